@@ -22,6 +22,9 @@
 #include "path_utils.h"
 #include "util.h"
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <lauxlib.h>
@@ -238,15 +241,9 @@ static bool unpack_package_subarchive(struct archive *a, const char *sub_name,
 	return success;
 }
 
-bool unpack_package(const char *package, const char *dir_path) {
-	archive_err_src = "Package unpack";
-	TRACE("Package unpack: %s", package);
-	struct archive *a = archive_read_new();
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
-	if (archive_read_open_filename(a, package, BUFSIZ) != ARCHIVE_OK)
-		return preserve_error(a, true);
-
+// Unpack package from given archive object. Archive is freed.
+static bool unpack_package_archive(struct archive *a, const char *package,
+		const char *dir_path) {
 	struct archive_entry *entry;
 	bool eof = false;
 	while (!eof) {
@@ -260,7 +257,7 @@ bool unpack_package(const char *package, const char *dir_path) {
 				WARN("libarchive: %s: %s", package, archive_error_string(a));
 				continue;
 			default:
-				DIE("Failed to get next header: %s", archive_error_string(a));
+				return preserve_error(a, true);
 		}
 		const char *path = archive_entry_pathname(entry);
 		// Valid path is with and without leading ./ so optionally skip it
@@ -284,6 +281,207 @@ bool unpack_package(const char *package, const char *dir_path) {
 	return true;
 }
 
+bool unpack_package(const char *package, const char *dir_path) {
+	archive_err_src = "Package unpack";
+	TRACE("Package unpack: %s", package);
+	struct archive *a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open_filename(a, package, BUFSIZ) != ARCHIVE_OK)
+		return preserve_error(a, true);
+	return unpack_package_archive(a, package, dir_path);
+}
+
+struct unpack_stream {
+	char *dir_path; // Directory package is unpacked to
+	FILE *f; // FILE object provided to user
+	pid_t pid; // PID of unpacking process (-1 if not yet started)
+	int data_fd; // Pipe to unpacking process with package data
+	int err_fd; // Pipe from unpacking process with error message
+	bool finished; // If stream was finished
+	bool success; // If unpack was successful (valid only if finished)
+	char *error; // Error message
+	struct unpack_stream *next, *prev; // List of running streams
+};
+
+// Streams with running unpacking process. Pipes of all of them have to be closed
+// in newly forked process otherwise they would never receive end of file.
+static struct unpack_stream *running_streams = NULL;
+
+static void unpack_stream_child(struct unpack_stream *stream) {
+	for (struct unpack_stream *s = running_streams; s; s = s->next) {
+		close(s->data_fd);
+		close(s->err_fd);
+	}
+	archive_err_src = "Package stream unpack";
+	struct archive *a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	bool success;
+	if (archive_read_open_fd(a, stream->data_fd, BUFSIZ) != ARCHIVE_OK)
+		success = preserve_error(a, true);
+	else
+		success = unpack_package_archive(a, stream->dir_path, stream->dir_path);
+	char *err = success ? NULL : archive_error();
+	if (err) {
+		size_t len = strlen(err), off = 0;
+		while (off < len) {
+			ssize_t ret = write(stream->err_fd, err + off, len - off);
+			if (ret > 0)
+				off += ret;
+			else if (errno != EINTR)
+				break;
+		}
+		free(err);
+	}
+	// Consume the rest of data (such as archive padding or failed part) so
+	// writer does not fail on closed pipe
+	char buf[BUFSIZ];
+	ssize_t rd;
+	do
+		rd = read(stream->data_fd, buf, BUFSIZ);
+	while (rd > 0 || (rd == -1 && errno == EINTR));
+	_exit(success ? 0 : 1);
+}
+
+static bool unpack_stream_start(struct unpack_stream *stream) {
+	TRACE("Starting package stream unpack to: %s", stream->dir_path);
+	int data_p[2], err_p[2];
+	if (pipe2(data_p, O_CLOEXEC))
+		return false;
+	if (pipe2(err_p, O_CLOEXEC)) {
+		close(data_p[0]);
+		close(data_p[1]);
+		return false;
+	}
+	fflush(NULL); // Prevent duplicate output of buffered data in child
+	pid_t pid = fork();
+	ASSERT_MSG(pid != -1, "Failed to fork package unpack process: %s", strerror(errno));
+	if (pid == 0) {
+		close(data_p[1]);
+		close(err_p[0]);
+		stream->data_fd = data_p[0];
+		stream->err_fd = err_p[1];
+		unpack_stream_child(stream);
+	}
+	close(data_p[0]);
+	close(err_p[1]);
+	stream->pid = pid;
+	stream->data_fd = data_p[1];
+	stream->err_fd = err_p[0];
+	stream->prev = NULL;
+	stream->next = running_streams;
+	if (running_streams)
+		running_streams->prev = stream;
+	running_streams = stream;
+	return true;
+}
+
+static ssize_t unpack_stream_write(void *cookie, const char *buf, size_t size) {
+	struct unpack_stream *stream = cookie;
+	if (stream->pid == -1 && !unpack_stream_start(stream))
+		return -1;
+	size_t written = 0;
+	while (written < size) {
+		ssize_t ret = write(stream->data_fd, buf + written, size - written);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return written > 0 ? (ssize_t)written : -1;
+		}
+		written += ret;
+	}
+	return size;
+}
+
+static int unpack_stream_close(void *cookie) {
+	struct unpack_stream *stream = cookie;
+	if (stream->pid == -1) {
+		stream->error = strdup("Package stream unpack failed: no data received");
+		return EOF;
+	}
+	close(stream->data_fd);
+	// Collect error message (empty on success)
+	size_t size = 0, len = 0;
+	char *err = NULL;
+	ssize_t ret;
+	do {
+		if (size <= (len + 1))
+			err = realloc(err, (size += BUFSIZ) * sizeof *err);
+		ret = read(stream->err_fd, err + len, size - len - 1);
+		if (ret > 0)
+			len += ret;
+	} while (ret > 0 || (ret == -1 && errno == EINTR));
+	err[len] = '\0';
+	close(stream->err_fd);
+	int wstatus;
+	while (waitpid(stream->pid, &wstatus, 0) == -1)
+		ASSERT_MSG(errno == EINTR, "Failed to wait for package unpack process: %s", strerror(errno));
+
+	if (stream->prev)
+		stream->prev->next = stream->next;
+	else
+		running_streams = stream->next;
+	if (stream->next)
+		stream->next->prev = stream->prev;
+
+	if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+		free(err);
+		return 0;
+	}
+	if (len == 0) {
+		free(err);
+		err = strdup("Package stream unpack failed: unpacking process terminated unexpectedly");
+	}
+	stream->error = err;
+	return EOF;
+}
+
+static const cookie_io_functions_t unpack_stream_io_funcs = {
+	.write = unpack_stream_write,
+	.close = unpack_stream_close
+};
+
+struct unpack_stream *unpack_package_stream(const char *dir_path) {
+	struct unpack_stream *stream = malloc(sizeof *stream);
+	*stream = (struct unpack_stream) {
+		.dir_path = strdup(dir_path),
+		.pid = -1,
+		.data_fd = -1,
+		.err_fd = -1,
+		.finished = false,
+		.success = false,
+		.error = NULL,
+	};
+	stream->f = fopencookie(stream, "w", unpack_stream_io_funcs);
+	return stream;
+}
+
+FILE *unpack_stream_file(struct unpack_stream *stream) {
+	ASSERT_MSG(!stream->finished, "Unpack stream file requested after stream was finished");
+	return stream->f;
+}
+
+bool unpack_stream_finish(struct unpack_stream *stream) {
+	if (!stream->finished) {
+		stream->success = fclose(stream->f) == 0;
+		stream->f = NULL;
+		stream->finished = true;
+	}
+	return stream->success;
+}
+
+const char *unpack_stream_error(struct unpack_stream *stream) {
+	return stream->error;
+}
+
+void unpack_stream_free(struct unpack_stream *stream) {
+	unpack_stream_finish(stream);
+	free(stream->dir_path);
+	free(stream->error);
+	free(stream);
+}
+
 
 // Lua interface /////////////////////////////////////////////////////////////////
 
@@ -52,6 +52,35 @@ FILE *decompress(FILE *f, int flags) __attribute__((nonnull));
 bool unpack_package(const char *package, const char *dir_path)
 	__attribute__((nonnull));
 
+// Package unpack stream
+struct unpack_stream;
+
+// Create new stream unpacking package as it is written to it. This is the same
+// as unpack_package but data are consumed as they arrive so package does not
+// have to be stored to file system first. Unpacking runs in separate process
+// started on first write.
+//
+// dir_path: directory to unpack package to
+//
+// Returns unpack stream. Use unpack_stream_file to get FILE to write package to.
+struct unpack_stream *unpack_package_stream(const char *dir_path)
+	__attribute__((nonnull));
+
+// Returns FILE object package data should be written to. Do not close it, use
+// unpack_stream_finish instead.
+FILE *unpack_stream_file(struct unpack_stream*) __attribute__((nonnull));
+
+// Finish unpack. This waits for unpacking process to finish.
+// Returns true on success and false on failure. On failure you can use
+// unpack_stream_error to receive failure message.
+bool unpack_stream_finish(struct unpack_stream*) __attribute__((nonnull));
+
+// Returns error message describing failure of unpack or NULL if there is none.
+const char *unpack_stream_error(struct unpack_stream*) __attribute__((nonnull));
+
+// Free unpack stream. Stream is finished if it was not already.
+void unpack_stream_free(struct unpack_stream*) __attribute__((nonnull));
+
 
 // Create unpack module and inject it into the lua state
 void archive_mod_init(lua_State *L) __attribute__((nonnull));
@@ -20,6 +20,7 @@
 #include "util.h"
 #include "syscnf.h"
 #include "logging.h"
+#include "opmode.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -34,17 +35,17 @@
 
 const char *argp_program_bug_address = PACKAGE_BUGREPORT;
 
-/* // Use this as template when ever we need option symbols. Reserved range is 260-300
+// Reserved range is 260-300
 enum option_val {
-	OPT_ = 260,
+	OPT_PKG_DB = 260,
 };
-*/
 
 static struct argp_option options[] = {
 	{"root", 'R', "PATH", 0, "Use given PATH as a root directory. Consider also using --out-of-root option.", 50},
 	{"stderr-level", 'e', "LEVEL", 0, "What level of messages to send to stderr (DISABLE/ERROR/WARN/INFO/DBG).", 51},
 	{"syslog-level", 's', "LEVEL", 0, "What level of messages to send to syslog (DISABLE/ERROR/WARN/INFO/DBG).", 51},
 	{"syslog-name", 'S', "NAME", 0, "Under which name messages are sent to syslog.", 51},
+	{"pkg-db", OPT_PKG_DB, NULL, 0, "Keep installed packages also in binary package database and read it instead of status file and control files of packages while they are not modified.", 52},
 	{NULL}
 };
 
@@ -70,6 +71,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		case 'S':
 			log_syslog_name(arg);
 			break;
+		case OPT_PKG_DB:
+			opmode_set(OPMODE_PKG_DB);
+			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
 	};
@@ -0,0 +1,579 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "control.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "logging.h"
+#include "inject.h"
+#include "archive.h"
+
+static const char *error_messages[] = {
+	[CONTROL_E_CONTINUATION] = "Continuation at the beginning of block",
+	[CONTROL_E_MALFORMED] = "Malformed line",
+};
+
+void control_parser_init(struct control_parser *p, const char *buf, size_t len) {
+	*p = (struct control_parser) {
+		.buf = buf,
+		.len = len,
+		.pos = 0,
+		.in_block = false,
+	};
+}
+
+// Returns end of line starting on given position (position of '\n' or end of buffer)
+static size_t line_end(const struct control_parser *p, size_t pos) {
+	const char *end = memchr(p->buf + pos, '\n', p->len - pos);
+	return end ? (size_t)(end - p->buf) : p->len;
+}
+
+static enum control_token parse_error(struct control_parser *p, enum control_error err, size_t end) {
+	p->err = err;
+	p->err_line = p->buf + p->pos;
+	p->err_line_len = end - p->pos;
+	return CONTROL_T_ERROR;
+}
+
+enum control_token control_next(struct control_parser *p, struct control_field *field) {
+	// Skip empty lines. They terminate block if we are in some.
+	while (p->pos < p->len && p->buf[p->pos] == '\n') {
+		p->pos++;
+		if (p->in_block) {
+			p->in_block = false;
+			return CONTROL_T_BLOCK_END;
+		}
+	}
+	if (p->pos >= p->len) {
+		if (p->in_block) {
+			p->in_block = false;
+			return CONTROL_T_BLOCK_END;
+		}
+		return CONTROL_T_END;
+	}
+
+	const char *line = p->buf + p->pos;
+	size_t end = line_end(p, p->pos);
+	size_t len = end - p->pos;
+	// Continuations are consumed with their field so this one has no field
+	if (isspace((unsigned char)line[0]))
+		return parse_error(p, CONTROL_E_CONTINUATION, end);
+	// Name is terminated by last colon in first word of line
+	size_t word = 0;
+	while (word < len && !isspace((unsigned char)line[word]))
+		word++;
+	const char *colon = NULL;
+	for (size_t i = word; i > 1 && !colon; i--)
+		if (line[i - 1] == ':')
+			colon = line + i - 1;
+	if (!colon)
+		return parse_error(p, CONTROL_E_MALFORMED, end);
+	field->name = line;
+	field->name_len = colon - line;
+	const char *value = colon + 1;
+	while (value < line + len && isspace((unsigned char)*value))
+		value++;
+	// Join all following continuation lines
+	while (end + 1 < p->len && p->buf[end + 1] != '\n' && isspace((unsigned char)p->buf[end + 1]))
+		end = line_end(p, end + 1);
+	field->value = value;
+	field->value_len = p->buf + end - value;
+
+	p->pos = end < p->len ? end + 1 : end;
+	p->in_block = true;
+	return CONTROL_T_FIELD;
+}
+
+const char *control_error_msg(enum control_error err) {
+	return error_messages[err];
+}
+
+// Lua interface /////////////////////////////////////////////////////////////////
+
+// Raise Lua error for parser that reported CONTROL_T_ERROR
+static int lua_parse_error(lua_State *L, struct control_parser *p) {
+	lua_pushstring(L, control_error_msg(p->err));
+	lua_pushstring(L, ": ");
+	lua_pushlstring(L, p->err_line, p->err_line_len);
+	lua_concat(L, 3);
+	return lua_error(L);
+}
+
+// Parse fields to table on top of the stack till end of block or input.
+// Returns token that terminated parsing.
+static enum control_token lua_parse_fields(lua_State *L, struct control_parser *p, bool whole) {
+	struct control_field field;
+	enum control_token token;
+	while ((token = control_next(p, &field)) == CONTROL_T_FIELD ||
+			(whole && token == CONTROL_T_BLOCK_END)) {
+		if (token != CONTROL_T_FIELD)
+			continue;
+		lua_pushlstring(L, field.name, field.name_len);
+		lua_pushlstring(L, field.value, field.value_len);
+		lua_rawset(L, -3);
+	}
+	if (token == CONTROL_T_ERROR)
+		lua_parse_error(L, p);
+	return token;
+}
+
+static int lua_parse(lua_State *L) {
+	size_t len;
+	const char *text = luaL_checklstring(L, 1, &len);
+	struct control_parser p;
+	control_parser_init(&p, text, len);
+	lua_newtable(L);
+	lua_parse_fields(L, &p, true);
+	return 1;
+}
+
+static int lua_blocks_next(lua_State *L) {
+	struct control_parser *p = lua_touserdata(L, lua_upvalueindex(2));
+	lua_newtable(L);
+	if (lua_parse_fields(L, p, false) == CONTROL_T_END)
+		return 0;
+	return 1;
+}
+
+static int lua_blocks(lua_State *L) {
+	size_t len;
+	const char *text = luaL_checklstring(L, 1, &len);
+	lua_pushvalue(L, 1); // Keep string referenced as long as iterator exists
+	struct control_parser *p = lua_newuserdata(L, sizeof *p);
+	control_parser_init(p, text, len);
+	lua_pushcclosure(L, lua_blocks_next, 2);
+	return 1;
+}
+
+// Upvalues of lazy records metatable functions
+#define LAZY_TEXT lua_upvalueindex(1) // Parsed text
+#define LAZY_OFFSETS lua_upvalueindex(2) // Offsets of not materialized records (weak)
+#define LAZY_EAGER lua_upvalueindex(3) // Set of eagerly decoded fields
+#define LAZY_POSTPROCESS lua_upvalueindex(4) // Function called on materialized record
+
+// Returns if field of given name is in set on given index
+static bool lazy_is_eager(lua_State *L, int eager, const struct control_field *field) {
+	lua_pushlstring(L, field->name, field->name_len);
+	lua_rawget(L, eager);
+	bool result = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+// Parse block starting on given offset to table on top of the stack. Only eager
+// or only lazy fields are set. Block is known to be valid as it was parsed already.
+static void lazy_parse_block(lua_State *L, size_t offset, bool eager) {
+	size_t len;
+	const char *text = lua_tolstring(L, LAZY_TEXT, &len);
+	struct control_parser p;
+	control_parser_init(&p, text + offset, len - offset);
+	struct control_field field;
+	while (control_next(&p, &field) == CONTROL_T_FIELD) {
+		if (lazy_is_eager(L, LAZY_EAGER, &field) != eager)
+			continue;
+		lua_pushlstring(L, field.name, field.name_len);
+		lua_pushlstring(L, field.value, field.value_len);
+		lua_rawset(L, -3);
+	}
+}
+
+// Push offset of not yet materialized record on given index. Returns false if
+// record is already materialized.
+static bool lazy_offset(lua_State *L, int record, size_t *offset) {
+	lua_pushvalue(L, record);
+	lua_rawget(L, LAZY_OFFSETS);
+	bool valid = !lua_isnil(L, -1);
+	*offset = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return valid;
+}
+
+// Returns if block starting on given offset has field of given name. Values are
+// not decoded.
+static bool lazy_has_field(lua_State *L, size_t offset, const char *name, size_t name_len) {
+	size_t len;
+	const char *text = lua_tolstring(L, LAZY_TEXT, &len);
+	struct control_parser p;
+	control_parser_init(&p, text + offset, len - offset);
+	struct control_field field;
+	while (control_next(&p, &field) == CONTROL_T_FIELD)
+		if (field.name_len == name_len && !memcmp(field.name, name, name_len))
+			return true;
+	return false;
+}
+
+// Materialize rest of the record on first access to lazy field. Eager fields
+// and keys that are not fields of record (such as deps) are never decoded.
+static int lua_lazy_index(lua_State *L) {
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return 0;
+	lua_pushvalue(L, 2);
+	lua_rawget(L, LAZY_EAGER);
+	bool eager = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	size_t offset;
+	if (eager || !lazy_offset(L, 1, &offset))
+		return 0;
+	size_t key_len;
+	const char *key = lua_tolstring(L, 2, &key_len);
+	if (!lazy_has_field(L, offset, key, key_len))
+		return 0;
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, LAZY_OFFSETS);
+	lua_pushvalue(L, 1);
+	lazy_parse_block(L, offset, false);
+	lua_pop(L, 1);
+	if (!lua_isnil(L, LAZY_POSTPROCESS)) {
+		lua_pushvalue(L, LAZY_POSTPROCESS);
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 0);
+	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 1);
+	return 1;
+}
+
+// Returns new table with all fields of record without materializing it
+static int lua_lazy_fields(lua_State *L) {
+	size_t offset;
+	if (!lazy_offset(L, 1, &offset))
+		return 0;
+	lua_newtable(L);
+	lazy_parse_block(L, offset, true);
+	lazy_parse_block(L, offset, false);
+	return 1;
+}
+
+static int lua_lazy_blocks_next(lua_State *L) {
+	struct control_parser *p = lua_touserdata(L, lua_upvalueindex(5));
+	lua_newtable(L);
+	int record = lua_gettop(L);
+	struct control_field field;
+	enum control_token token;
+	// Skip leading empty lines so offset points to first field
+	while (p->pos < p->len && p->buf[p->pos] == '\n')
+		p->pos++;
+	size_t offset = p->pos;
+	while ((token = control_next(p, &field)) == CONTROL_T_FIELD) {
+		if (!lazy_is_eager(L, LAZY_EAGER, &field))
+			continue;
+		lua_pushlstring(L, field.name, field.name_len);
+		lua_pushlstring(L, field.value, field.value_len);
+		lua_rawset(L, record);
+	}
+	if (token == CONTROL_T_ERROR)
+		lua_parse_error(L, p);
+	if (token == CONTROL_T_END)
+		return 0;
+	lua_pushvalue(L, record);
+	lua_pushinteger(L, offset);
+	lua_rawset(L, LAZY_OFFSETS);
+	lua_pushvalue(L, lua_upvalueindex(6));
+	lua_setmetatable(L, record);
+	return 1;
+}
+
+// Push upvalues of lazy records metatable functions (in order of LAZY_* indexes)
+// followed by metatable of records. Arguments are absolute stack indexes of
+// text, array of eagerly decoded fields and postprocess function.
+static void lazy_push_meta(lua_State *L, int text, int fields, int postprocess) {
+	int base = lua_gettop(L) + 1;
+	lua_pushvalue(L, text); // LAZY_TEXT
+	lua_newtable(L); // LAZY_OFFSETS
+	lua_newtable(L);
+	lua_pushstring(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_newtable(L); // LAZY_EAGER
+	size_t cnt = lua_objlen(L, fields);
+	for (size_t i = 1; i <= cnt; i++) {
+		lua_rawgeti(L, fields, i);
+		lua_pushboolean(L, true);
+		lua_rawset(L, -3);
+	}
+	lua_pushvalue(L, postprocess); // LAZY_POSTPROCESS
+	// Metatable of records
+	lua_newtable(L);
+	for (int i = base; i < base + 4; i++)
+		lua_pushvalue(L, i);
+	lua_pushcclosure(L, lua_lazy_index, 4);
+	lua_setfield(L, -2, "__index");
+	for (int i = base; i < base + 4; i++)
+		lua_pushvalue(L, i);
+	lua_pushcclosure(L, lua_lazy_fields, 4);
+	lua_setfield(L, -2, "__fields");
+}
+
+static int lua_lazy_blocks(lua_State *L) {
+	luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+	lazy_push_meta(L, 1, 2, 3);
+	// Iterator
+	size_t len;
+	const char *text = lua_tolstring(L, 1, &len);
+	struct control_parser *p = lua_newuserdata(L, sizeof *p);
+	control_parser_init(p, text, len);
+	lua_insert(L, -2);
+	lua_pushcclosure(L, lua_lazy_blocks_next, 6);
+	return 1;
+}
+
+// Text prepared for lazy_blocks in background thread. Thread decompresses text
+// (if it is compressed) and locates blocks and their eager fields. Lua tables
+// can't be created outside of Lua thread so that is left to lazy_blocks.
+#define PREPARED_META "updater_control_prepared_meta"
+
+struct prepared_field {
+	size_t name, name_len, value, value_len; // Slices of text
+};
+
+struct prepared_block {
+	size_t offset; // Offset of block in text
+	size_t fields_end; // Index of first field of next block in fields array
+};
+
+struct prepared {
+	pthread_t thread;
+	bool running; // If thread was started and not yet joined
+	const char *input; // Text to be prepared (string in userdata environment)
+	size_t input_len;
+	char *data; // Decompressed input (NULL if input is not compressed)
+	size_t len;
+	const char **eager; // Names of eager fields (strings in userdata environment)
+	size_t *eager_len;
+	size_t eager_cnt;
+	struct prepared_block *blocks;
+	size_t blocks_cnt, blocks_size;
+	struct prepared_field *fields;
+	size_t fields_cnt, fields_size;
+	char *error; // Error message if preparation failed
+};
+
+static bool prepared_decompress(struct prepared *p) {
+	FILE *f = decompress(fmemopen((void*)p->input, p->input_len, "rb"), ARCHIVE_AUTOCLOSE);
+	if (f == NULL) {
+		p->error = archive_error();
+		return false;
+	}
+	size_t size = 0;
+	do {
+		if (size == p->len)
+			p->data = realloc(p->data, size = size ? 2 * size : 4 * p->input_len + BUFSIZ);
+		p->len += fread(p->data + p->len, 1, size - p->len, f);
+	} while (!feof(f) && !ferror(f));
+	bool ok = !ferror(f);
+	if (!ok && !(p->error = archive_error()))
+		p->error = strdup("Decompression of text failed");
+	fclose(f);
+	return ok;
+}
+
+static bool prepared_is_eager(const struct prepared *p, const struct control_field *field) {
+	for (size_t i = 0; i < p->eager_cnt; i++)
+		if (p->eager_len[i] == field->name_len && !memcmp(p->eager[i], field->name, field->name_len))
+			return true;
+	return false;
+}
+
+static void *prepared_thread(void *arg) {
+	struct prepared *p = arg;
+	const char *text = p->input;
+	size_t len = p->input_len;
+	if (len >= 2 && (unsigned char)text[0] == 0x1F && (unsigned char)text[1] == 0x8B) {
+		// gzip compressed text
+		if (!prepared_decompress(p))
+			return NULL;
+		text = p->data;
+		len = p->len;
+	}
+	struct control_parser parser;
+	control_parser_init(&parser, text, len);
+	struct control_field field;
+	enum control_token token;
+	while (true) {
+		// Skip leading empty lines so offset points to first field
+		while (parser.pos < parser.len && parser.buf[parser.pos] == '\n')
+			parser.pos++;
+		size_t offset = parser.pos;
+		while ((token = control_next(&parser, &field)) == CONTROL_T_FIELD) {
+			if (!prepared_is_eager(p, &field))
+				continue;
+			if (p->fields_cnt == p->fields_size)
+				p->fields = realloc(p->fields, (p->fields_size = 2 * p->fields_size + 64) * sizeof *p->fields);
+			p->fields[p->fields_cnt++] = (struct prepared_field) {
+				.name = field.name - text,
+				.name_len = field.name_len,
+				.value = field.value - text,
+				.value_len = field.value_len,
+			};
+		}
+		if (token == CONTROL_T_ERROR) {
+			asprintf(&p->error, "%s: %.*s", control_error_msg(parser.err),
+					(int)parser.err_line_len, parser.err_line);
+			break;
+		}
+		if (token == CONTROL_T_END)
+			break;
+		if (p->blocks_cnt == p->blocks_size)
+			p->blocks = realloc(p->blocks, (p->blocks_size = 2 * p->blocks_size + 64) * sizeof *p->blocks);
+		p->blocks[p->blocks_cnt++] = (struct prepared_block) {
+			.offset = offset,
+			.fields_end = p->fields_cnt,
+		};
+	}
+	return NULL;
+}
+
+static void prepared_join(struct prepared *p) {
+	if (p->running) {
+		ASSERT(!pthread_join(p->thread, NULL));
+		p->running = false;
+	}
+}
+
+static int lua_prepare(lua_State *L) {
+	luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	struct prepared *p = lua_newuserdata(L, sizeof *p);
+	*p = (struct prepared) { .running = false };
+	luaL_getmetatable(L, PREPARED_META);
+	lua_setmetatable(L, -2);
+	// Strings used by thread are referenced from environment so they stay valid
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	size_t cnt = lua_objlen(L, 2);
+	lua_createtable(L, cnt, 0);
+	p->eager = malloc(cnt * sizeof *p->eager);
+	p->eager_len = malloc(cnt * sizeof *p->eager_len);
+	for (size_t i = 1; i <= cnt; i++) {
+		lua_rawgeti(L, 2, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			return luaL_error(L, "Field names have to be strings");
+		p->eager[p->eager_cnt] = lua_tolstring(L, -1, &p->eager_len[p->eager_cnt]);
+		p->eager_cnt++;
+		lua_rawseti(L, -2, i);
+	}
+	lua_rawseti(L, -2, 2);
+	lua_setfenv(L, -2);
+	p->input = lua_tolstring(L, 1, &p->input_len);
+	if (pthread_create(&p->thread, NULL, prepared_thread, p) == 0)
+		p->running = true;
+	else {
+		WARN("Unable to start thread to prepare text, preparing it directly");
+		prepared_thread(p);
+	}
+	return 1;
+}
+
+static int lua_prepared_blocks_next(lua_State *L) {
+	struct prepared *p = lua_touserdata(L, lua_upvalueindex(5));
+	size_t i = lua_tointeger(L, lua_upvalueindex(7));
+	if (i >= p->blocks_cnt) {
+		if (p->error) {
+			lua_pushstring(L, p->error);
+			return lua_error(L);
+		}
+		return 0;
+	}
+	lua_pushinteger(L, i + 1);
+	lua_replace(L, lua_upvalueindex(7));
+	const char *text = lua_tostring(L, LAZY_TEXT);
+	lua_newtable(L);
+	for (size_t f = i ? p->blocks[i - 1].fields_end : 0; f < p->blocks[i].fields_end; f++) {
+		lua_pushlstring(L, text + p->fields[f].name, p->fields[f].name_len);
+		lua_pushlstring(L, text + p->fields[f].value, p->fields[f].value_len);
+		lua_rawset(L, -3);
+	}
+	lua_pushvalue(L, -1);
+	lua_pushinteger(L, p->blocks[i].offset);
+	lua_rawset(L, LAZY_OFFSETS);
+	lua_pushvalue(L, lua_upvalueindex(6));
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int lua_prepared_lazy_blocks(lua_State *L) {
+	struct prepared *p = luaL_checkudata(L, 1, PREPARED_META);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+	prepared_join(p);
+	lua_getfenv(L, 1);
+	if (p->data) {
+		// Decompressed text replaces input so it can be collected
+		lua_pushlstring(L, p->data, p->len);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, 3, 1);
+		free(p->data);
+		p->data = NULL;
+	} else
+		lua_rawgeti(L, 3, 1);
+	lua_rawgeti(L, 3, 2);
+	lazy_push_meta(L, 4, 5, 2);
+	// Iterator
+	lua_pushvalue(L, 1);
+	lua_insert(L, -2);
+	lua_pushinteger(L, 0); // Index of next block
+	lua_pushcclosure(L, lua_prepared_blocks_next, 7);
+	return 1;
+}
+
+static int lua_prepared_gc(lua_State *L) {
+	struct prepared *p = luaL_checkudata(L, 1, PREPARED_META);
+	prepared_join(p);
+	free(p->data);
+	free(p->eager);
+	free(p->eager_len);
+	free(p->blocks);
+	free(p->fields);
+	free(p->error);
+	return 0;
+}
+
+static const struct inject_func funcs[] = {
+	{ lua_parse, "parse" },
+	{ lua_blocks, "blocks" },
+	{ lua_lazy_blocks, "lazy_blocks" },
+	{ lua_prepare, "prepare" },
+};
+
+static const struct inject_func prepared_meta[] = {
+	{ lua_prepared_lazy_blocks, "lazy_blocks" },
+	{ lua_prepared_gc, "__gc" },
+};
+
+void control_mod_init(lua_State *L) {
+	TRACE("control module init");
+	lua_newtable(L);
+	inject_func_n(L, "control", funcs, sizeof funcs / sizeof *funcs);
+	lua_pushvalue(L, -1);
+	lua_setmetatable(L, -2);
+	inject_module(L, "control");
+	inject_metatable_self_index(L, PREPARED_META);
+	inject_func_n(L, PREPARED_META, prepared_meta, sizeof prepared_meta / sizeof *prepared_meta);
+}
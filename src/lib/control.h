@@ -0,0 +1,76 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UPDATER_CONTROL_H
+#define UPDATER_CONTROL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua.h>
+
+// Parser of control file format (mail-header-like records) used by package
+// control files, repository indexes (Packages) and status file. Blocks of fields
+// are separated by empty lines. Field has format "Name: value" and value can
+// continue on following lines if they start with white space.
+
+enum control_token {
+	CONTROL_T_FIELD, // Field was parsed
+	CONTROL_T_BLOCK_END, // End of block
+	CONTROL_T_END, // End of input
+	CONTROL_T_ERROR, // Malformed input
+};
+
+enum control_error {
+	CONTROL_E_CONTINUATION, // Continuation line at the beginning of block
+	CONTROL_E_MALFORMED, // Line that is neither field nor continuation
+};
+
+struct control_parser {
+	const char *buf;
+	size_t len;
+	size_t pos; // Start of next line to be parsed
+	bool in_block; // If some field of current block was already parsed
+	enum control_error err; // Error (valid only after CONTROL_T_ERROR)
+	const char *err_line; // Offending line (not terminated, valid only after CONTROL_T_ERROR)
+	size_t err_line_len;
+};
+
+// Parsed field. Strings point to parsed buffer and are not terminated.
+// Value of field with continuation lines contains them including line breaks.
+struct control_field {
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+};
+
+// Initialize parser for given buffer. Buffer has to be valid as long as parser
+// and parsed fields are used.
+void control_parser_init(struct control_parser*, const char *buf, size_t len) __attribute__((nonnull(1)));
+
+// Parse next field. Field is filled in only if CONTROL_T_FIELD is returned.
+// CONTROL_T_BLOCK_END is returned only for blocks with at least one field.
+enum control_token control_next(struct control_parser*, struct control_field*) __attribute__((nonnull));
+
+// Returns error message for given parser error.
+const char *control_error_msg(enum control_error);
+
+
+// Create control module and inject it into the lua state
+void control_mod_init(lua_State *L) __attribute__((nonnull));
+
+#endif
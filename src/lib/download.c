@@ -23,8 +23,14 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
 #include "syscnf.h"
 
 // Initial size of storage buffer
@@ -34,34 +40,272 @@
 
 #define ASSERT_CURL(X) ASSERT((X) == CURLE_OK)
 #define ASSERT_CURLM(X) ASSERT((X) == CURLM_OK)
+#define ASSERT_CURLSH(X) ASSERT((X) == CURLSHE_OK)
+
+// Relative throughput change considered significant by adaptive limit
+#define ADAPTIVE_THRESHOLD 0.1
 
 struct downloader {
 	struct event_base *ebase; // libevent base
 	CURLM *cmulti; // Curl multi instance
+	CURLSH *cshare; // Curl share instance (DNS cache and TLS sessions)
+	struct download_store *stores; // Cached certificate stores for sets of PEMs
 	struct event *ctimer; // Timer used by curl
 
-	struct download_i **instances; // Registered instances
-	size_t i_size, i_allocated; // instances size and allocated size
+	int total_limit; // Limit of all connections (upper bound in adaptive mode)
+	int host_limit; // Limit of connections to single host (0 for no limit)
+	bool adaptive; // If limit of all connections is adjusted according to throughput
+	struct {
+		int limit; // Current limit of all connections
+		int step; // Direction limit is adjusted in (+1 or -1)
+		int done; // Number of finished downloads in current window
+		int64_t size; // Number of bytes received in current window
+		int64_t start; // Start of current window (microseconds)
+		double rate; // Throughput measured in previous window (bytes per second)
+	} adapt;
+
+	struct download_i *instances; // Registered instances (doubly linked list)
 	int pending; // Number of still not downloaded instances
 	struct download_i *failed; // Latest failed instance (used internally)
+	struct download_i *notified; // Latest finished instance with notify (used internally)
 };
 
 struct download_i {
 	bool done; // If download is finished
 	bool success; // If download was successful. Not valid if done is false.
+	bool not_modified; // If server reported that content was not modified
+	long response_code; // Last received response code
+	struct download_stats stats; // Transfer statistics
 	char error[CURL_ERROR_SIZE]; // error message if download fails
+	char *etag; // ETag received from server
+	long last_modified; // Modification time received from server
+	bool hash; // If sums of received data are computed
+	long resume; // Offset download was requested to be resumed from
+	bool resumed; // If server accepted resume request
+	bool started; // If data reception started
+	void (*start_callback)(download_i_t, void *data);
+	void *start_callback_data;
+	struct download_race *race; // Race this download participates in
+	struct download_i *race_next; // Next participant of same race
+	struct download_race *lead_race; // Race of download this one follows
+	struct download_i *lead; // Download this one follows (only compared, might be freed)
+	bool cancelled; // If download was cancelled because it lost race
+	bool notify; // If downloader_run should return on successful finish
+	MD5_CTX md5;
+	SHA256_CTX sha256;
+	uint8_t md5_sum[MD5_DIGEST_LENGTH];
+	uint8_t sha256_sum[SHA256_DIGEST_LENGTH];
 
 	struct downloader *downloader; // parent downloader
+	struct download_i *prev, *next; // Neighbours in list of downloader's instances
 	FILE *output;
 	CURL *curl; // easy curl session
+	struct curl_slist *headers; // additional HTTP headers
 	download_pem_t *pems;
 };
 
 struct download_pem {
 	BIO *cbio;
 	STACK_OF(X509_INFO) *info;
+	uint8_t digest[SHA256_DIGEST_LENGTH]; // Digest of PEM used to identify it
+};
+
+struct download_race {
+	unsigned refs; // Reference count
+	struct download_i *participants; // Linked list of participants
+	struct download_i *winner;
+};
+
+// Certificate store build from set of PEMs
+struct download_store {
+	size_t cnt; // Number of PEMs
+	uint8_t (*digests)[SHA256_DIGEST_LENGTH]; // Digests of PEMs store was build from
+	X509_STORE *store;
+	CURLSH *share; // Connections and TLS sessions verified with these PEMs
+	struct download_store *next;
 };
 
+// Feed data that are already in output to sums (used when download is resumed)
+static bool download_hash_output(struct download_i *inst) {
+	int fd = fileno(inst->output);
+	uint8_t buf[BUFSIZ];
+	off_t off = 0;
+	while (off < inst->resume) {
+		size_t toread = inst->resume - off < BUFSIZ ? inst->resume - off : BUFSIZ;
+		ssize_t rd = pread(fd, buf, toread, off);
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			return false;
+		MD5_Update(&inst->md5, buf, rd);
+		SHA256_Update(&inst->sha256, buf, rd);
+		off += rd;
+	}
+	return true;
+}
+
+// Mark given instance as winner of its race if there is no winner yet. Other
+// participants are aborted by their callbacks (curl does not allow removal of
+// handles from callbacks).
+static void download_race_win(struct download_i *inst) {
+	if (!inst->race || inst->race->winner)
+		return;
+	char *url;
+	ASSERT_CURL(curl_easy_getinfo(inst->curl, CURLINFO_EFFECTIVE_URL, &url));
+	DBG("Download won race (%s)", url);
+	inst->race->winner = inst;
+}
+
+// Check if download this instance follows lost its race.
+static bool download_lead_lost(struct download_i *inst) {
+	return inst->lead_race && inst->lead_race->winner && inst->lead_race->winner != inst->lead;
+}
+
+// Check if given instance should be aborted as it or download it follows lost race.
+static bool download_race_abort(struct download_i *inst) {
+	if (inst->race && inst->race->winner && inst->race->winner != inst)
+		return true;
+	return download_lead_lost(inst);
+}
+
+// Check if given instance lost its race. That is if there is some other winner or
+// at least some other participant that still has chance to win. Instance also
+// lost if download it follows lost.
+static bool download_race_lost(struct download_i *inst) {
+	if (download_lead_lost(inst))
+		return true;
+	if (!inst->race || inst->race->winner == inst)
+		return false;
+	if (inst->race->winner)
+		return true;
+	for (struct download_i *p = inst->race->participants; p; p = p->race_next)
+		if (!p->done)
+			return true;
+	return false;
+}
+
+// Called on first received data
+static bool download_data_start(struct download_i *inst) {
+	char *url;
+	ASSERT_CURL(curl_easy_getinfo(inst->curl, CURLINFO_EFFECTIVE_URL, &url));
+	ASSERT_CURL(curl_easy_getinfo(inst->curl, CURLINFO_FILETIME, &inst->last_modified));
+	if (inst->resume > 0) {
+		long code;
+		ASSERT_CURL(curl_easy_getinfo(inst->curl, CURLINFO_RESPONSE_CODE, &code));
+		fflush(inst->output);
+		if (code == 206) {
+			DBG("(%s) Resuming download from: %ld", url, inst->resume);
+			inst->resumed = true;
+			if (inst->hash && !download_hash_output(inst)) {
+				ERROR("(%s) Unable to read partially downloaded data: %s", url, strerror(errno));
+				return false;
+			}
+		} else {
+			// Server sends whole content again so drop what we have
+			DBG("(%s) Resume rejected by server, downloading from start", url);
+			if (ftruncate(fileno(inst->output), 0) || fseek(inst->output, 0, SEEK_SET)) {
+				ERROR("(%s) Unable to drop partially downloaded data: %s", url, strerror(errno));
+				return false;
+			}
+		}
+	}
+	if (inst->start_callback)
+		inst->start_callback(inst, inst->start_callback_data);
+	return true;
+}
+
+// Monotonic time in microseconds
+static int64_t download_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void download_collect_stats(struct download_i *inst) {
+	curl_off_t val;
+#define STAT(INFO, FIELD) do { \
+		ASSERT_CURL(curl_easy_getinfo(inst->curl, INFO, &val)); \
+		inst->stats.FIELD = val; \
+	} while (false)
+	STAT(CURLINFO_SIZE_DOWNLOAD_T, size);
+	STAT(CURLINFO_CONNECT_TIME_T, connect_time);
+	STAT(CURLINFO_APPCONNECT_TIME_T, tls_time);
+	STAT(CURLINFO_STARTTRANSFER_TIME_T, first_byte_time);
+	STAT(CURLINFO_TOTAL_TIME_T, total_time);
+	STAT(CURLINFO_SPEED_DOWNLOAD_T, speed);
+#undef STAT
+	inst->stats.finish = download_now();
+	inst->stats.start = inst->stats.finish - inst->stats.total_time;
+}
+
+// Drop partially received content and request whole content again. This is used
+// when server refuses to resume download (If-Range did not match or range is not
+// satisfiable).
+static bool download_restart(struct download_i *inst) {
+	char *url;
+	ASSERT_CURL(curl_easy_getinfo(inst->curl, CURLINFO_EFFECTIVE_URL, &url));
+	DBG("(%s) Resume rejected by server (%ld), downloading from start", url, inst->response_code);
+	if (ftruncate(fileno(inst->output), 0) || fseek(inst->output, 0, SEEK_SET)) {
+		ERROR("(%s) Unable to drop partially downloaded data: %s", url, strerror(errno));
+		return false;
+	}
+	inst->resume = 0;
+	inst->done = false;
+	inst->response_code = 0;
+	free(inst->etag);
+	inst->etag = NULL;
+	// Handle has to be re-added to multi to be performed again. If-Range header
+	// is ignored by server when there is no Range so it can stay.
+	ASSERT_CURLM(curl_multi_remove_handle(inst->downloader->cmulti, inst->curl));
+	ASSERT_CURL(curl_easy_setopt(inst->curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0));
+	ASSERT_CURLM(curl_multi_add_handle(inst->downloader->cmulti, inst->curl));
+	return true;
+}
+
+static void download_apply_limit(struct downloader *d) {
+	int limit = d->adaptive ? d->adapt.limit : d->total_limit;
+	ASSERT_CURLM(curl_multi_setopt(d->cmulti, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)limit));
+	ASSERT_CURLM(curl_multi_setopt(d->cmulti, CURLMOPT_MAX_HOST_CONNECTIONS, (long)d->host_limit));
+}
+
+static void download_adapt_reset(struct downloader *d) {
+	d->adapt.done = 0;
+	d->adapt.size = 0;
+	d->adapt.start = download_now();
+}
+
+// Account finished download and adjust limit of connections if enough data was
+// collected. Throughput of every window of finished downloads is compared with
+// previous one. Limit is moved further in same direction as long as throughput
+// improves and direction is reversed when it gets significantly worse.
+static void download_adapt(struct downloader *d, const struct download_stats *stats) {
+	if (!d->adaptive)
+		return;
+	d->adapt.done++;
+	d->adapt.size += stats->size;
+	if (d->adapt.done < 2 * d->adapt.limit)
+		return;
+	int64_t elapsed = download_now() - d->adapt.start;
+	if (elapsed <= 0)
+		return;
+	double rate = (double)d->adapt.size * 1000000 / elapsed;
+	int prev = d->adapt.limit;
+	if (d->adapt.rate > 0 && rate < d->adapt.rate * (1 - ADAPTIVE_THRESHOLD))
+		d->adapt.step = -d->adapt.step;
+	if (d->adapt.rate <= 0 || rate > d->adapt.rate * (1 + ADAPTIVE_THRESHOLD)
+			|| rate < d->adapt.rate * (1 - ADAPTIVE_THRESHOLD)) {
+		int limit = d->adapt.limit + d->adapt.step;
+		if (limit < 1 || limit > d->total_limit)
+			d->adapt.step = -d->adapt.step; // Bounce from boundary
+		else
+			d->adapt.limit = limit;
+	}
+	DBG("Download throughput %.0f B/s with %d connections, new limit %d", rate, prev, d->adapt.limit);
+	d->adapt.rate = rate;
+	download_apply_limit(d);
+	download_adapt_reset(d);
+}
+
 static void download_check_info(struct downloader *downloader) {
 	CURLMsg *msg;
 	int msgs_left;
@@ -74,14 +318,63 @@ static void download_check_info(struct downloader *downloader) {
 		ASSERT_CURL(curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &inst));
 		ASSERT_CURL(curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url));
 		inst->done = true;
-		if (msg->data.result == CURLE_OK) {
-			DBG("Download succesfull (%s)", url);
+		download_collect_stats(inst);
+		download_adapt(downloader, &inst->stats);
+		DBG("Download statistics (%s): %" PRId64 " bytes, connect %" PRId64 " us, TLS %" PRId64
+				" us, first byte %" PRId64 " us, total %" PRId64 " us, %" PRId64 " B/s", url,
+				inst->stats.size, inst->stats.connect_time, inst->stats.tls_time,
+				inst->stats.first_byte_time, inst->stats.total_time, inst->stats.speed);
+		CURLcode result = msg->data.result;
+		ASSERT_CURL(curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &inst->response_code));
+		long unmet;
+		ASSERT_CURL(curl_easy_getinfo(msg->easy_handle, CURLINFO_CONDITION_UNMET, &unmet));
+		// Time condition can be also evaluated by curl itself (for example for
+		// file://) and in such case there is no 304 but also no content.
+		inst->not_modified = inst->response_code == 304 || unmet;
+		if (inst->resume > 0 && !inst->started && (result == CURLE_RANGE_ERROR ||
+					(result == CURLE_OK && inst->response_code != 206))) {
+			// Curl fails when server sends whole content instead of requested range
+			// and reports 416 as success but in both cases we got no data.
+			if (download_restart(inst))
+				continue;
+			result = CURLE_WRITE_ERROR;
+			strcpy(inst->error, "Unable to restart rejected resumed download");
+		}
+		if (result == CURLE_OK && !inst->started && !inst->not_modified) {
+			// No data were received so write callback was never called
+			inst->started = true;
+			if (!download_data_start(inst)) {
+				result = CURLE_WRITE_ERROR;
+				strcpy(inst->error, "Unable to finish resumed download");
+			}
+		}
+		if (result == CURLE_OK) {
+			download_race_win(inst);
+			ASSERT_CURL(curl_easy_getinfo(msg->easy_handle, CURLINFO_FILETIME, &inst->last_modified));
+			if (inst->hash) {
+				MD5_Final(inst->md5_sum, &inst->md5);
+				SHA256_Final(inst->sha256_sum, &inst->sha256);
+			}
+			DBG("Download succesfull (%s)%s", url, inst->not_modified ? ": not modified" : "");
 			inst->success = true;
+			if (inst->notify) {
+				downloader->notified = inst;
+				event_base_loopbreak(downloader->ebase); // break event loop to report finish
+				break; // Rest of the messages is processed on next run
+			}
+		} else if (download_race_lost(inst)) {
+			// Cancelled or failed but some other participant can still win
+			inst->cancelled = download_race_abort(inst);
+			if (inst->cancelled)
+				strcpy(inst->error, "Cancelled as other download was faster");
+			DBG("Download lost race (%s): %s", url, inst->error);
+			inst->success = false;
 		} else {
 			DBG("Download failed (%s): %s", url, inst->error);
 			inst->success = false;
 			downloader->failed = inst;
 			event_base_loopbreak(downloader->ebase); // break event loop to report error
+			break; // Rest of the messages is processed on next run
 		}
 	}
 }
@@ -165,28 +458,40 @@ struct downloader *downloader_new(int parallel) {
 	ASSERT_MSG(!curl_global_init(CURL_GLOBAL_SSL), "Curl initialization failed");
 	ASSERT(d->cmulti = curl_multi_init());
 #define CURLM_SETOPT(OPT, VAL) ASSERT_CURLM(curl_multi_setopt(d->cmulti, OPT, VAL))
-	CURLM_SETOPT(CURLMOPT_MAX_TOTAL_CONNECTIONS, parallel);
 	CURLM_SETOPT(CURLMOPT_SOCKETFUNCTION, download_socket_cb);
 	CURLM_SETOPT(CURLMOPT_SOCKETDATA, d);
 	CURLM_SETOPT(CURLMOPT_TIMERFUNCTION, download_timer_set);
 	CURLM_SETOPT(CURLMOPT_TIMERDATA, d);
+	CURLM_SETOPT(CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX); // Multiplex transfers to same host over HTTP/2
 #undef CURLM_SETOPT
+	ASSERT(d->cshare = curl_share_init());
+	ASSERT_CURLSH(curl_share_setopt(d->cshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS));
+	ASSERT_CURLSH(curl_share_setopt(d->cshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION));
+	d->stores = NULL;
 	d->ctimer = evtimer_new(d->ebase, download_timer_cb, d);
+	downloader_set_limits(d, parallel, 0, false);
 
-	d->i_size = 0;
-	d->i_allocated = 1;
-	d->instances = malloc(d->i_allocated * sizeof *d->instances);
+	d->instances = NULL;
 	d->pending = 0;
 	d->failed = NULL;
+	d->notified = NULL;
 	return d;
 }
 
 void downloader_free(struct downloader *d) {
 	TRACE("Downloader free");
 	downloader_flush(d);
-	free(d->instances);
 	event_free(d->ctimer);
 	curl_multi_cleanup(d->cmulti);
+	curl_share_cleanup(d->cshare);
+	while (d->stores) {
+		struct download_store *store = d->stores;
+		d->stores = store->next;
+		X509_STORE_free(store->store);
+		curl_share_cleanup(store->share);
+		free(store->digests);
+		free(store);
+	}
 	curl_global_cleanup(); // We call this for every curl_global_init call.
 	event_base_free(d->ebase);
 	free(d);
@@ -194,21 +499,46 @@ void downloader_free(struct downloader *d) {
 
 struct download_i *downloader_run(struct downloader *downloader) {
 	TRACE("Downloader run");
-	event_base_dispatch(downloader->ebase);
+	// Time between runs is not spent downloading so measure only this run
+	download_adapt_reset(downloader);
+	// Process messages left from previous run first as those won't trigger any event
+	download_check_info(downloader);
+	if (!downloader->failed && !downloader->notified)
+		event_base_dispatch(downloader->ebase);
+	struct download_i *inst = NULL;
 	if (downloader->failed) {
-		struct download_i *inst = downloader->failed;
+		inst = downloader->failed;
 		downloader->failed = NULL;
-		return inst;
+	} else if (downloader->notified) {
+		inst = downloader->notified;
+		downloader->notified = NULL;
 	}
-	return NULL;
+	return inst;
+}
+
+void downloader_set_limits(struct downloader *d, int total, int per_host, bool adaptive) {
+	ASSERT_MSG(total > 0, "Limit of all connections has to be positive number");
+	ASSERT_MSG(per_host >= 0, "Limit of connections per host can't be negative");
+	TRACE("Downloader limits: total=%d per_host=%d adaptive=%s", total, per_host, STRBOOL(adaptive));
+	d->total_limit = total;
+	d->host_limit = per_host;
+	d->adaptive = adaptive;
+	// Adaptive mode starts in middle of the range and continues upward
+	d->adapt.limit = (total + 1) / 2;
+	d->adapt.step = 1;
+	d->adapt.rate = 0;
+	download_adapt_reset(d);
+	download_apply_limit(d);
+}
+
+int downloader_limit(struct downloader *d) {
+	return d->adaptive ? d->adapt.limit : d->total_limit;
 }
 
 void downloader_flush(struct downloader *d) {
 	TRACE("Downloader flush");
-	// Instances are freed from back because that prevents data shift in array
-	for (int i = d->i_size - 1; i >= 0; i--)
-		if (d->instances[i])
-			download_i_free(d->instances[i]);
+	while (d->instances)
+		download_i_free(d->instances);
 }
 
 void download_opts_def(struct download_opts *opts) {
@@ -221,6 +551,16 @@ void download_opts_def(struct download_opts *opts) {
 	opts->capath = DOWNLOAD_OPT_SYSTEM_CAPATH; // In default use compiled in path (system path)
 	opts->crl_file = NULL; // In default don't check CRL
 	opts->pems = NULL;
+	opts->etag = NULL; // In default no conditional request
+	opts->last_modified = -1;
+	opts->hash = false;
+	opts->resume = 0;
+	opts->if_range = NULL;
+	opts->start_callback = NULL;
+	opts->start_callback_data = NULL;
+	opts->race = NULL;
+	opts->race_lead = NULL;
+	opts->notify = false;
 }
 
 download_pem_t download_pem(const uint8_t *pem, size_t len) {
@@ -233,6 +573,7 @@ download_pem_t download_pem(const uint8_t *pem, size_t len) {
 		BIO_free(dpem->cbio);
 		goto error;
 	}
+	SHA256(pem, len, dpem->digest);
 	return dpem;
 
 error:
@@ -252,6 +593,18 @@ static size_t download_write_callback(char *ptr, size_t size, size_t nmemb, void
 	struct download_i *inst = userd;
 	size_t rsize = size * nmemb;
 	size_t remb = rsize;
+	if (download_race_abort(inst))
+		return 0; // Lost race so abort
+	if (!inst->started) {
+		inst->started = true;
+		download_race_win(inst);
+		if (!download_data_start(inst))
+			return 0;
+	}
+	if (inst->hash) {
+		MD5_Update(&inst->md5, ptr, rsize);
+		SHA256_Update(&inst->sha256, ptr, rsize);
+	}
 	while (remb > 0) {
 		ssize_t ds = fwrite(ptr, 1, remb, inst->output);
 		if (ds == -1) {
@@ -267,14 +620,39 @@ static size_t download_write_callback(char *ptr, size_t size, size_t nmemb, void
 	return rsize;
 }
 
-static CURLcode download_sslctx(CURL *curl __attribute__((unused)), void *sslctx, void *parm) {
-	struct download_pem **pems = parm;
-	X509_STORE *cts = SSL_CTX_get_cert_store((SSL_CTX *)sslctx);
-	if (!cts) {
-		TRACE("Failed to get cert store: %s", ERR_error_string(ERR_get_error(), NULL));
-		return CURLE_ABORTED_BY_CALLBACK;
+// Called by libcurl periodically. Used to abort downloads that lost race.
+static int download_xferinfo_callback(void *userd, curl_off_t dltotal __attribute__((unused)),
+		curl_off_t dlnow __attribute__((unused)), curl_off_t ultotal __attribute__((unused)),
+		curl_off_t ulnow __attribute__((unused))) {
+	struct download_i *inst = userd;
+	return download_race_abort(inst);
+}
+
+// Called by libcurl for every received header line
+static size_t download_header_callback(char *buffer, size_t size, size_t nitems, void *userd) {
+	struct download_i *inst = userd;
+	size_t len = size * nitems;
+	static const char etag_header[] = "ETag:";
+	const size_t etag_len = sizeof etag_header - 1;
+	if (len >= 5 && !strncmp(buffer, "HTTP/", 5)) {
+		// New response (for example after redirect) so drop any previous one
+		free(inst->etag);
+		inst->etag = NULL;
+	} else if (len > etag_len && !strncasecmp(buffer, etag_header, etag_len)) {
+		const char *val = buffer + etag_len;
+		const char *end = buffer + len;
+		while (val < end && isspace((unsigned char)*val))
+			val++;
+		while (end > val && isspace((unsigned char)*(end - 1)))
+			end--;
+		free(inst->etag);
+		inst->etag = end > val ? strndup(val, end - val) : NULL;
 	}
+	return len;
+}
 
+// Add all certificates and CRLs from given PEMs to store
+static void store_add_pems(X509_STORE *cts, struct download_pem **pems) {
 	while (*pems) {
 		for (int i = 0; i < sk_X509_INFO_num((*pems)->info); i++) {
 			X509_INFO *itmp = sk_X509_INFO_value((*pems)->info, i);
@@ -285,6 +663,62 @@ static CURLcode download_sslctx(CURL *curl __attribute__((unused)), void *sslctx
 		}
 		pems++;
 	}
+}
+
+static CURLcode download_sslctx(CURL *curl __attribute__((unused)), void *sslctx, void *parm) {
+	struct download_pem **pems = parm;
+	X509_STORE *cts = SSL_CTX_get_cert_store((SSL_CTX *)sslctx);
+	if (!cts) {
+		TRACE("Failed to get cert store: %s", ERR_error_string(ERR_get_error(), NULL));
+		return CURLE_ABORTED_BY_CALLBACK;
+	}
+
+	store_add_pems(cts, pems);
+	return CURLE_OK;
+}
+
+// Returns certificate store containing only given PEMs. Stores are cached in
+// downloader and shared between all download instances using same set of PEMs.
+// Every store also has its own curl share so connections and TLS sessions are
+// reused only between instances using same set of PEMs.
+static struct download_store *download_store(struct downloader *downloader, const download_pem_t *pems) {
+	size_t cnt = 0;
+	while (pems[cnt])
+		cnt++;
+	for (struct download_store *s = downloader->stores; s; s = s->next) {
+		if (s->cnt != cnt)
+			continue;
+		size_t i = 0;
+		while (i < cnt && !memcmp(s->digests[i], pems[i]->digest, SHA256_DIGEST_LENGTH))
+			i++;
+		if (i == cnt)
+			return s;
+	}
+	TRACE("Building new certificate store for %zu PEMs", cnt);
+	struct download_store *s = malloc(sizeof *s);
+	s->cnt = cnt;
+	s->digests = malloc(cnt * sizeof *s->digests);
+	for (size_t i = 0; i < cnt; i++)
+		memcpy(s->digests[i], pems[i]->digest, SHA256_DIGEST_LENGTH);
+	ASSERT(s->store = X509_STORE_new());
+	store_add_pems(s->store, (struct download_pem**)pems);
+	ASSERT(s->share = curl_share_init());
+	ASSERT_CURLSH(curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS));
+	ASSERT_CURLSH(curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION));
+	ASSERT_CURLSH(curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT));
+	s->next = downloader->stores;
+	downloader->stores = s;
+	return s;
+}
+
+// SSL context callback used when only PEMs should be trusted. It replaces
+// certificate store with cached one.
+static CURLcode download_sslctx_store(CURL *curl __attribute__((unused)), void *sslctx, void *parm) {
+	X509_STORE *store = parm;
+	X509_STORE *cts = SSL_CTX_get_cert_store((SSL_CTX *)sslctx);
+	if (cts) // Preserve verification parameters configured by curl
+		X509_STORE_set1_param(store, X509_STORE_get0_param(cts));
+	SSL_CTX_set1_cert_store((SSL_CTX *)sslctx, store);
 	return CURLE_OK;
 }
 
@@ -303,13 +737,39 @@ struct download_i *download(struct downloader *downloader, const char *url,
 	// TODO TRACE configured options
 	inst->done = false;
 	inst->success = false;
+	inst->not_modified = false;
+	inst->response_code = 0;
+	inst->stats = (struct download_stats){0};
+	inst->etag = NULL;
+	inst->last_modified = -1;
 	inst->downloader = downloader;
+	inst->headers = NULL;
 	inst->pems = NULL;
+	inst->hash = opts->hash;
+	inst->resume = opts->resume;
+	inst->resumed = false;
+	inst->started = false;
+	inst->start_callback = opts->start_callback;
+	inst->start_callback_data = opts->start_callback_data;
+	inst->race = NULL;
+	inst->race_next = NULL;
+	inst->lead_race = NULL;
+	inst->lead = NULL;
+	inst->cancelled = false;
+	inst->notify = opts->notify;
+	if (inst->hash) {
+		MD5_Init(&inst->md5);
+		SHA256_Init(&inst->sha256);
+	}
 
 	inst->curl = curl_easy_init();
 	ASSERT_MSG(inst->curl, "Curl download instance creation failed");
 #define CURL_SETOPT(OPT, VAL) ASSERT_CURL(curl_easy_setopt(inst->curl, OPT, VAL))
 	CURL_SETOPT(CURLOPT_URL, url);
+	CURL_SETOPT(CURLOPT_SHARE, downloader->cshare);
+	CURL_SETOPT(CURLOPT_PIPEWAIT, 1L); // Prefer waiting for multiplexed connection over opening new one
+	// Use HTTP/2 if server supports it. This is not fatal as curl might be compiled without it.
+	curl_easy_setopt(inst->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
 	CURL_SETOPT(CURLOPT_ACCEPT_ENCODING, ""); // Enable all supported built-in compressions
 	CURL_SETOPT(CURLOPT_FOLLOWLOCATION, opts->follow_redirect); // Follow redirects
 	CURL_SETOPT(CURLOPT_TIMEOUT, opts->timeout);
@@ -330,28 +790,69 @@ struct download_i *download(struct downloader *downloader, const char *url,
 		if (opts->crl_file)
 			CURL_SETOPT(CURLOPT_CRLFILE, opts->crl_file);
 		if (opts->pems) {
-			inst->pems = pemsdup(opts->pems);
-			CURL_SETOPT(CURLOPT_SSL_CTX_FUNCTION, download_sslctx);
-			CURL_SETOPT(CURLOPT_SSL_CTX_DATA, inst->pems);
+			struct download_store *store = download_store(downloader, opts->pems);
+			if (!opts->cacert_file && !opts->capath) {
+				// Only provided PEMs are trusted so we can use cached store
+				CURL_SETOPT(CURLOPT_SSL_CTX_FUNCTION, download_sslctx_store);
+				CURL_SETOPT(CURLOPT_SSL_CTX_DATA, store->store);
+			} else {
+				inst->pems = pemsdup(opts->pems);
+				CURL_SETOPT(CURLOPT_SSL_CTX_FUNCTION, download_sslctx);
+				CURL_SETOPT(CURLOPT_SSL_CTX_DATA, inst->pems);
+			}
+			// Curl does not consider SSL context callback when it matches connections
+			// and TLS sessions for reuse so those verified with different
+			// certificates are kept apart in share of given set of PEMs. Curl still
+			// distinguishes CA file and path on its own.
+			CURL_SETOPT(CURLOPT_SHARE, store->share);
 		}
 		CURL_SETOPT(CURLOPT_SSL_VERIFYSTATUS, opts->ocsp);
 	} else
 		CURL_SETOPT(CURLOPT_SSL_VERIFYPEER, 0L);
 	CURL_SETOPT(CURLOPT_WRITEFUNCTION, download_write_callback);
 	CURL_SETOPT(CURLOPT_WRITEDATA, inst);
+	CURL_SETOPT(CURLOPT_HEADERFUNCTION, download_header_callback);
+	CURL_SETOPT(CURLOPT_HEADERDATA, inst);
+	CURL_SETOPT(CURLOPT_FILETIME, 1L); // Request modification time of content
+	if (opts->etag)
+		inst->headers = curl_slist_append(inst->headers, aprintf("If-None-Match: %s", opts->etag));
+	if (opts->resume > 0) {
+		CURL_SETOPT(CURLOPT_RESUME_FROM_LARGE, (curl_off_t)opts->resume);
+		if (opts->if_range)
+			inst->headers = curl_slist_append(inst->headers, aprintf("If-Range: %s", opts->if_range));
+	}
+	if (inst->headers)
+		CURL_SETOPT(CURLOPT_HTTPHEADER, inst->headers);
+	if (opts->last_modified >= 0) {
+		CURL_SETOPT(CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+		CURL_SETOPT(CURLOPT_TIMEVALUE, opts->last_modified);
+	}
 	CURL_SETOPT(CURLOPT_ERRORBUFFER, inst->error);
 	CURL_SETOPT(CURLOPT_PRIVATE, inst);
 	// TODO We might set XFERINFOFUNCTION here to use it for reporting progress of download to user.
+	if (opts->race) {
+		inst->race = download_race_ref(opts->race);
+		inst->race_next = inst->race->participants;
+		inst->race->participants = inst;
+	}
+	if (opts->race_lead && opts->race_lead->race) {
+		inst->lead_race = download_race_ref(opts->race_lead->race);
+		inst->lead = opts->race_lead;
+	}
+	if (inst->race || inst->lead_race) {
+		CURL_SETOPT(CURLOPT_XFERINFOFUNCTION, download_xferinfo_callback);
+		CURL_SETOPT(CURLOPT_XFERINFODATA, inst);
+		CURL_SETOPT(CURLOPT_NOPROGRESS, 0L);
+	}
 #undef CURL_SETOPT
 	ASSERT_CURLM(curl_multi_add_handle(downloader->cmulti, inst->curl));
 
 	// Add instance to downloader
-	if (downloader->i_size >= downloader->i_allocated) {
-		downloader->i_allocated *= 2;
-		downloader->instances = realloc(downloader->instances,
-				downloader->i_allocated * sizeof *downloader->instances);
-	}
-	downloader->instances[downloader->i_size++] = inst;
+	inst->prev = NULL;
+	inst->next = downloader->instances;
+	if (inst->next)
+		inst->next->prev = inst;
+	downloader->instances = inst;
 
 	return inst;
 }
@@ -359,22 +860,67 @@ struct download_i *download(struct downloader *downloader, const char *url,
 void download_i_free(struct download_i *inst) {
 	TRACE("Downloader: free instance");
 	// Remove instance from downloader
-	int i = inst->downloader->i_size - 1;
-	while (i >= 0 && inst->downloader->instances[i] != inst)
-		i--;
-	ASSERT_MSG(i >= 0, "Download instance is not registered with downloader that it specifies");
-	inst->downloader->i_size--;
-	memmove(inst->downloader->instances + i, inst->downloader->instances + i + 1,
-			(inst->downloader->i_size - i) * sizeof *inst->downloader->instances);
+	ASSERT_MSG(inst->prev || inst->downloader->instances == inst,
+			"Download instance is not registered with downloader that it specifies");
+	if (inst->prev)
+		inst->prev->next = inst->next;
+	else
+		inst->downloader->instances = inst->next;
+	if (inst->next)
+		inst->next->prev = inst->prev;
 
 	// Free instance it self
 	ASSERT_CURLM(curl_multi_remove_handle(inst->downloader->cmulti, inst->curl)); // remove download from multi handler
 	curl_easy_cleanup(inst->curl); // and clean download (also closing running connection)
+	curl_slist_free_all(inst->headers);
+	free(inst->etag);
 	if (inst->pems)
 		free(inst->pems);
+	if (inst->race) {
+		struct download_i **p = &inst->race->participants;
+		while (*p != inst)
+			p = &(*p)->race_next;
+		*p = inst->race_next;
+		if (inst->race->winner == inst)
+			inst->race->winner = NULL;
+		download_race_free(inst->race);
+	}
+	if (inst->lead_race)
+		download_race_free(inst->lead_race);
 	free(inst);
 }
 
+download_race_t download_race_new(void) {
+	struct download_race *race = malloc(sizeof *race);
+	*race = (struct download_race) {
+		.refs = 1,
+		.participants = NULL,
+		.winner = NULL,
+	};
+	return race;
+}
+
+download_race_t download_race_ref(download_race_t race) {
+	race->refs++;
+	return race;
+}
+
+void download_race_free(download_race_t race) {
+	ASSERT(race->refs > 0);
+	if (--race->refs == 0) {
+		ASSERT_MSG(!race->participants, "Freeing race with participants");
+		free(race);
+	}
+}
+
+bool download_race_won(download_i_t inst) {
+	return inst->race && inst->race->winner == inst;
+}
+
+bool download_is_cancelled(download_i_t inst) {
+	return inst->cancelled;
+}
+
 bool download_is_done(download_i_t inst) {
 	return inst->done;
 }
@@ -383,6 +929,38 @@ bool download_is_success(download_i_t inst) {
 	return inst->success;
 }
 
+bool download_is_not_modified(download_i_t inst) {
+	return inst->not_modified;
+}
+
+const char *download_etag(download_i_t inst) {
+	return inst->etag;
+}
+
+long download_last_modified(download_i_t inst) {
+	return inst->last_modified;
+}
+
+const struct download_stats *download_stats(download_i_t inst) {
+	return &inst->stats;
+}
+
+long download_response_code(download_i_t inst) {
+	return inst->response_code;
+}
+
+bool download_is_resumed(download_i_t inst) {
+	return inst->resumed;
+}
+
+const uint8_t *download_md5(download_i_t inst) {
+	return (inst->hash && inst->done && inst->success) ? inst->md5_sum : NULL;
+}
+
+const uint8_t *download_sha256(download_i_t inst) {
+	return (inst->hash && inst->done && inst->success) ? inst->sha256_sum : NULL;
+}
+
 const char *download_error(download_i_t inst) {
 	return inst->error;
 }
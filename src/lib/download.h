@@ -38,9 +38,25 @@ typedef struct download_i* download_i_t;
 struct download_pem;
 typedef struct download_pem* download_pem_t;
 
+// Race of multiple downloads where only the fastest one is finished
+struct download_race;
+typedef struct download_race* download_race_t;
+
 #define DOWNLOAD_OPT_SYSTEM_CACERT ((const char*)-1)
 #define DOWNLOAD_OPT_SYSTEM_CAPATH ((const char*)-1)
 
+// Statistics of single download (all times are in microseconds from transfer start)
+struct download_stats {
+	int64_t size; // Number of received bytes
+	int64_t connect_time; // Time till connection to server was established
+	int64_t tls_time; // Time till TLS handshake was finished (0 if not used)
+	int64_t first_byte_time; // Time till first byte of content was received
+	int64_t total_time; // Total time of transfer
+	int64_t speed; // Average download speed in bytes per second
+	int64_t start; // Monotonic time transfer started at
+	int64_t finish; // Monotonic time transfer finished at
+};
+
 // Download options (additional options configuring security and more)
 struct download_opts {
 	long timeout; // Download timeout
@@ -52,6 +68,16 @@ struct download_opts {
 	const char *capath; // Path to directory containing CA certificates
 	const char *crl_file; // Path to custom CA crl
 	const download_pem_t *pems; // NULL terminated array of PEM certificates
+	const char *etag; // ETag of previously received content (conditional request)
+	long last_modified; // Modification time of previously received content (conditional request), -1 if unknown
+	bool hash; // If MD5 and SHA256 sums of received data should be computed
+	long resume; // Size of data already present in output, download is resumed from this offset (0 to download everything)
+	const char *if_range; // ETag or HTTP date of content already in output (If-Range header) or NULL
+	void (*start_callback)(download_i_t, void *data); // Called when data reception starts (headers are received)
+	void *start_callback_data; // Data passed to start_callback
+	download_race_t race; // Race download participates in (NULL if none)
+	download_i_t race_lead; // Download is cancelled if this one loses its race (NULL if none)
+	bool notify; // If downloader_run should return once this download successfully finishes
 };
 
 
@@ -63,8 +89,29 @@ downloader_t downloader_new(int parallel) __attribute__((malloc));
 // Free given instance of downloader
 void downloader_free(downloader_t) __attribute__((nonnull));
 
+// Set limits for number of connections downloader can open
+// total: Limit for all connections together (has to be positive)
+// per_host: Limit for connections to single host (0 for no limit)
+// adaptive: If limit for all connections should be adjusted according to
+//   measured throughput. In such case total is used as upper bound.
+// Note: it can be called at any time but new limits are applied only on new
+//   connections.
+// Note: downloads pinned to set of PEMs use connections of their certificate
+//   store (see download_opts.pems) and curl applies limits to every such pool
+//   of connections separately. With multiple sets of PEMs in use there can be
+//   more connections than the total limit.
+void downloader_set_limits(downloader_t, int total, int per_host, bool adaptive)
+	__attribute__((nonnull));
+
+// Returns current limit for all connections (this is total passed to
+// downloader_set_limits unless adaptive mode is used)
+int downloader_limit(downloader_t) __attribute__((nonnull));
+
 // Run downloader and download all registered URLs
-// return: NULL on success otherwise pointer to download instance that failed.
+// return: NULL when all downloads are finished otherwise pointer to download
+//   instance that failed or that successfully finished and has notify option set.
+//   Use download_is_success to distinguish them. Downloader can be run again to
+//   continue with remaining downloads.
 download_i_t downloader_run(downloader_t) __attribute__((nonnull));
 
 // Remove all download instances from downloader
@@ -86,6 +133,23 @@ download_pem_t download_pem(const uint8_t *pem, size_t len)
 // Free download_pem_t instance
 void download_pem_free(download_pem_t) __attribute__((nonnull));
 
+// Create new download race. Downloads registered with same race are racing each
+// other. The first one that receives data (or is finished without them) wins and
+// all others are cancelled. Failure of download that is not winner is not reported
+// unless it is the last running one and there is no winner. Download can also
+// follow race of some other download (see race_lead in download_opts) and in such
+// case it is cancelled if that download loses.
+// Returns new race with single reference (owned by caller).
+download_race_t download_race_new(void) __attribute__((malloc));
+
+// Add reference to race.
+// Returns given race.
+download_race_t download_race_ref(download_race_t) __attribute__((nonnull));
+
+// Drop reference to race. Race is freed when there is no reference left. Every
+// download instance registered with race holds its own reference.
+void download_race_free(download_race_t) __attribute__((nonnull));
+
 // Register given URL to be downloaded.
 // downloader: downloader instance to register download to
 // url: URL data are downloaded from
@@ -108,6 +172,51 @@ bool download_is_done(download_i_t) __attribute__((nonnull));
 // true.
 bool download_is_success(download_i_t) __attribute__((nonnull));
 
+// Check if given instance completed with server reporting that content was not
+// modified since it was received with validators passed in download_opts (HTTP
+// 304). In such case no data were written to output.
+// Returned value is only valid if download_is_success returns true.
+bool download_is_not_modified(download_i_t) __attribute__((nonnull));
+
+// Check if given instance won race it participates in (see download_race_new).
+// Returns false if instance does not participate in any race.
+bool download_race_won(download_i_t) __attribute__((nonnull));
+
+// Check if given instance was cancelled because some other participant of race
+// won. Such instance is done but not successful and its failure is not reported
+// by downloader_run.
+bool download_is_cancelled(download_i_t) __attribute__((nonnull));
+
+// Returns ETag of received content or NULL if server did not provide it.
+// Returned string is valid till instance is not freed.
+const char *download_etag(download_i_t) __attribute__((nonnull));
+
+// Returns modification time (Unix time) of received content as reported by
+// server or -1 if it is not known.
+long download_last_modified(download_i_t) __attribute__((nonnull));
+
+// Returns statistics of given download. Statistics are collected once download
+// is finished (no matter if successfully or not) and are zeroed before that.
+// Returned pointer is valid till instance is not freed.
+const struct download_stats *download_stats(download_i_t) __attribute__((nonnull));
+
+// Returns last response code received from server (HTTP status code) or 0 if no
+// response was received.
+// Returned value is only valid if download_is_done returns true.
+long download_response_code(download_i_t) __attribute__((nonnull));
+
+// Check if server accepted request to resume download (see resume in
+// download_opts). If it did not then output was truncated and whole content
+// was received again.
+bool download_is_resumed(download_i_t) __attribute__((nonnull));
+
+// Returns MD5 (16 bytes) or SHA256 (32 bytes) sum of received data. Sums are
+// computed while data are received and only if hash was set in download_opts.
+// NULL is returned if sums were not computed or download was not successful.
+// Returned pointer is valid till instance is not freed.
+const uint8_t *download_md5(download_i_t) __attribute__((nonnull));
+const uint8_t *download_sha256(download_i_t) __attribute__((nonnull));
+
 // Returns string with error message desciring failure reason.
 // Returned string is only valid if download_is_success returns false and is valid
 // till instance is not freed.
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "hashing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "logging.h"
+#include "util.h"
+#include "inject.h"
+
+// Size of read buffer of every thread
+#define HASH_BUFFER_SIZE (1024 * 1024)
+// Alignment of read buffer
+#define HASH_BUFFER_ALIGN 4096
+
+struct hash_pool {
+	struct hash_file *files;
+	size_t cnt;
+	size_t next; // Index of next file to be hashed (updated atomically)
+};
+
+// Read whole file and feed it to given digests. Returns errno on failure.
+static int hash_fd(int fd, uint8_t *buf, EVP_MD_CTX *md5, EVP_MD_CTX *sha256, uint64_t *size) {
+	ssize_t got;
+	while ((got = read(fd, buf, HASH_BUFFER_SIZE))) {
+		if (got == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (md5)
+			EVP_DigestUpdate(md5, buf, got);
+		if (sha256)
+			EVP_DigestUpdate(sha256, buf, got);
+		*size += got;
+	}
+	return 0;
+}
+
+static void hash_file(struct hash_file *file, uint8_t *buf) {
+	file->size = 0;
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		file->err = errno;
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	EVP_MD_CTX *md5 = NULL, *sha256 = NULL;
+	if (file->algos & HASH_MD5) {
+		md5 = EVP_MD_CTX_new();
+		ASSERT(md5 && EVP_DigestInit_ex(md5, EVP_md5(), NULL));
+	}
+	if (file->algos & HASH_SHA256) {
+		sha256 = EVP_MD_CTX_new();
+		ASSERT(sha256 && EVP_DigestInit_ex(sha256, EVP_sha256(), NULL));
+	}
+	file->err = hash_fd(fd, buf, md5, sha256, &file->size);
+	close(fd);
+	if (md5) {
+		EVP_DigestFinal_ex(md5, file->md5, NULL);
+		EVP_MD_CTX_free(md5);
+	}
+	if (sha256) {
+		EVP_DigestFinal_ex(sha256, file->sha256, NULL);
+		EVP_MD_CTX_free(sha256);
+	}
+}
+
+static void *hash_worker(void *data) {
+	struct hash_pool *pool = data;
+	uint8_t *buf;
+	ASSERT(posix_memalign((void**)&buf, HASH_BUFFER_ALIGN, HASH_BUFFER_SIZE) == 0);
+	size_t i;
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->cnt)
+		hash_file(&pool->files[i], buf);
+	free(buf);
+	return NULL;
+}
+
+void hash_files(struct hash_file *files, size_t cnt, unsigned threads) {
+	if (!cnt)
+		return;
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > HASH_MAX_THREADS)
+		threads = HASH_MAX_THREADS;
+	if (threads > cnt)
+		threads = cnt;
+	struct hash_pool pool = {
+		.files = files,
+		.cnt = cnt,
+		.next = 0,
+	};
+	// Current thread is one of the workers so only rest of them is created
+	pthread_t workers[threads];
+	unsigned started = 0;
+	for (; started + 1 < threads; started++) {
+		int err = pthread_create(&workers[started], NULL, hash_worker, &pool);
+		if (err) {
+			WARN("Unable to create hashing thread: %s", strerror(err));
+			break;
+		}
+	}
+	hash_worker(&pool);
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+}
+
+// Lua interface /////////////////////////////////////////////////////////////////
+
+static const struct {
+	int algo;
+	const char *name;
+} algo_names[] = {
+	{ HASH_MD5, "md5" },
+	{ HASH_SHA256, "sha256" },
+};
+
+static int algo_parse(lua_State *L, int index) {
+	const char *name = luaL_checkstring(L, index);
+	for (size_t i = 0; i < sizeof algo_names / sizeof *algo_names; i++)
+		if (!strcmp(name, algo_names[i].name))
+			return algo_names[i].algo;
+	return luaL_error(L, "Unknown hash algorithm: %s", name);
+}
+
+static void push_hex(lua_State *L, const uint8_t *buffer, size_t size) {
+	char result[2 * size + 1];
+	for (size_t i = 0; i < size; i ++)
+		snprintf(result + 2 * i, 3, "%02hhx", buffer[i]);
+	lua_pushlstring(L, result, 2 * size);
+}
+
+static int lua_files(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int algos = 0;
+	if (lua_istable(L, 2)) {
+		size_t cnt = lua_objlen(L, 2);
+		for (size_t i = 1; i <= cnt; i++) {
+			lua_rawgeti(L, 2, i);
+			algos |= algo_parse(L, -1);
+			lua_pop(L, 1);
+		}
+	} else
+		algos = algo_parse(L, 2);
+	lua_Integer threads = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, threads >= 0, 3, "Number of threads can't be negative");
+
+	// Strings are referenced by paths table so they stay valid while we hash
+	size_t cnt = lua_objlen(L, 1);
+	struct hash_file *files = calloc(cnt ? cnt : 1, sizeof *files);
+	for (size_t i = 0; i < cnt; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			free(files);
+			return luaL_error(L, "Path on index %d is not a string", (int)(i + 1));
+		}
+		files[i].path = lua_tostring(L, -1);
+		lua_pop(L, 1);
+		files[i].algos = algos;
+	}
+	hash_files(files, cnt, threads);
+
+	lua_newtable(L); // Hashes
+	lua_newtable(L); // Errors
+	for (size_t i = 0; i < cnt; i++) {
+		lua_pushstring(L, files[i].path);
+		if (files[i].err) {
+			lua_pushstring(L, strerror(files[i].err));
+			lua_rawset(L, -3);
+			continue;
+		}
+		lua_newtable(L);
+		if (algos & HASH_MD5) {
+			push_hex(L, files[i].md5, sizeof files[i].md5);
+			lua_setfield(L, -2, "md5");
+		}
+		if (algos & HASH_SHA256) {
+			push_hex(L, files[i].sha256, sizeof files[i].sha256);
+			lua_setfield(L, -2, "sha256");
+		}
+		lua_pushinteger(L, files[i].size);
+		lua_setfield(L, -2, "size");
+		lua_rawset(L, -4);
+	}
+	free(files);
+	return 2;
+}
+
+static const struct inject_func funcs[] = {
+	{ lua_files, "files" },
+};
+
+void hashing_mod_init(lua_State *L) {
+	TRACE("hashing module init");
+	lua_newtable(L);
+	inject_func_n(L, "hashing", funcs, sizeof funcs / sizeof *funcs);
+	lua_pushvalue(L, -1);
+	lua_setmetatable(L, -2);
+	inject_module(L, "hashing");
+}
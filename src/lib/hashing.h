@@ -0,0 +1,56 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UPDATER_HASHING_H
+#define UPDATER_HASHING_H
+#include <stdint.h>
+#include <stddef.h>
+#include <lua.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+// Batch hashing of files. Files are read in large chunks and every file is read
+// only once no matter how many hashes are computed from it. Files are
+// distributed between pool of threads.
+
+#define HASH_MD5 (1 << 0)
+#define HASH_SHA256 (1 << 1)
+
+// Maximum number of threads used to hash files
+#define HASH_MAX_THREADS 8
+
+struct hash_file {
+	const char *path; // Path to file to hash (input)
+	int algos; // Bitwise combination of hashes to compute (input)
+	uint8_t md5[MD5_DIGEST_LENGTH];
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	uint64_t size; // Number of bytes hashed
+	int err; // errno of failed operation or 0 on success
+};
+
+// Hash all given files. Hashes are stored to given structures and result of
+// each file is signaled by its err field.
+// threads: number of threads to use, 0 means number of online CPUs. No more than
+//   HASH_MAX_THREADS and no more threads than files are ever used.
+void hash_files(struct hash_file *files, size_t cnt, unsigned threads) __attribute__((nonnull(1)));
+
+
+// Create hashing module and inject it into the lua state
+void hashing_mod_init(lua_State *L) __attribute__((nonnull));
+
+#endif
@@ -31,6 +31,10 @@
 #include "uri_lua.h"
 #include "archive.h"
 #include "path_utils.h"
+#include "control.h"
+#include "snapshot.h"
+#include "hashing.h"
+#include "pkgdb.h"
 #include "picosat.h"
 
 #include "lua/backend.lua.h"
@@ -58,6 +62,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -730,7 +736,9 @@ static int stat_lstat(lua_State *L, bool use_lstat) {
 	}
 	lua_pushstring(L, stat2str(&buf));
 	lua_pushstring(L, perm2str(&buf));
-	return 2;
+	lua_pushnumber(L, buf.st_size);
+	lua_pushnumber(L, buf.st_mtime);
+	return 4;
 }
 
 static int lua_stat(lua_State *L) {
@@ -741,6 +749,101 @@ static int lua_lstat(lua_State *L) {
 	return stat_lstat(L, true);
 }
 
+static int lua_file_id(lua_State *L) {
+	const char *fname = luaL_checkstring(L, 1);
+	struct stat buf;
+	if (stat(fname, &buf) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		return luaL_error(L, "Failed to stat '%s': %s", fname, strerror(errno));
+	}
+	lua_pushstring(L, aprintf("%ju:%ju:%jd:%jd.%09ld:%jd.%09ld", (uintmax_t)buf.st_dev,
+			(uintmax_t)buf.st_ino, (intmax_t)buf.st_size,
+			(intmax_t)buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec,
+			(intmax_t)buf.st_ctim.tv_sec, buf.st_ctim.tv_nsec));
+	lua_pushnumber(L, buf.st_size);
+	return 2;
+}
+
+static int lua_touch(lua_State *L) {
+	const char *fname = luaL_checkstring(L, 1);
+	if (utimensat(AT_FDCWD, fname, NULL, 0) == 0)
+		return 0;
+	return luaL_error(L, "Failed to touch '%s': %s", fname, strerror(errno));
+}
+
+// Copy first len bytes of file src to file dst (both are file descriptors)
+static bool copy_head(int src, int dst, off_t len) {
+	char buf[BUFSIZ];
+	while (len > 0) {
+		ssize_t rd = read(src, buf, (size_t)len < sizeof buf ? (size_t)len : sizeof buf);
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd <= 0) {
+			if (rd == 0)
+				errno = EINVAL; // Base file is shorter than requested
+			return false;
+		}
+		for (ssize_t wr = 0; wr < rd;) {
+			ssize_t res = write(dst, buf + wr, rd - wr);
+			if (res == -1 && errno != EINTR)
+				return false;
+			if (res > 0)
+				wr += res;
+		}
+		len -= rd;
+	}
+	return true;
+}
+
+static int lua_clone_write(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	const char *base = luaL_checkstring(L, 2);
+	lua_Integer offset = luaL_checkinteger(L, 3);
+	size_t len;
+	const char *data = luaL_checklstring(L, 4, &len);
+	luaL_argcheck(L, offset >= 0, 3, "Offset can't be negative");
+	int src = open(base, O_RDONLY);
+	if (src == -1)
+		return luaL_error(L, "Failed to open '%s': %s", base, strerror(errno));
+	int dst = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (dst == -1) {
+		close(src);
+		return luaL_error(L, "Failed to open '%s': %s", path, strerror(errno));
+	}
+	struct stat st;
+	bool ok = fstat(src, &st) == 0;
+	if (ok && offset > st.st_size) {
+		ok = false;
+		errno = EINVAL; // Base file is shorter than requested
+	}
+	bool cloned = false;
+#ifdef FICLONE
+	// Share data with base file if file system supports it so only tail is written
+	cloned = ok && ioctl(dst, FICLONE, src) == 0;
+#endif
+	if (cloned)
+		ok = ftruncate(dst, offset) == 0 && lseek(dst, offset, SEEK_SET) != -1;
+	else if (ok)
+		ok = copy_head(src, dst, offset);
+	for (size_t wr = 0; ok && wr < len;) {
+		ssize_t res = write(dst, data + wr, len - wr);
+		if (res == -1 && errno != EINTR)
+			ok = false;
+		else if (res > 0)
+			wr += res;
+	}
+	int err = errno;
+	close(src);
+	if (close(dst) && ok) {
+		ok = false;
+		err = errno;
+	}
+	if (!ok)
+		return luaL_error(L, "Failed to write '%s': %s", path, strerror(err));
+	return 0;
+}
+
 static int lua_sync(lua_State *L __attribute__((unused))) {
 	TRACE("Sync");
 	sync();
@@ -776,21 +879,20 @@ static int lua_md5(lua_State *L) {
 	return 1;
 }
 
+// Hash single file using given algorithm. Raises error if file can't be read.
+static void hash_single_file(lua_State *L, struct hash_file *file, int algo) {
+	file->path = luaL_checkstring(L, 1);
+	file->algos = algo;
+	hash_files(file, 1, 1);
+	if (file->err)
+		luaL_error(L, "Unable to hash file %s: %s", file->path, strerror(file->err));
+}
+
 static int lua_md5_file(lua_State *L) {
-	size_t len;
-	const char *filename = luaL_checklstring(L, 1, &len);
-	MD5_CTX md5;
-	MD5_Init(&md5);
-	char buffer[32768];
-	int read = 0;
-	FILE *f = fopen(filename, "rb");
-	while((read = fread(buffer, 1, sizeof(buffer), f)))
-		MD5_Update(&md5, buffer, read);
-	fclose(f);
-	uint8_t result[MD5_DIGEST_LENGTH];
-	MD5_Final(result, &md5);
-	push_hex(L, result, sizeof result);
-	return 1;	
+	struct hash_file file;
+	hash_single_file(L, &file, HASH_MD5);
+	push_hex(L, file.md5, sizeof file.md5);
+	return 1;
 }
 
 static int lua_sha256(lua_State *L) {
@@ -806,20 +908,10 @@ static int lua_sha256(lua_State *L) {
 }
 
 static int lua_sha256_file(lua_State *L) {
-	size_t len;
-	const char *filename = luaL_checklstring(L, 1, &len);
-	SHA256_CTX sha256;
-	SHA256_Init(&sha256);
-	char buffer[32768];
-	int read = 0;
-	FILE *f = fopen(filename, "rb");
-	while((read = fread(buffer, 1, sizeof(buffer), f)))
-		SHA256_Update(&sha256, buffer, read);
-	fclose(f);
-	uint8_t result[SHA256_DIGEST_LENGTH];
-	SHA256_Final(result, &sha256);
-	push_hex(L, result, sizeof result);
-	return 1;	
+	struct hash_file file;
+	hash_single_file(L, &file, HASH_SHA256);
+	push_hex(L, file.sha256, sizeof file.sha256);
+	return 1;
 }
 
 
@@ -868,6 +960,9 @@ static const struct injected_func injected_funcs[] = {
 	{ lua_ls, "ls" },
 	{ lua_stat, "stat" },
 	{ lua_lstat, "lstat" },
+	{ lua_file_id, "file_id" },
+	{ lua_touch, "touch" },
+	{ lua_clone_write, "clone_write" },
 	{ lua_sync, "sync" },
 	{ lua_setenv, "setenv" },
 	{ lua_md5, "md5" },
@@ -962,6 +1057,10 @@ struct interpreter *interpreter_create(struct events *events) {
 	uri_mod_init(L);
 	archive_mod_init(L);
 	path_utils_mod_init(L);
+	control_mod_init(L);
+	snapshot_mod_init(L);
+	hashing_mod_init(L);
+	pkgdb_mod_init(L);
 	picosat_mod_init(L);
 #ifdef COVERAGE
 	interpreter_load_coverage(result);
@@ -25,6 +25,9 @@ local tonumber = tonumber
 local pcall = pcall
 local require = require
 local next = next
+local rawget = rawget
+local rawset = rawset
+local setmetatable = setmetatable
 local tostring = tostring
 local tonumber = tonumber
 local assert = assert
@@ -46,11 +49,20 @@ local move = move
 local copy = copy
 local symlink = symlink
 local ls = ls
-local md5_file = md5_file
-local sha256_file = sha256_file
+local touch = touch
+local file_id = file_id
+local clone_write = clone_write
 local archive = archive
+local hashing = hashing
+local pkgdb = pkgdb
+local opmode = opmode
 local path_utils = path_utils
+local control_parse = control.parse
+local control_blocks = control.blocks
+local control_lazy_blocks = control.lazy_blocks
+local control_prepare = control.prepare
 local DBG = DBG
+local INFO = INFO
 local WARN = WARN
 local ERROR = ERROR
 local syscnf = require "syscnf"
@@ -60,10 +72,10 @@ local locks = require "locks"
 module "backend"
 
 -- Variables that we want to access from outside (ex. for testing purposes)
--- luacheck: globals cmd_timeout cmd_kill_timeout
+-- luacheck: globals cmd_timeout cmd_kill_timeout pkg_cache_size
 -- Functions that we want to access from outside (ex. for testing purposes)
 -- luacheck: globals block_parse block_split block_dump_ordered pkg_status_dump package_postprocess status_parse get_parent config_modified
--- luacheck: globals repo_parse status_dump pkg_unpack pkg_examine collision_check installed_confs steal_configs pkg_merge_files pkg_merge_control pkg_config_info pkg_cleanup_files pkg_update_alternatives pkg_remove_alternatives script_run control_cleanup parse_pkg_specifier version_cmp version_match run_state user_path_move get_nonconf_files get_changed_files
+-- luacheck: globals repo_prepare repo_parse status_dump pkg_unpack pkg_delta_apply pkg_cache_get pkg_cache_store pkg_cache_commit pkg_examine collision_check installed_confs steal_configs pkg_merge_files pkg_merge_control pkg_config_info config_hashes_start config_hashes_stop status_load pkg_cleanup_files pkg_update_alternatives pkg_remove_alternatives script_run control_cleanup parse_pkg_specifier version_cmp version_match run_state user_path_move get_nonconf_files get_changed_files file_hashes_store
 
 --[[
 Configuration of the module. It is supported (yet unlikely to be needed) to modify
@@ -74,10 +86,14 @@ cmd_timeout = 600000
 -- Time after which we SIGKILL external commands
 -- TODO instead of this if subprocess is used we set kill timeout globally so drop this
 cmd_kill_timeout = 900000
+-- Maximum size of packages cache in bytes (least recently used packages are removed)
+pkg_cache_size = 104857600
 
 --[[
 Parse a single block of mail-header-like records.
 Return as a table.
+Note that native implementation control.parse is used internally. This one is
+kept as reference implementation.
 ]]--
 function block_parse(block)
 	local result = {}
@@ -131,6 +147,19 @@ function block_dump_ordered(block)
 	end))
 end
 
+-- Format table of config files (name and hash) as value of Conffiles field
+local function conffiles_dump(confs)
+	local i = 0
+	--[[
+	For each dep, place it into an array instead of map and format the line.
+	Then connect these lines together with newlines.
+	]]
+	return "\n" .. table.concat(utils.map(confs, function (filename, hash)
+		i = i + 1
+		return i, " " .. filename .. " " .. hash
+	end), "\n")
+end
+
 --[[
 Dump status of a single package.
 ]]
@@ -155,17 +184,7 @@ function pkg_status_dump(status)
 			return table.concat(status, ' ')
 		end),
 		raw "Architecture",
-		line("Conffiles", function (confs)
-			local i = 0
-			--[[
-			For each dep, place it into an array instead of map and format the line.
-			Then connect these lines together with newlines.
-			]]
-			return "\n" .. table.concat(utils.map(confs, function (filename, hash)
-				i = i + 1
-				return i, " " .. filename .. " " .. hash
-			end), "\n")
-		end),
+		line("Conffiles", conffiles_dump),
 		raw "Installed-Time",
 		raw "Auto-Installed"
 	})
@@ -174,6 +193,8 @@ end
 --[[
 Split text into blocks separated by at least one empty line.
 Returns an iterator.
+Note that native implementation control.blocks (that also parses blocks) is used
+internally. This one is kept as reference implementation.
 ]]
 function block_split(string)
 	local pos = 0 -- 0 is the last one we /don't/ want.
@@ -286,7 +307,7 @@ end
 local function pkg_control(pkg_name)
 	local content = pkg_file(pkg_name, "control", true)
 	if content then
-		return block_parse(content)
+		return control_parse(content)
 	else
 		return {}
 	end
@@ -344,79 +365,402 @@ function get_nonconf_files(pkg)
 	return files
 end
 
+--[[
+Cache of MD5 hashes of installed files so files are not read on every run. It
+maps path to string with file identifier (see file_id) and hash separated by
+space. Hash is computed again only if identifier of file changes. Cache is loaded
+on first use and entries of files that no longer exist are dropped when it is
+stored by file_hashes_store.
+]]
+local file_hashes = nil
+local file_hashes_path = nil -- Path cache was loaded from
+local file_hashes_used = {}
+local file_hashes_dirty = false
+local rehashed_files, rehashed_bytes = 0, 0
+
+local function file_hashes_load()
+	file_hashes = {}
+	file_hashes_path = syscnf.file_hash_cache
+	file_hashes_used = {}
+	file_hashes_dirty = false
+	rehashed_files, rehashed_bytes = 0, 0
+	local f = io.open(file_hashes_path)
+	if f then
+		for line in f:lines() do
+			local id, hash, path = line:match('^(%S+) (%S+) (.+)$')
+			if path then
+				file_hashes[path] = id .. " " .. hash
+			end
+		end
+		f:close()
+	end
+end
+
+--[[
+Returns table with MD5 hashes of given files. Hashes of files that were not
+modified since they were hashed last time are taken from cache and the rest of
+files is hashed in a single batch. Files that do not exist are not included.
+]]
+local function files_md5(paths)
+	if not file_hashes or file_hashes_path ~= syscnf.file_hash_cache then
+		file_hashes_load()
+	end
+	local result = {}
+	local ids = {}
+	local rehash = {}
+	for _, path in ipairs(paths) do
+		local id = file_id(path)
+		if id then
+			local entry = file_hashes[path]
+			if entry and entry:sub(1, #id + 1) == id .. " " then
+				file_hashes_used[path] = entry
+				result[path] = entry:sub(#id + 2)
+			else
+				ids[path] = id
+				table.insert(rehash, path)
+			end
+		end
+	end
+	for path, hash in pairs(hashing.files(rehash, "md5")) do
+		result[path] = hash.md5
+		rehashed_files = rehashed_files + 1
+		rehashed_bytes = rehashed_bytes + hash.size
+		file_hashes_used[path] = ids[path] .. " " .. hash.md5
+		file_hashes_dirty = true
+	end
+	return result
+end
+
+-- Store cache of file hashes. Cache is loaded again on next use. Returns number
+-- of files and bytes that were hashed again since cache was loaded.
+function file_hashes_store()
+	if not file_hashes then
+		return 0, 0 -- Cache was not used at all
+	end
+	INFO("Rehashed " .. tostring(rehashed_files) .. " files (" .. tostring(rehashed_bytes) .. " bytes)")
+	-- Entries of files that were not used are kept unless file was removed
+	for path, entry in pairs(file_hashes) do
+		if not file_hashes_used[path] then
+			if file_id(path) then
+				file_hashes_used[path] = entry
+			else
+				file_hashes_dirty = true
+			end
+		end
+	end
+	if file_hashes_dirty then
+		local content = {}
+		for path, entry in pairs(file_hashes_used) do
+			table.insert(content, entry .. " " .. path .. "\n")
+		end
+		local tmp = file_hashes_path .. ".tmp"
+		local ok, perr, err = pcall(utils.write_file, tmp, table.concat(content))
+		err = ok and err or perr
+		if not err then
+			ok, err = os.rename(tmp, file_hashes_path)
+		end
+		if err then
+			WARN("Unable to store file hashes cache: " .. tostring(err))
+		end
+	end
+	local files, bytes = rehashed_files, rehashed_bytes
+	file_hashes = nil
+	file_hashes_used = {}
+	file_hashes_dirty = false
+	rehashed_files, rehashed_bytes = 0, 0
+	return files, bytes
+end
+
 function get_changed_files(files)
 	local changed = {}
+	local hashes = files_md5(utils.set2arr(files))
 	for filename, hash in pairs(files) do
-		if utils.file_exists(filename) then
-			local filehash = md5_file(filename)
-			if filehash ~= hash then
-				table.insert(changed, filename)
-			end
+		local filehash = hashes[filename]
+		if filehash and filehash ~= hash then
+			table.insert(changed, filename)
 		end
 	end
 	return changed
 end
 
+--[[
+Binary database of installed packages (see pkgdb module) is used instead of
+status file and control files of packages if it was created for current state of
+status file and info directory. It is used only in pkg_db operation mode. Hashes
+of files that are not configuration files (as returned by get_nonconf_files) are
+kept here for every package so database can be written without reading control
+files of all packages again.
+]]
+local pkg_nonconf = {}
+-- Path and stamp of package database that is known to be up to date
+local pkg_db_valid = nil
+
+--[[
+Packages parsed from status file have list of files, fields from control file
+and list of changed files loaded from info directory on first access. Only
+status file has to be read that way if those are not needed. This maps package
+to set of not yet loaded parts ("files", "control" and "ChangedFiles").
+]]
+local pkg_lazy = setmetatable({}, {__mode = "k"})
+-- Fields of package stored in status file (see pkg_status_dump)
+local status_fields = utils.arr2set({"Package", "Version", "Depends", "Conflicts", "Status", "Architecture", "Conffiles", "Installed-Time", "Auto-Installed"})
+
+local function pkg_installed(pkg)
+	return utils.multi_index(pkg, "Status", 3) ~= "not-installed"
+end
+
+-- Load given part of lazily loaded package (if not loaded already)
+local function pkg_lazy_load(pkg, part)
+	local pending = pkg_lazy[pkg]
+	if not pending or not pending[part] then
+		return
+	end
+	pending[part] = nil
+	if part == "files" then
+		-- Don't read info files if package is not installed
+		if pkg_installed(pkg) then
+			rawset(pkg, "files", pkg_files(pkg.Package))
+		end
+	elseif part == "control" then
+		if pkg_installed(pkg) then
+			merge(pkg, package_postprocess(pkg_control(pkg.Package)))
+		end
+	elseif part == "ChangedFiles" then
+		pkg_nonconf[pkg.Package] = pkg_nonconf[pkg.Package] or get_nonconf_files(pkg)
+		rawset(pkg, "ChangedFiles", get_changed_files(pkg_nonconf[pkg.Package]))
+	end
+end
+
+local pkg_lazy_meta = {
+	__index = function (pkg, key)
+		if key == "files" or key == "ChangedFiles" then
+			pkg_lazy_load(pkg, key)
+		elseif type(key) == "string" and not status_fields[key] then
+			pkg_lazy_load(pkg, "control")
+		end
+		return rawget(pkg, key)
+	end
+}
+
+-- Load files and fields from control file of package if it is lazily loaded
+local function pkg_load(pkg)
+	pkg_lazy_load(pkg, "files")
+	pkg_lazy_load(pkg, "control")
+end
+
+--[[
+Load lazily loaded parts of packages in status (see pkg_lazy). Those are not
+visible to pairs so this has to be called before status is serialized (such as
+to journal). List of changed files requires hashing so it is loaded only for
+packages in given set. It has to be loaded before info files of such package
+are replaced (see pkg_merge_control) as it is computed from them.
+]]
+function status_load(status, changed)
+	for name, pkg in pairs(status) do
+		pkg_load(pkg)
+		if changed[name] then
+			pkg_lazy_load(pkg, "ChangedFiles")
+		end
+	end
+end
+
+-- Returns stamp identifying current state of status file and info directory
+local function pkg_db_stamp()
+	return table.concat({
+		syscnf.status_file, file_id(syscnf.status_file) or "",
+		syscnf.info_dir, file_id(syscnf.info_dir) or ""
+	}, "\n")
+end
+
+-- Store given status to package database under given stamp
+local function pkg_db_store(status, stamp)
+	if not opmode.pkg_db then
+		return
+	end
+	local packages = {}
+	for name, pkg in pairs(status) do
+		pkg_load(pkg)
+		if pkg.files == nil and pkg_installed(pkg) then
+			-- This can happen for status restored from journal
+			DBG("Package database not stored as list of files of ", name, " is not known")
+			return
+		end
+		local fields = {}
+		for field, value in pairs(pkg) do
+			if type(value) == "string" then
+				fields[field] = value
+			end
+		end
+		if type(pkg.Status) == "table" then
+			fields.Status = table.concat(pkg.Status, " ")
+		end
+		if type(pkg.Conffiles) == "table" then
+			fields.Conffiles = conffiles_dump(pkg.Conffiles)
+		end
+		pkg_nonconf[name] = pkg_nonconf[name] or get_nonconf_files(pkg)
+		packages[name] = {fields = fields, files = pkg.files, nonconf = pkg_nonconf[name]}
+	end
+	local ok, err = pkgdb.write(syscnf.pkg_db_file, stamp, packages)
+	if ok then
+		pkg_db_valid = syscnf.pkg_db_file .. "\n" .. stamp
+	else
+		WARN("Unable to store package database: " .. tostring(err))
+	end
+end
+
+-- Read status from package database. Returns nil if there is no valid database.
+local function pkg_db_parse(stamp)
+	if not opmode.pkg_db then
+		return nil
+	end
+	local db = pkgdb.load(syscnf.pkg_db_file, stamp)
+	if not db then
+		return nil
+	end
+	DBG("Using package database ", syscnf.pkg_db_file)
+	pkg_db_valid = syscnf.pkg_db_file .. "\n" .. stamp
+	local result = {}
+	for name, record in pairs(db) do
+		local pkg = record.fields
+		-- Same as in status file there are no files for not installed packages
+		if not (pkg.Status or ""):match("not%-installed") then
+			pkg.files = record.files or {}
+		end
+		pkg_nonconf[name] = record.nonconf
+		pkg = package_postprocess(pkg)
+		-- Everything but list of changed files is in database
+		pkg_lazy[pkg] = {ChangedFiles = true}
+		result[name] = setmetatable(pkg, pkg_lazy_meta)
+	end
+	return result
+end
+
+--[[
+Parse status of installed packages. Package database is used if it is up to
+date. Otherwise status file is parsed and files of packages in info directory
+are read on first access to fields that are not in status file.
+]]
 function status_parse()
 	DBG("Parsing status file ", syscnf.status_file)
-	local result = {}
+	pkg_nonconf = {}
+	local stamp = pkg_db_stamp()
+	local result = pkg_db_parse(stamp)
+	if result then
+		return result
+	end
+	result = {}
 	local f, err = io.open(syscnf.status_file)
 	if f then
 		local content = f:read("*a")
 		f:close()
 		if not content then error("Failed to read content of the status file") end
-		for block in block_split(content) do
-			local pkg = block_parse(block)
-			-- Don't read info files if package is not installed
-			if not (pkg.Status or ""):match("not%-installed") then
-				merge(pkg, pkg_control(pkg.Package))
-				pkg.files = pkg_files(pkg.Package)
-			end
-			-- Get list of changed files (without config files)
-			-- and put it into the journal
-			pkg.ChangedFiles = get_changed_files(get_nonconf_files(pkg))
+		for pkg in control_blocks(content) do
 			pkg = package_postprocess(pkg)
-			result[pkg.Package] = pkg
+			-- Info files are read on first access (see pkg_lazy)
+			pkg_lazy[pkg] = {files = true, control = true, ChangedFiles = true}
+			result[pkg.Package] = setmetatable(pkg, pkg_lazy_meta)
 		end
 	else
 		error("Couldn't read status file " .. syscnf.status_file .. ": " .. err)
 	end
+	-- Package database is stored with status file as it requires all info files
 	return result
 end
 
+-- Fields of packages in repository index that are needed for every package.
+-- Rest of the fields is decoded only for packages that are accessed.
+local repo_eager_fields = {"Package", "Version", "Filename", "Provides", "Depends", "Conflicts"}
+
+--[[
+Start decompression (of gzip compressed index) and parsing of repository index
+in background thread. Returned object can be passed to repo_parse instead of
+index content. Errors are reported by repo_parse.
+]]
+function repo_prepare(content)
+	return control_prepare(content, repo_eager_fields)
+end
+
 function repo_parse(content)
 	local result = {}
-	for block in block_split(content) do
-		local pkg = block_parse(block)
-		if next(pkg) then -- Problems with empty indices...
-			-- Some fields are not present here (conffiles, status), but there are just ignored.
-			pkg = package_postprocess(pkg)
+	local blocks
+	if type(content) == "string" then
+		blocks = control_lazy_blocks(content, repo_eager_fields, package_postprocess)
+	else -- prepared by repo_prepare
+		blocks = content:lazy_blocks(package_postprocess)
+	end
+	-- Some fields are not present here (conffiles, status), but there are just ignored.
+	for pkg in blocks do
+		if rawget(pkg, "Package") then -- Problems with empty indices...
 			result[pkg.Package] = pkg
 		end
 	end
 	return result
 end
 
+--[[
+Write status file. Blocks of packages that were not changed are kept in order
+they have in current status file and changed or new packages are appended after
+them. Only part of file after the first modified block is written (beginning is
+shared with current file if file system supports it) and file is not written at
+all if nothing changed. This spares flash of devices that update often with no or
+small changes. Package database is updated as well.
+]]
 function status_dump(status)
-	DBG("Writing status file ", syscnf.status_file)
-	--[[
-	Use a temporary file, so we don't garble the real and precious file.
-	Write the thing first and then switch attomicaly.
-	]]
-	local tmp_file = syscnf.status_file .. ".tmp"
-	local f, err = io.open(tmp_file, "w")
-	if f then
-		for _, pkg in pairs(status) do
-			f:write(pkg_status_dump(pkg), "\n")
+	local blocks = {}
+	for name, pkg in pairs(status) do
+		blocks[name] = pkg_status_dump(pkg) .. "\n"
+	end
+	local current = utils.read_file(syscnf.status_file) or ""
+	local content = {}
+	local keep = 0 -- Length of not modified beginning of status file
+	local pos = 1
+	while pos <= #current do
+		local sep = current:find("\n\n", pos, true)
+		local block = current:sub(pos, sep and sep + 1)
+		local name = block:match("^Package: ([^\n]*)\n")
+		if name and blocks[name] == block then
+			table.insert(content, block)
+			blocks[name] = nil
+			if keep + 1 == pos then
+				keep = keep + #block
+			end
+		end
+		pos = pos + #block
+	end
+	local changed = utils.set2arr(blocks)
+	table.sort(changed)
+	for _, name in ipairs(changed) do
+		table.insert(content, blocks[name])
+	end
+	content = table.concat(content)
+	if content == current then
+		DBG("Status file ", syscnf.status_file, " not modified")
+	else
+		DBG("Writing status file ", syscnf.status_file, " from offset ", keep)
+		--[[
+		Use a temporary file, so we don't garble the real and precious file.
+		Write the thing first and then switch attomicaly.
+		]]
+		local tmp_file = syscnf.status_file .. ".tmp"
+		if keep > 0 then
+			clone_write(tmp_file, syscnf.status_file, keep, content:sub(keep + 1))
+		else
+			local f, err = io.open(tmp_file, "w")
+			if not f then
+				error("Couldn't write status file " .. tmp_file .. ": " .. err)
+			end
+			f:write(content)
+			f:close()
 		end
-		f:close()
 		-- Override the resulting file (btrfs guarantees the data is there once we rename it)
 		local _, err = os.rename(tmp_file, syscnf.status_file)
 		if err then
 			error("Couldn't rename status file " .. tmp_file .. " to " .. syscnf.status_file .. ": " .. err)
 		end
-	else
-		error("Couldn't write status file " .. tmp_file .. ": " .. err)
+	end
+	local stamp = pkg_db_stamp()
+	if syscnf.pkg_db_file .. "\n" .. stamp ~= pkg_db_valid then
+		pkg_db_store(status, stamp)
 	end
 end
 
@@ -434,10 +778,105 @@ TODO:
 function pkg_unpack(package_path)
 	utils.mkdirp(syscnf.pkg_unpacked_dir)
 	local sdir = mkdtemp(syscnf.pkg_unpacked_dir)
-	archive.unpack_package(package_path, sdir)
+	local err = archive.unpack_package(package_path, sdir)
+	if err then
+		utils.cleanup_dirs({sdir})
+		error(utils.exception("corruption", "Unpack of package " .. package_path .. " failed: " .. err))
+	end
 	return sdir
 end
 
+--[[
+Apply binary delta to base package and write resulting package to output. Delta
+is expected to be created by zstd with option --patch-from against base package.
+It raises error of type "corruption" if delta can't be applied.
+]]
+function pkg_delta_apply(base, delta, output)
+	local ec, err
+	events_wait(run_util(function (ecode, _, _, stderr)
+		ec = ecode
+		err = stderr
+	end, nil, nil, cmd_timeout, cmd_kill_timeout, "zstd", "-d", "-q", "-f", "--patch-from=" .. base, delta, "-o", output))
+	if ec ~= 0 then
+		os.remove(output)
+		error(utils.exception("corruption", "Application of delta " .. delta .. " failed: " .. tostring(err)))
+	end
+end
+
+--[[
+Packages cache contains verified packages. It is content addressed, package files
+are named by their SHA256 sum. Modification time of file is updated every time
+package is used and least recently used packages are removed once cache size
+exceeds pkg_cache_size. New packages are staged first and they are added to cache
+only once transaction is committed so packages still installed (bases for deltas)
+are not evicted in favour of those that might never be installed.
+]]
+-- Returns path to cached package with given SHA256 sum or nil if not cached.
+-- Staged packages are returned as well so they can be used when transaction they
+-- were staged for failed and is retried.
+function pkg_cache_get(sum)
+	local path = syscnf.pkg_cache_dir .. sum .. ".ipk"
+	if stat(path) == "r" then
+		touch(path)
+		return path
+	end
+	if stat(path .. ".staged") == "r" then
+		return path .. ".staged"
+	end
+	return nil
+end
+
+-- Remove least recently used packages from cache so it fits to pkg_cache_size
+local function pkg_cache_evict()
+	local total = 0
+	local entries = {}
+	for fname in pairs(ls(syscnf.pkg_cache_dir)) do
+		local path = syscnf.pkg_cache_dir .. fname
+		local _, _, size, mtime = stat(path)
+		if size then
+			total = total + size
+			table.insert(entries, {path = path, size = size, mtime = mtime})
+		end
+	end
+	table.sort(entries, function (a, b) return a.mtime < b.mtime end)
+	for _, entry in ipairs(entries) do
+		if total <= pkg_cache_size then
+			break
+		end
+		DBG("Removing package from cache: " .. entry.path)
+		os.remove(entry.path)
+		total = total - entry.size
+	end
+end
+
+-- Stage package file with given SHA256 sum to be stored to cache (see
+-- pkg_cache_commit)
+function pkg_cache_store(file, sum)
+	local path = syscnf.pkg_cache_dir .. sum .. ".ipk"
+	utils.mkdirp(syscnf.pkg_cache_dir)
+	if stat(path) ~= "r" then
+		-- Copy to temporally file first so cache never contains partial package
+		copy(file, path .. ".tmp")
+		move(path .. ".tmp", path .. ".staged")
+	else
+		touch(path)
+	end
+end
+
+-- Add all staged packages to cache and remove least recently used ones if cache
+-- is too big. This is called once transaction is committed.
+function pkg_cache_commit()
+	if stat(syscnf.pkg_cache_dir) ~= "d" then
+		return
+	end
+	for fname in pairs(ls(syscnf.pkg_cache_dir)) do
+		if fname:match("%.ipk%.staged$") then
+			move(syscnf.pkg_cache_dir .. fname, syscnf.pkg_cache_dir .. fname:sub(1, -8))
+		end
+	end
+	pkg_cache_evict()
+end
+
 --[[
 Look into the dir with unpacked package (the one containing control and data subdirs).
 Return four tables:
@@ -469,19 +908,27 @@ function pkg_examine(dir)
 	local cidx = io.open(control_dir .. "/conffiles")
 	local conffiles = {}
 	if cidx then
+		local paths = {}
 		for l in cidx:lines() do
 			local fname = l:match("^%s*(/.*%S)%s*")
 			if utils.file_exists(data_dir .. fname) then
-				conffiles[fname] = sha256_file(data_dir .. fname)
+				paths[data_dir .. fname] = fname
 			else
 				error("File " .. fname .. " does not exist.")
 			end
 		end
 		cidx:close()
+		local hashes, errors = hashing.files(utils.set2arr(paths), "sha256")
+		for path, fname in pairs(paths) do
+			if not hashes[path] then
+				error("Unable to hash file " .. fname .. ": " .. errors[path])
+			end
+			conffiles[fname] = hashes[path].sha256
+		end
 	end
 	conffiles = slashes_sanitize(conffiles)
 	-- Load the control file of the package and parse it
-	local control = package_postprocess(block_parse(utils.read_file(control_dir .. "/control")));
+	local control = package_postprocess(control_parse(utils.read_file(control_dir .. "/control")));
 	-- Complete the control structure
 	control.files = files
 	if next(conffiles) then -- Don't store empty config files
@@ -509,6 +956,9 @@ The current_status is what is returned from status_parse(). The remove_pkgs
 is set of package names (without versions) to remove. It's not a problem if
 the package is not installed. The add_pkgs is a table, keys are names of packages
 (without versions), the values are sets of the files the new package will own.
+Files of other installed packages are looked up in package database if it is up
+to date with status file (so current_status has to be status of installed
+packages, not modified one).
 
 It returns a table, values are name of files where are new collisions, values
 are tables where the keys are names of packages and values are either `existing`
@@ -553,13 +1003,21 @@ function collision_check(current_status, remove_pkgs, add_pkgs)
 		end
 		add(fname, "file")
 	end
-	-- Populate tree with files from currently installed packages
-	for name, status in pairs(current_status) do
-		for f in pairs(status.files or {}) do
-			add_file_to_tree(f, name, false)
-			 -- if package is not going to be updater or removed then also add it as new one
-			if not remove_pkgs[name] and not add_pkgs[name] then
-				add_file_to_tree(f, name, true)
+	local function add_installed_file(file_path, package)
+		add_file_to_tree(file_path, package, false)
+		 -- if package is not going to be updater or removed then also add it as new one
+		if not remove_pkgs[package] and not add_pkgs[package] then
+			add_file_to_tree(file_path, package, true)
+		end
+	end
+	-- Paths of files of packages that are added or removed
+	local paths = {}
+	-- Populate tree with files of installed packages that are going to be updated or removed
+	for _, pkgs in pairs({remove_pkgs, add_pkgs}) do
+		for name in pairs(pkgs) do
+			for f in pairs(utils.multi_index(current_status, name, "files") or {}) do
+				add_installed_file(f, name)
+				paths[f] = true
 			end
 		end
 	end
@@ -567,6 +1025,32 @@ function collision_check(current_status, remove_pkgs, add_pkgs)
 	for name, files in pairs(add_pkgs) do
 		for f in pairs(files) do
 			add_file_to_tree(f, name, true)
+			paths[f] = true
+		end
+	end
+	--[[
+	Populate tree with files from other installed packages. Only files that can
+	collide with paths of added and removed packages are needed and those are
+	looked up in package database. If it is not available then all files are
+	added.
+	]]
+	local stamp = pkg_db_stamp()
+	local owners = pkg_db_valid == syscnf.pkg_db_file .. "\n" .. stamp and pkgdb.owners(syscnf.pkg_db_file, stamp, paths)
+	if owners then
+		for f, pkgs in pairs(owners) do
+			for name in pairs(pkgs) do
+				if not remove_pkgs[name] and not add_pkgs[name] then
+					add_installed_file(f, name)
+				end
+			end
+		end
+	else
+		for name, status in pairs(current_status) do
+			if not remove_pkgs[name] and not add_pkgs[name] then
+				for f in pairs(status.files or {}) do
+					add_installed_file(f, name)
+				end
+			end
 		end
 	end
 
@@ -706,6 +1190,54 @@ function steal_configs(current_status, installed_confs, configs)
 	return steal
 end
 
+-- Hashes of config files cached during transaction (indexed by path)
+local config_hashes = nil
+
+--[[
+Start caching of config files hashes. Every file is then hashed only once during
+transaction unless it is modified. Entries are validated against file identity
+(see file_id) and dropped when file is replaced or removed by updater itself.
+]]
+function config_hashes_start()
+	config_hashes = {}
+end
+
+-- Stop caching of config files hashes and drop all cached ones
+function config_hashes_stop()
+	config_hashes = nil
+end
+
+-- Drop cached hash of given path (it is about to be modified)
+local function config_hash_forget(path)
+	if config_hashes then
+		config_hashes[path:gsub("/+", "/")] = nil
+	end
+end
+
+-- Returns hash of given file computed by given algorithm or nil if file can't be read
+local function config_hash(path, algo)
+	local id = file_id(path)
+	if not id then
+		return nil
+	end
+	path = path:gsub("/+", "/")
+	local entry = config_hashes and config_hashes[path]
+	if not entry or entry.id ~= id then
+		entry = {id = id}
+	end
+	if not entry[algo] then
+		local hashes = hashing.files({path}, algo)
+		if not hashes[path] then
+			return nil
+		end
+		entry[algo] = hashes[path][algo]
+		if config_hashes then
+			config_hashes[path] = entry
+		end
+	end
+	return entry[algo]
+end
+
 --[[
 Move anything on given path to opkg_collided_dir. This backups and removes original files.
 When keep is set to true, file is copied instead of moved.
@@ -722,6 +1254,7 @@ function user_path_move(path, keep)
 		fpath = fpath .. "/" .. dir .. randex
 	end
 	WARN("Collision with existing path. Moving " .. path .. " to " .. fpath)
+	config_hash_forget(path)
 	 -- fpath is directory so path will be placed to that directory
 	 -- If in fpath is file of same name, then it is replaced. And if there is
 	 -- directory of same name then it is placed inside. But lets not care.
@@ -790,6 +1323,7 @@ function pkg_merge_files(dir, dirs, files, configs)
 				-- If there is directory on target path, file would be places inside that directory without warning. Move it away instead.
 				user_path_move(result)
 			end
+			config_hash_forget(result)
 			move(dir .. f, result)
 		end
 	end
@@ -810,6 +1344,8 @@ function pkg_merge_control(dir, name, files)
 	First, make sure there are no leftover files from previous version
 	(the new version might removed a postinst script, or something).
 	]]
+	-- Control files of package are replaced so its hashes have to be read again
+	pkg_nonconf[name] = nil
 	local prefix = name .. '.'
 	local plen = prefix:len()
 	for fname in pairs(ls(syscnf.info_dir)) do
@@ -877,6 +1413,7 @@ function pkg_cleanup_files(files, rm_configs)
 			DBG("Not removing config " .. f .. ", as it has been modified")
 		else
 			DBG("Removing file " .. path)
+			config_hash_forget(path)
 			local ok, err = pcall(function () os.remove(path) end)
 			-- If it failed because the file didn't exist, that's OK. Mostly.
 			if not ok then
@@ -1067,32 +1604,30 @@ is returned.
 function config_modified(file, hash)
 	DBG("Checking if file " .. file .. " is modified against " .. hash)
 	local len = hash:len()
-	local hasher
+	local algo
 	if len == 32 then
-		hasher = md5_file
+		algo = "md5"
 	elseif len == 64 then
-		hasher = sha256_file
+		algo = "sha256"
 	elseif len > 32 and len < 64 then
 		--[[
 		Something produces (produced?) truncated hashes in the status file.
 		Handle them. This is likely already fixed, but we don't want to
 		crash on system that still have these broken hashes around.
 		]]
-		hasher = function (file)
-			WARN("Truncated sha256 hash seen, using bug compat mode")
-			return sha256_file(file):sub(1, len)
-		end
+		WARN("Truncated sha256 hash seen, using bug compat mode")
+		algo = "sha256"
 	else
 		error("Can not determine hash algorithm to use for hash " .. hash)
 	end
-	if utils.file_exists(file) then
-		local got = hasher(file):lower()
-		hash = hash:lower()
-		DBG("Hashes: for " .. file .. ": " .. got .. " " .. hash)
-		return hasher(file):lower() ~= hash:lower()
-	else
+	local got = config_hash(file, algo)
+	if not got then
 		return nil
 	end
+	got = got:sub(1, len)
+	hash = hash:lower()
+	DBG("Hashes: for " .. file .. ": " .. got .. " " .. hash)
+	return got ~= hash
 end
 
 --[[
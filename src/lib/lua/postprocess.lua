@@ -24,81 +24,223 @@ local error = error
 local pcall = pcall
 local next = next
 local type = type
+local rawget = rawget
+local setmetatable = setmetatable
 local table = table
-local string = string
 local DBG = DBG
 local WARN = WARN
 local ERROR = ERROR
-local archive = archive
+local sha256 = sha256
+local snapshot = snapshot
 local utils = require "utils"
 local backend = require "backend"
 local requests = require "requests"
+local syscnf = require "syscnf"
 
 module "postprocess"
 
--- luacheck: globals get_repos deps_canon conflicts_canon available_packages pkg_aggregate run sort_candidates
+-- luacheck: globals get_repos deps_canon conflicts_canon index_deps available_packages pkg_aggregate run sort_candidates
 
-local function repo_parse(repo)
-	repo.tp = 'parsed-repository'
-	repo.content = {}
+--[[
+Start processing of repository index. Index is used from snapshot if it was not
+modified. Otherwise it is decompressed and parsed in background thread. This is
+called as soon as index is downloaded so it overlaps with downloads of the rest
+of the indexes. Returned table is passed to repo_parse.
+]]
+local function repo_prepare(repo)
 	local name = repo.name .. "/" .. repo.index_uri:uri()
 	-- Get index
 	local index = repo.index_uri:finish() -- TODO error?
-	if index:sub(1, 2) == string.char(0x1F, 0x8B) then -- compressed index
-		DBG("Decompressing index " .. name)
-		index = archive.decompress(index)
+	if repo.index_uri:is_cached() then
+		DBG("Index not modified, using cached copy " .. name)
+	end
+	-- Snapshot of parsed index is valid only for index it was created from
+	local prepared = {
+		name = name,
+		snap_path = syscnf.index_cache_dir .. sha256(repo.index_uri:uri()) .. ".snap",
+		snap_key = sha256(index),
+	}
+	prepared.list = snapshot.load(prepared.snap_path, prepared.snap_key)
+	if prepared.list then
+		DBG("Using snapshot of parsed index " .. name)
+	else
+		DBG("Parsing index " .. name)
+		prepared.index = backend.repo_prepare(index)
+	end
+	return prepared
+end
+
+-- Finish parsing of repository index started by repo_prepare. Parsed index is
+-- stored as snapshot for the next run.
+local function repo_parse(repo, prepared)
+	repo.tp = 'parsed-repository'
+	repo.content = {}
+	local name = prepared.name
+	local list = prepared.list
+	if not list then
+		local ok
+		ok, list = pcall(backend.repo_parse, prepared.index)
+		if ok then
+			for _, pkg in pairs(list) do
+				pkg.index_deps = index_deps(pkg)
+			end
+			local written, err = pcall(utils.mkdirp, syscnf.index_cache_dir)
+			if written then
+				written, err = snapshot.write(prepared.snap_path, prepared.snap_key, list)
+			end
+			if not written then
+				WARN("Unable to store snapshot of index " .. name .. ": " .. tostring(err))
+			end
+		else
+			local msg = "Couldn't parse the index of " .. name .. ": " .. tostring(list)
+			if not repo.optional then
+				error(utils.exception('syntax', msg))
+			end
+			WARN(msg)
+			-- TODO we might want to ignore this repository in its fulles instead of this
+		end
 	end
-	-- Parse index
-	DBG("Parsing index " .. name)
-	local ok, list = pcall(backend.repo_parse, index)
-	if not ok then
-		local msg = "Couldn't parse the index of " .. name .. ": " .. tostring(list)
-		if not repo.optional then
-			error(utils.exception('syntax', msg))
+	local repo_uri = repo.repo_uri
+	for _, mirror in ipairs(repo.mirrors) do
+		if mirror.index_uri == repo.index_uri then
+			repo_uri = mirror.repo_uri
 		end
-		WARN(msg)
-		-- TODO we might want to ignore this repository in its fulles instead of this
 	end
 	for _, pkg in pairs(list) do
 		-- Compute the URI of each package (but don't download it yet, so don't create the uri object)
-		pkg.uri_raw = repo.repo_uri .. '/' .. pkg.Filename
+		pkg.uri_raw = repo_uri .. '/' .. pkg.Filename
 		pkg.repo = repo
 	end
 	repo.content = list
 end
 
+-- Select mirror that won the race of index download. Local mirror is always
+-- preferred as it is not downloaded at all.
+local function repo_mirror_select(repo)
+	if #repo.mirrors < 2 then
+		return
+	end
+	local selected
+	for _, mirror in ipairs(repo.mirrors) do
+		if mirror.index_uri:is_local() then
+			selected = mirror
+			break
+		elseif not selected and mirror.index_uri:race_won() then
+			selected = mirror
+		end
+	end
+	if selected then
+		DBG("Using mirror " .. selected.repo_uri .. " for repository " .. repo.name)
+		repo.index_uri = selected.index_uri
+	end
+end
+
+-- Check if index of repository can be parsed while other downloads continue.
+-- That is when index of mirror to be selected is downloaded.
+local function repo_ready(repo)
+	if #repo.mirrors < 2 then
+		return repo.index_uri:is_ready()
+	end
+	for _, mirror in ipairs(repo.mirrors) do
+		local iuri = mirror.index_uri
+		if iuri:is_local() or (iuri:race_won() and iuri:is_ready()) then
+			return true
+		end
+	end
+	return false
+end
+
+--[[
+Download of index failed for all mirrors or mirror that won the race failed later
+on. Mirrors it won over and local mirrors (those are not downloaded) are still
+considered as working so we try them again. Returns false if there is no such
+mirror.
+]]
+local function repo_mirrors_retry(repo, uri_fail)
+	local mirrors = {}
+	local racing
+	for _, mirror in ipairs(repo.mirrors) do
+		if mirror.index_uri:is_local() then
+			table.insert(mirrors, mirror)
+		elseif mirror.index_uri:is_cancelled() then
+			-- Derived URI inherits all configuration except signature, cache and race
+			local iuri = requests.repositories_uri_master:to_buffer(mirror.index_uri:uri(), mirror.index_uri)
+			if repo.sig then
+				iuri:set_sig(repo.sig)
+			end
+			iuri:set_cache(syscnf.index_cache_dir .. sha256(iuri:uri()))
+			iuri:set_notify(true)
+			if racing then
+				iuri:race_join(racing)
+			end
+			racing = racing or iuri
+			table.insert(mirrors, {repo_uri = mirror.repo_uri, index_uri = iuri})
+		end
+	end
+	if not next(mirrors) then
+		return false
+	end
+	WARN("Download failed for repository index " .. repo.name .. " (" ..
+		uri_fail:uri() .. "): " .. tostring(uri_fail:download_error()) ..
+		". Trying other mirrors.")
+	repo.mirrors = mirrors
+	repo.index_uri = mirrors[1].index_uri
+	return true
+end
+
 local function repos_failed_download(uri_fail)
 	-- Locate failed repository and check if we can continue
 	for _, repo in pairs(requests.known_repositories) do
-		if uri_fail == repo.index_uri then
-			local message = "Download failed for repository index " ..
-				repo.name .. " (" .. repo.index_uri:uri() .. "): " ..
-				tostring(repo.index_uri:download_error())
-			if not repo.optional then
-				error(utils.exception('repo missing', message))
+		for _, mirror in ipairs(repo.mirrors) do
+			if uri_fail == mirror.index_uri then
+				if repo_mirrors_retry(repo, uri_fail) then
+					return
+				end
+				local message = "Download failed for repository index " ..
+					repo.name .. " (" .. uri_fail:uri() .. "): " ..
+					tostring(uri_fail:download_error())
+				if not repo.optional then
+					error(utils.exception('repo missing', message))
+				end
+				WARN(message)
+				repo.tp = 'failed-repository'
+				return
 			end
-			WARN(message)
-			repo.tp = 'failed-repository'
-			break
 		end
 	end
 end
 
 function get_repos()
 	DBG("Downloading repositories indexes")
-	-- Run download
+	local prepared = {}
+	local function prepare(repo)
+		repo_mirror_select(repo)
+		prepared[repo] = repo_prepare(repo)
+	end
+	-- Run download. Index is prepared as soon as it is downloaded.
 	while true do
-		local uri_fail = requests.repositories_uri_master:download()
-		if uri_fail then
+		local uri_fail, finished = requests.repositories_uri_master:download()
+		if finished then
+			for _, repo in pairs(requests.known_repositories) do
+				if repo.tp == 'repository' and not prepared[repo] and repo_ready(repo) then
+					prepare(repo)
+				end
+			end
+		elseif uri_fail then
 			repos_failed_download(uri_fail)
 		else
 			break
 		end
 	end
-	-- Collect indexes and parse them
+	-- Prepare the rest of the indexes so all of them are processed in parallel
+	for _, repo in pairs(requests.known_repositories) do
+		if repo.tp == 'repository' and not prepared[repo] then -- ignore failed repositories
+			prepare(repo)
+		end
+	end
 	for _, repo in pairs(requests.known_repositories) do
-		if repo.tp == 'repository' then -- ignore failed repositories
-			local ok, err = pcall(repo_parse, repo)
+		if repo.tp == 'repository' and prepared[repo] then
+			local ok, err = pcall(repo_parse, repo, prepared[repo])
 			if not ok then
 				-- TODO is this fatal?
 				error(err)
@@ -239,6 +381,34 @@ function conflicts_canon(conflicts)
 	return dep
 end
 
+-- Canonical dependencies of packages indexed by their Depends and Conflicts
+-- fields. Same fields are common across packages and repositories so this way
+-- they share single dependency tree. Values are weak so trees no longer used by
+-- any package are collected.
+local index_deps_memo = setmetatable({}, {__mode = "v"})
+
+--[[
+Canonical dependencies of package from repository (Depends and negative
+dependencies from Conflicts). Returned tree can be shared with other packages
+and must not be modified. Dependencies already present in package (loaded from
+snapshot) are used if there are no memoised ones.
+]]
+function index_deps(pkg)
+	if not pkg.Depends and not pkg.Conflicts then
+		return nil
+	end
+	local key = (pkg.Depends or "") .. "\0" .. (pkg.Conflicts or "")
+	local deps = index_deps_memo[key]
+	if not deps then
+		deps = rawget(pkg, "index_deps") or deps_canon(utils.arr_prune({
+			pkg.Depends,
+			conflicts_canon(pkg.Conflicts)
+		}))
+		index_deps_memo[key] = deps
+	end
+	return deps
+end
+
 --[[
 Sort all given candidates according to following criteria.
 
@@ -403,11 +573,14 @@ function pkg_aggregate()
 		-- Canonize dependencies
 		modifier.deps = deps_canon(modifier.deps)
 		for _, candidate in ipairs(pkg_group.candidates or {}) do
-			candidate.deps = deps_canon(utils.arr_prune({
-				candidate.deps, -- deps from updater configuration file
-				candidate.Depends, -- Depends from repository
-				conflicts_canon(candidate.Conflicts) -- Negative dependencies from repository
-			}))
+			if candidate.deps then
+				candidate.deps = deps_canon(utils.arr_prune({
+					candidate.deps, -- deps from updater configuration file
+					index_deps(candidate), -- Depends and Conflicts from repository
+				}))
+			else
+				candidate.deps = index_deps(candidate) -- shared with other candidates
+			end
 		end
 		pkg_group.modifier = modifier
 		-- We merged them together, they are no longer needed separately
@@ -33,9 +33,11 @@ local require = require
 local tostring = tostring
 local assert = assert
 local table = table
+local sha256 = sha256
 local utils = require "utils"
 local uri = require "uri"
 local backend = require "backend"
+local syscnf = require "syscnf"
 local opmode = opmode
 local DBG = DBG
 local WARN = WARN
@@ -43,7 +45,7 @@ local ERROR = ERROR
 
 module "requests"
 
--- luacheck: globals known_packages known_repositories repositories_uri_master repo_serial repository content_requests install uninstall mode script package
+-- luacheck: globals known_packages known_repositories repositories_uri_master repo_serial repository content_requests install uninstall mode downloads script package
 
 -- Verifications fields are same for script, repository and package. Lets define them here once and then just append.
 local allowed_extras_verification = {
@@ -275,18 +277,50 @@ function repository(context, name, repo_uri, extra)
 	extra_check_verification("repository", extra)
 	extra_annul_ignore(extra, 'Repository extra option "ignore" is obsolete and should not be used. Use "optional" instead.', true)
 
-	local function register_repo(u, repo_name)
+	-- Repository can be provided by multiple mirrors (ordered list of URIs)
+	local repo_uris = repo_uri
+	if type(repo_uri) == "string" then
+		repo_uris = {repo_uri}
+	elseif type(repo_uri) ~= "table" or not next(repo_uri) then
+		error(utils.exception("bad value", "Repository URI has to be string or non-empty table of strings for repository " .. tostring(name)))
+	end
+	for _, u in ipairs(repo_uris) do
+		if type(u) ~= "string" then
+			error(utils.exception("bad value", "Invalid type " .. type(u) .. " of mirror URI for repository " .. tostring(name)))
+		end
+	end
+
+	-- Index is located in given subdirectory of every mirror but packages are
+	-- still relative to mirror URI itself.
+	local function register_repo(uris, repo_name, subdir)
 		if known_repositories[repo_name] then
-			ERROR("Repository of name '" .. repo_name "' was already added. Repetition is ignored.")
+			ERROR("Repository of name '" .. repo_name .. "' was already added. Repetition is ignored.")
 			return
 		end
-		local iuri = repositories_uri_master:to_buffer(u .. "/" .. (extra.index or "Packages"), context.parent_script_uri)
-		utils.uri_config(iuri, extra)
+		local mirrors = {}
+		local racing
+		for _, u in ipairs(uris) do
+			local index_base = subdir and (u .. '/' .. subdir) or u
+			local iuri = repositories_uri_master:to_buffer(index_base .. "/" .. (extra.index or "Packages"), context.parent_script_uri)
+			utils.uri_config(iuri, extra)
+			-- Index is cached between runs and revalidated using conditional request
+			iuri:set_cache(syscnf.index_cache_dir .. sha256(iuri:uri()))
+			-- Index is parsed as soon as it is downloaded
+			iuri:set_notify(true)
+			if not iuri:is_local() then -- Remote mirrors race for the fastest one
+				if racing then
+					iuri:race_join(racing)
+				end
+				racing = racing or iuri
+			end
+			table.insert(mirrors, {repo_uri = u, index_uri = iuri})
+		end
 
 		local repo = {
 			tp = "repository",
-			index_uri = iuri,
+			index_uri = mirrors[1].index_uri,
 			repo_uri = repo_uri,
+			mirrors = mirrors,
 			name = repo_name,
 			serial = repo_serial,
 			pkg_hash_required = true,
@@ -300,10 +334,10 @@ function repository(context, name, repo_uri, extra)
 	if extra.subdirs then
 		WARN('Repository extra option "subdirs" is obsolete and should not be used anymore.')
 		for _, sub in pairs(extra.subdirs) do
-			register_repo(repo_uri .. '/' .. sub, name .. '-' .. sub)
+			register_repo(repo_uris, name .. '-' .. sub, sub)
 		end
 	else
-		register_repo(repo_uri, name)
+		register_repo(repo_uris, name)
 	end
 end
 
@@ -386,6 +420,9 @@ local known_modes = {
 	["reinstall_all"] = true,
 	["no_removal"] = true,
 	["optional_installs"] = true,
+	["stream_unpack"] = true,
+	["delta_update"] = true,
+	["pkg_cache"] = true,
 }
 
 function mode(_, ...)
@@ -398,6 +435,31 @@ function mode(_, ...)
 	end
 end
 
+local allowed_downloads_extras = {
+	["total"] = utils.arr2set({"number"}),
+	["per_host"] = utils.arr2set({"number"}),
+	["adaptive"] = utils.arr2set({"boolean"}),
+}
+
+-- Configured limit for all connections. It is not read back from downloader as
+-- in adaptive mode that returns current effective limit instead.
+local downloads_total = nil
+
+function downloads(_, extra)
+	extra = allowed_extras_check_type(allowed_downloads_extras, "downloads", extra or {})
+	local total = extra.total or downloads_total or uri.download_limits()
+	local per_host = extra.per_host or 0
+	if total < 1 or total % 1 ~= 0 then
+		error(utils.exception("bad value", "Invalid total limit of connections for downloads: " .. tostring(total)))
+	end
+	if per_host < 0 or per_host % 1 ~= 0 then
+		error(utils.exception("bad value", "Invalid per host limit of connections for downloads: " .. tostring(per_host)))
+	end
+	DBG("Downloads limited to " .. tostring(total) .. " connections (per host: " .. tostring(per_host) .. ", adaptive: " .. tostring(extra.adaptive or false) .. ")")
+	uri.download_limits(total, per_host, extra.adaptive or false)
+	downloads_total = total
+end
+
 local allowed_script_extras = {
 	["security"] = utils.arr2set({"string"}),
 	["optional"] = utils.arr2set({"boolean"}),
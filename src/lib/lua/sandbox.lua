@@ -29,6 +29,7 @@ local loadstring = loadstring
 local setfenv = setfenv
 local pcall = pcall
 local setmetatable = setmetatable
+local rawset = rawset
 local tostring = tostring
 local error = error
 local WARN = WARN
@@ -102,6 +103,8 @@ local rest_additional_funcs = {
 }
 
 state_vars = nil
+-- Status of packages state variable installed was created from
+local installed_status = {}
 
 function load_state_vars()
 	local status_ok, run_state = pcall(backend.run_state)
@@ -112,6 +115,7 @@ function load_state_vars()
 		WARN("Couldn't read the status file: " .. tostring(run_state))
 		status = {}
 	end
+	installed_status = status
 	--[[
 	Some state variables provided for each sandbox. They are copied
 	into each, so the fact a sandbox can modified its own copy doesn't
@@ -137,9 +141,9 @@ function load_state_vars()
 		architectures = {'all', (utils.read_file('/etc/openwrt_release') or ""):match("DISTRIB_TARGET='([^'/]*)")},
 		installed = utils.map(status, function (name, pkg)
 			if utils.multi_index(pkg, "Status", 3) == "installed" then
+				-- Files are added on first access (see installed_files)
 				return name, {
 					version = pkg.Version,
-					files = utils.set2arr(pkg.files or {}),
 					configs = utils.set2arr(pkg.Conffiles or {}),
 					-- TODO: We currently don't store the repository anywhere. So we can't provide it.
 					install_time = pkg["Installed-Time"]
@@ -153,6 +157,23 @@ function load_state_vars()
 end
 
 
+--[[
+Provide list of files of installed packages on first access. Reading it requires
+reading of info file of every package and it is rarely used.
+]]
+local function installed_files(installed)
+	for name, pkg in pairs(installed or {}) do
+		setmetatable(pkg, {__index = function (tab, key)
+			if key == "files" then
+				local files = utils.set2arr(utils.multi_index(installed_status, name, "files") or {})
+				rawset(tab, "files", files)
+				return files
+			end
+		end})
+	end
+	return installed
+end
+
 -- Functions to be injected into an environment in the given security level
 local funcs = {
 	Full = {
@@ -189,6 +210,10 @@ local funcs = {
 			mode = "wrap",
 			value = requests.mode
 		},
+		Downloads = {
+			mode = "wrap",
+			value = requests.downloads
+		},
 		Unexport = {
 			mode = "wrap",
 			value = function(context, variable)
@@ -354,6 +379,9 @@ function new(sec_level, parent)
 				load_state_vars()
 			end
 			result.env[n] = utils.clone(state_vars[v.value])
+			if v.value == "installed" then
+				installed_files(result.env[n])
+			end
 		elseif v.mode == "wrap" then
 			result.env[n] = function(...)
 				return v.value(result, ...)
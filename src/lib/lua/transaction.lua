@@ -46,7 +46,7 @@ local sync = sync
 
 module "transaction"
 
--- luacheck: globals perform recover perform_queue recover_pretty queue_remove queue_install queue_install_downloaded cleanup_actions
+-- luacheck: globals perform recover perform_queue recover_pretty queue_remove queue_install queue_install_downloaded queue_install_unpacked cleanup_actions
 
 -- Wrap the call to the maintainer script, and store any possible errors for later use
 local function script(curchangelog, errors_collected, name, suffix, is_upgrade, ...)
@@ -82,7 +82,8 @@ local function pkg_unpack(operations, status)
 				WARN("Package " .. op.name .. " is not installed. Can't remove")
 			end
 		elseif op.op == "install" then
-			local pkg_dir = backend.pkg_unpack(op.file)
+			-- Package can be already unpacked (see queue_install_unpacked)
+			local pkg_dir = op.dir or backend.pkg_unpack(op.file)
 			table.insert(dir_cleanups, pkg_dir)
 			local files, dirs, configs, control = backend.pkg_examine(pkg_dir)
 			to_remove[control.Package] = true
@@ -166,6 +167,15 @@ end
 
 local function pkg_move(status, plan, early_remove, errors_collected, curchangelog)
 	INFO("Running pre-install and pre-rm scripts and merging packages to root file system")
+	-- Info files of installed packages are replaced and status is stored to
+	-- journal after this step so all lazily loaded parts of status are needed now
+	local installing = {}
+	for _, op in ipairs(plan) do
+		if op.op == "install" then
+			installing[op.control.Package] = true
+		end
+	end
+	backend.status_load(status, installing)
 	-- Prepare table of not installed confs for config stealing
 	local installed_confs = backend.installed_confs(status)
 
@@ -291,6 +301,8 @@ local function perform_internal(operations, journal_status, run_state)
 	local dir_cleanups = {}
 	local status = run_state.status
 	local errors_collected = {}
+	-- Config files are checked repeatedly during transaction so hash them only once
+	backend.config_hashes_start()
 	-- Emulate try-finally
 	local ok, err = pcall(function ()
 		-- Make sure the temporary directory for unpacked packages exist
@@ -314,6 +326,7 @@ local function perform_internal(operations, journal_status, run_state)
 		curchangelog:close()
 
 	end)
+	backend.config_hashes_stop()
 	-- Make sure the temporary dirs are removed even if it fails. This will probably be slightly different with working journal.
 	utils.cleanup_dirs(dir_cleanups)
 	if not ok then
@@ -336,6 +349,10 @@ local function perform_internal(operations, journal_status, run_state)
 	step(journal.CLEANED, pkg_cleanup, true, status)
 	-- All done. Mark journal as done.
 	journal.finish()
+	-- Packages staged to cache for this transaction can be used from now on
+	backend.pkg_cache_commit()
+	-- Hashes of installed files computed during transaction are used in next run
+	backend.file_hashes_store()
 	run_state:release()
 	return errors_collected
 end
@@ -451,4 +468,16 @@ function queue_install_downloaded(file, name, version, modifier)
 	})
 end
 
+-- Queue a request to install a package that was already unpacked to given directory.
+function queue_install_unpacked(dir, name, version, modifier)
+	table.insert(queue, {
+		op = "install",
+		dir = dir,
+		name = name,
+		version = version,
+		reboot = modifier.reboot,
+		replan = modifier.replan
+	})
+end
+
 return _M
@@ -18,15 +18,25 @@ along with Updater.  If not, see <http://www.gnu.org/licenses/>.
 ]]--
 
 local next = next
+local unpack = unpack
 local error = error
+local pcall = pcall
+local tostring = tostring
 local ipairs = ipairs
+local pairs = pairs
 local table = table
+local string = string
+local math = math
+local os = os
 local WARN = WARN
 local INFO = INFO
+local DBG = DBG
 local DIE = DIE
-local md5_file = md5_file
 local sha256_file = sha256_file
 local sha256 = sha256
+local hashing = hashing
+local mkdtemp = mkdtemp
+local opmode = opmode
 local reexec = reexec
 local utils = require "utils"
 local syscnf = require "syscnf"
@@ -78,6 +88,7 @@ function prepare(entrypoint)
 			local version_desc = task.package.Version
 			if run_state.status[task.name] then
 				local current_version = run_state.status[task.name].Version
+				task.installed_version = current_version
 				local cmp = backend.version_cmp(task.package.Version, current_version)
 				if cmp > 0 then
 					operation_string = "upgrade"
@@ -103,26 +114,287 @@ function no_tasks()
 	return not next(tasks)
 end
 
+-- Hashes used to verify packages: method of URI (and hashing algorithm) and field of package
+local verify_hashes = {
+	{"md5", "MD5Sum"},
+	{"sha256", "SHA256Sum"}, -- This is supported only by updater (introduced as a fault)
+	{"sha256", "SHA256sum"},
+}
+
+--[[
+Compute sums of packages of given tasks that are needed for verification and
+were not computed while package was downloaded. Sums are stored to task.sums.
+All files are hashed together in a single batch.
+]]
+local function packages_hash(hash_tasks)
+	local paths = {}
+	local algos = {}
+	for _, task in ipairs(hash_tasks) do
+		for _, hash in ipairs(verify_hashes) do
+			local method, field = unpack(hash)
+			if not task.sums and task.package[field] and
+					not (task.real_uri and task.real_uri[method](task.real_uri)) then
+				paths[task.file] = task
+				algos[method] = true
+			end
+		end
+	end
+	local sums = hashing.files(utils.set2arr(paths), utils.set2arr(algos))
+	for path, task in pairs(paths) do
+		task.sums = sums[path] or {}
+	end
+end
+
 function package_verify(task)
+	packages_hash({task})
 	local verified = false
-	local function package_verify_single(func, hash)
-		if task.package[hash] == nil then return end
-		local sum = func(task.file)
-		if sum ~= task.package[hash] then
-			error(utils.exception("corruption", "The " .. hash .. " sum of " .. task.name .. " does not match"))
+	for _, hash in ipairs(verify_hashes) do
+		local method, field = unpack(hash)
+		if task.package[field] ~= nil then
+			-- Prefer sum computed while package was downloaded so we do not have to read it again
+			local sum = task.real_uri and task.real_uri[method](task.real_uri)
+			if not sum then
+				sum = task.sums[method]
+			end
+			if sum ~= task.package[field] then
+				error(utils.exception("corruption", "The " .. field .. " sum of " .. task.name .. " does not match"))
+			end
+			verified = true
 		end
-		verified = true
 	end
-
-	package_verify_single(md5_file, "MD5Sum")
-	package_verify_single(sha256_file, "SHA256Sum") -- This is supported only by updater (introduced as a fault)
-	package_verify_single(sha256_file, "SHA256sum")
 	if not verified then
 		if task.package.repo.pkg_hash_required then
 			error(utils.exception("corruption",
-				"There is not supported hash in repository index to verify package: " + task.name))
+				"There is not supported hash in repository index to verify package: " .. task.name))
+		else
+			WARN("Package has no hash in index to verify it: " .. task.name)
+		end
+	end
+end
+
+-- Remove directories packages were unpacked to in stream_unpack mode
+local function unpacked_cleanup()
+	local dirs = {}
+	for _, task in ipairs(tasks) do
+		table.insert(dirs, task.dir)
+		task.dir = nil
+	end
+	utils.cleanup_dirs(dirs)
+end
+
+-- Log summary of packages download statistics
+local function download_summary()
+	local count, size, time, connect, tls, first_byte = 0, 0, 0, 0, 0, 0
+	local slowest, start, finish
+	for _, task in ipairs(tasks) do
+		local stats = task.real_uri and task.real_uri:download_stats()
+		if stats then
+			count = count + 1
+			size = size + stats.size
+			time = time + stats.total_time
+			start = math.min(start or stats.start, stats.start)
+			finish = math.max(finish or stats.finish, stats.finish)
+			connect = connect + stats.connect_time
+			tls = tls + stats.tls_time
+			first_byte = first_byte + stats.first_byte_time
+			if not slowest or stats.speed < slowest.speed then
+				slowest = {name = task.name, speed = stats.speed}
+			end
+		end
+	end
+	if count == 0 then return end
+	-- Transfers run in parallel so speed is computed from time all of them took
+	local span = finish - start
+	INFO(string.format("Downloaded %d packages (%d bytes) with average speed %.0f B/s",
+		count, size, span > 0 and size / span or 0))
+	DBG(string.format("Average package download times: connect %.3f s, TLS %.3f s, first byte %.3f s, total %.3f s",
+		connect / count, tls / count, first_byte / count, time / count))
+	DBG(string.format("Slowest package download: %s (%.0f B/s)", slowest.name, slowest.speed))
+end
+
+--[[
+Returns delta that can be used to rebuild package of given task from cached
+package of currently installed version or nil if there is no such delta.
+Deltas are advertised in repository index in field Deltas. It is comma separated
+list of entries "VERSION SHA256 FILENAME" where VERSION is version of package
+delta was created against, SHA256 is sum of that package and FILENAME is path to
+delta (relative to repository same as Filename).
+]]
+local function package_delta(task)
+	if not opmode.delta_update or opmode.stream_unpack or not task.package.Deltas then
+		return nil
+	end
+	if not task.installed_version then
+		return nil
+	end
+	for entry in task.package.Deltas:gmatch("[^,]+") do
+		local version, sum, filename = entry:match("^%s*(%S+)%s+(%x+)%s+(%S+)%s*$")
+		if version == task.installed_version then
+			local base = backend.pkg_cache_get(sum:lower())
+			if base then
+				return {base = base, filename = filename}
+			end
+		end
+	end
+	return nil
+end
+
+-- Returns path to package of given task in packages cache or nil if it is not
+-- cached. Cached package is verified first and removed from cache if corrupted.
+local function package_cached(task)
+	if not opmode.pkg_cache and not opmode.delta_update then
+		return nil
+	end
+	local sum = task.package.SHA256sum or task.package.SHA256Sum
+	local path = sum and backend.pkg_cache_get(sum:lower())
+	if path and sha256_file(path) ~= sum:lower() then
+		WARN("Cached package " .. task.name .. " is corrupted. Removing it from cache.")
+		os.remove(path)
+		return nil
+	end
+	return path
+end
+
+-- Create URI for package of given task. Parent is index URI of repository mirror.
+-- Package is taken from cache if present there. Otherwise delta is downloaded
+-- instead of package if there is any usable one.
+local function package_uri(uri_master, task, parent)
+	task.parent_uri = parent
+	task.sums = nil
+	local cached = package_cached(task)
+	task.delta = not cached and not task.delta_failed and package_delta(task) or nil
+	if cached then
+		DBG("Using cached package " .. task.name .. ": " .. cached)
+		if opmode.stream_unpack then
+			task.dir = mkdtemp(syscnf.pkg_unpacked_dir)
+			task.real_uri = uri_master:to_unpacked("file://" .. cached, task.dir)
+		else
+			task.file = syscnf.pkg_download_dir .. task.name .. '-' .. task.package.Version .. '.ipk'
+			task.real_uri = uri_master:to_file("file://" .. cached, task.file)
+		end
+	elseif task.delta then
+		task.file = syscnf.pkg_download_dir .. task.name .. '-' .. task.package.Version .. '.ipk'
+		task.delta.file = task.file .. '.delta'
+		task.real_uri = uri_master:to_file(task.delta.filename, task.delta.file, parent)
+		task.real_uri:add_pubkey() -- do not verify signatures (there are none)
+		return -- Sums of delta are not interesting so do not compute them
+	elseif opmode.stream_unpack then
+		task.dir = mkdtemp(syscnf.pkg_unpacked_dir)
+		task.real_uri = uri_master:to_unpacked(task.package.Filename, task.dir, parent)
+	else
+		task.file = syscnf.pkg_download_dir .. task.name .. '-' .. task.package.Version .. '.ipk'
+		-- Partially downloaded package from interrupted run is resumed
+		task.real_uri = uri_master:to_resumable_file(task.package.Filename, task.file, parent)
+	end
+	task.real_uri:add_pubkey() -- do not verify signatures (there are none)
+	task.real_uri:set_hash(true) -- compute sums for package_verify on the way
+end
+
+-- Returns index URI of repository mirror package of given task was not yet
+-- downloaded from or nil if there is no such mirror.
+local function package_next_mirror(task)
+	local repo = task.package.repo
+	task.mirrors_tried = task.mirrors_tried or {[repo.index_uri] = true}
+	for _, mirror in ipairs(repo.mirrors or {}) do
+		if not task.mirrors_tried[mirror.index_uri] then
+			task.mirrors_tried[mirror.index_uri] = true
+			return mirror.index_uri
+		end
+	end
+	return nil
+end
+
+--[[
+Run download of all packages registered to given URI master. Failed downloads of
+deltas are replaced with downloads of whole packages and failed downloads of
+packages are retried from other mirrors of repository.
+]]
+local function packages_download(uri_master)
+	local failed_uri = uri_master:download()
+	while failed_uri do
+		local failed_task
+		for _, task in ipairs(tasks) do
+			if task.real_uri == failed_uri then
+				failed_task = task
+				break
+			end
+		end
+		if failed_task and failed_task.delta then
+			WARN("Download of delta " .. failed_uri:uri() .. " failed: " .. failed_uri:download_error() ..
+				". Downloading whole package.")
+			failed_task.delta_failed = true
+			package_uri(uri_master, failed_task, failed_task.parent_uri)
 		else
-			WARN("Package has no hash in index to verify it: " + task.name)
+			local mirror = failed_task and package_next_mirror(failed_task)
+			if not mirror then
+				unpacked_cleanup()
+				error(utils.exception("download",
+					"Download of " .. failed_uri:uri() .. " failed: " .. failed_uri:download_error()))
+			end
+			WARN("Download of " .. failed_uri:uri() .. " failed: " .. failed_uri:download_error() ..
+				". Trying mirror " .. mirror:uri())
+			if failed_task.dir then
+				utils.cleanup_dirs({failed_task.dir})
+			end
+			package_uri(uri_master, failed_task, mirror)
+		end
+		failed_uri = uri_master:download()
+	end
+end
+
+--[[
+Rebuild packages from downloaded deltas and verify them. Returns true if there
+are some packages that have to be downloaded whole because delta was not usable.
+]]
+local function packages_from_deltas(uri_master)
+	local download_required = false
+	local function delta_failed(task, err)
+		WARN("Rebuild of package " .. task.name .. " from delta failed: " .. tostring(err.msg or err) ..
+			". Downloading whole package.")
+		os.remove(task.file)
+		task.delta_failed = true
+		package_uri(uri_master, task, task.parent_uri)
+		download_required = true
+	end
+	local rebuilt = {}
+	for _, task in ipairs(tasks) do
+		if task.action == "require" and task.delta then
+			local ok, err = pcall(function ()
+				task.real_uri:finish()
+				backend.pkg_delta_apply(task.delta.base, task.delta.file, task.file)
+			end)
+			os.remove(task.delta.file)
+			if ok then
+				table.insert(rebuilt, task)
+			else
+				delta_failed(task, err)
+			end
+		end
+	end
+	-- Rebuilt packages are hashed together before they are verified
+	packages_hash(rebuilt)
+	for _, task in ipairs(rebuilt) do
+		local ok, err = pcall(package_verify, task)
+		if ok then
+			DBG("Package " .. task.name .. " rebuilt from delta")
+			task.verified = true
+		else
+			delta_failed(task, err)
+		end
+	end
+	return download_required
+end
+
+-- Store verified packages to cache so they can be used instead of download or as
+-- base for deltas later
+local function packages_cache_store()
+	for _, task in ipairs(tasks) do
+		if task.action == "require" and task.file then
+			local sum = task.package.SHA256sum or task.package.SHA256Sum or sha256_file(task.file)
+			local ok, err = pcall(backend.pkg_cache_store, task.file, sum:lower())
+			if not ok then
+				WARN("Unable to store package " .. task.name .. " to cache: " .. tostring(err))
+			end
 		end
 	end
 end
@@ -131,27 +403,49 @@ end
 function tasks_to_transaction()
 	INFO("Downloading packages")
 	utils.mkdirp(syscnf.pkg_download_dir)
+	if opmode.stream_unpack then
+		utils.mkdirp(syscnf.pkg_unpacked_dir)
+	end
 	-- Start packages download
 	local uri_master = uri:new()
 	for _, task in ipairs(tasks) do
 		if task.action == "require" then
-			task.file = syscnf.pkg_download_dir .. task.name .. '-' .. task.package.Version .. '.ipk'
-			task.real_uri = uri_master:to_file(task.package.Filename, task.file, task.package.repo.index_uri)
-			task.real_uri:add_pubkey() -- do not verify signatures (there are none)
+			package_uri(uri_master, task, task.package.repo.index_uri)
 		end
 	end
-	local failed_uri = uri_master:download()
-	if failed_uri then
-		error(utils.exception("download",
-			"Download of " .. failed_uri:uri() .. " failed: " .. failed_uri:download_error()))
+	packages_download(uri_master)
+	if packages_from_deltas(uri_master) then
+		packages_download(uri_master)
 	end
-	-- Now push all data into the transaction
+	download_summary()
+	-- Verify all packages before anything is pushed to the transaction
 	utils.mkdirp(syscnf.pkg_download_dir)
+	local ok, err = pcall(function ()
+		for _, task in ipairs(tasks) do
+			if task.action == "require" and not task.verified then
+				task.real_uri:finish()
+				package_verify(task)
+			end
+		end
+	end)
+	if not ok then
+		unpacked_cleanup()
+		error(err)
+	end
+	if opmode.stream_unpack and opmode.pkg_cache then
+		-- There are no package files in this mode so there is nothing to store
+		WARN("Packages cache is not updated in stream_unpack mode. Only already cached packages are used.")
+	elseif opmode.pkg_cache or opmode.delta_update then
+		packages_cache_store()
+	end
+	-- Now push all data into the transaction
 	for _, task in ipairs(tasks) do
 		if task.action == "require" then
-			task.real_uri:finish()
-			package_verify(task)
-			transaction.queue_install_downloaded(task.file, task.name, task.package.Version, task.modifier)
+			if task.dir then
+				transaction.queue_install_unpacked(task.dir, task.name, task.package.Version, task.modifier)
+			else
+				transaction.queue_install_downloaded(task.file, task.name, task.package.Version, task.modifier)
+			end
 		elseif task.action == "remove" then
 			transaction.queue_remove(task.name)
 		else
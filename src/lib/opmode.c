@@ -48,6 +48,14 @@ static enum OPMODE lua_str2opmode(const char *str_mode) {
 		return OPMODE_NO_REMOVAL;
 	else if (!strcmp("optional_installs", str_mode))
 		return OPMODE_OPTIONAL_INSTALLS;
+	else if (!strcmp("stream_unpack", str_mode))
+		return OPMODE_STREAM_UNPACK;
+	else if (!strcmp("delta_update", str_mode))
+		return OPMODE_DELTA_UPDATE;
+	else if (!strcmp("pkg_cache", str_mode))
+		return OPMODE_PKG_CACHE;
+	else if (!strcmp("pkg_db", str_mode))
+		return OPMODE_PKG_DB;
 	return OPMODE_LAST;
 }
 
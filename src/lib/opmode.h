@@ -30,6 +30,14 @@ enum OPMODE {
 	OPMODE_NO_REMOVAL,
 	// Consider all install requests optional
 	OPMODE_OPTIONAL_INSTALLS,
+	// Unpack packages as they are downloaded instead of storing them first
+	OPMODE_STREAM_UNPACK,
+	// Keep installed packages in cache and use binary deltas against them
+	OPMODE_DELTA_UPDATE,
+	// Keep verified packages in cache and use them instead of download
+	OPMODE_PKG_CACHE,
+	// Keep installed packages in binary database instead of reading control files
+	OPMODE_PKG_DB,
 	// Not technically opmode but it can be used to get enum size
 	OPMODE_LAST
 };
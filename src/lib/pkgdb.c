@@ -0,0 +1,532 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pkgdb.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <uthash.h>
+#include "logging.h"
+#include "util.h"
+#include "inject.h"
+
+/*
+ * Database format (all integers are 32 bit in native byte order as database is
+ * never moved between machines). All strings are stored in string pool at the
+ * end of the file and are referenced by offset and length. Sections follow each
+ * other in this order:
+ *   header: magic, version, stamp, sizes of all following sections
+ *   packages: name, range of fields and range of files of package
+ *   fields: name and value
+ *   files: path, MD5 hash, index of package and flags
+ *   owners: indexes of listed files sorted by path
+ *   string pool
+ */
+
+static const char pkgdb_magic[8] = "UPDPKGDB";
+#define PKGDB_VERSION 1
+
+struct pkgdb_ref {
+	uint32_t off, len;
+};
+
+struct pkgdb_header {
+	char magic[8];
+	uint32_t version;
+	struct pkgdb_ref stamp;
+	uint32_t package_cnt, field_cnt, file_cnt, owner_cnt;
+	uint32_t pool_len;
+};
+
+#define PKGDB_P_FILES (1 << 0) // Package has list of files
+
+struct pkgdb_package {
+	struct pkgdb_ref name;
+	uint32_t field_start, field_cnt;
+	uint32_t file_start, file_cnt;
+	uint32_t flags;
+};
+
+struct pkgdb_field {
+	struct pkgdb_ref name, value;
+};
+
+#define PKGDB_F_LISTED (1 << 0) // File is in list of package files
+#define PKGDB_F_HASHED (1 << 1) // File has hash (it is not config file)
+
+struct pkgdb_file {
+	struct pkgdb_ref path, md5;
+	uint32_t package;
+	uint32_t flags;
+};
+
+// Writing //////////////////////////////////////////////////////////////////////
+
+// Items of given type in buffer
+#define ITEM_CNT(buf, type) ((buf).len / sizeof(type))
+#define ITEM_PUSH(buf, type) ((type*)buffer_append(&(buf), NULL, sizeof(type)))
+
+// Interned string of pool. Key points to Lua string that is referenced by
+// written table for whole time of writing.
+struct pool_str {
+	struct pkgdb_ref ref;
+	UT_hash_handle hh;
+};
+
+struct writer {
+	struct buffer packages, fields, files, owners, pool;
+	struct pool_str *strings;
+};
+
+static struct pkgdb_ref pool_add(struct writer *w, const char *str, size_t len) {
+	struct pool_str *s;
+	HASH_FIND(hh, w->strings, str, len, s);
+	if (s)
+		return s->ref;
+	s = malloc(sizeof *s);
+	s->ref.off = w->pool.len;
+	s->ref.len = len;
+	buffer_append(&w->pool, str, len);
+	HASH_ADD_KEYPTR(hh, w->strings, str, len, s);
+	return s->ref;
+}
+
+// Add string on given index of Lua stack to pool
+static struct pkgdb_ref pool_lstr(struct writer *w, lua_State *L, int index) {
+	size_t len;
+	const char *str = lua_tolstring(L, index, &len);
+	return pool_add(w, str, len);
+}
+
+static void add_file(struct writer *w, lua_State *L, int path, int md5, uint32_t flags) {
+	struct pkgdb_file *file = ITEM_PUSH(w->files, struct pkgdb_file);
+	file->path = pool_lstr(w, L, path);
+	file->md5 = md5 ? pool_lstr(w, L, md5) : (struct pkgdb_ref){0, 0};
+	file->package = ITEM_CNT(w->packages, struct pkgdb_package) - 1;
+	file->flags = flags;
+	if (flags & PKGDB_F_LISTED)
+		*ITEM_PUSH(w->owners, uint32_t) = ITEM_CNT(w->files, struct pkgdb_file) - 1;
+}
+
+// Add package (table on top of the Lua stack) of given name (on index -2).
+// Returns false if package has unexpected format.
+static bool write_package(struct writer *w, lua_State *L) {
+	int pkg = lua_gettop(L);
+	struct pkgdb_package *package = ITEM_PUSH(w->packages, struct pkgdb_package);
+	*package = (struct pkgdb_package) {
+		.name = pool_lstr(w, L, pkg - 1),
+		.field_start = ITEM_CNT(w->fields, struct pkgdb_field),
+		.file_start = ITEM_CNT(w->files, struct pkgdb_file),
+	};
+	lua_getfield(L, pkg, "fields");
+	lua_getfield(L, pkg, "files");
+	lua_getfield(L, pkg, "nonconf");
+	int fields = pkg + 1, files = pkg + 2, nonconf = pkg + 3;
+	bool ok = lua_istable(L, fields) && (lua_isnil(L, files) || lua_istable(L, files)) &&
+		(lua_isnil(L, nonconf) || lua_istable(L, nonconf));
+	if (ok) {
+		lua_pushnil(L);
+		while (lua_next(L, fields) != 0) {
+			if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+				struct pkgdb_field *field = ITEM_PUSH(w->fields, struct pkgdb_field);
+				field->name = pool_lstr(w, L, -2);
+				field->value = pool_lstr(w, L, -1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	if (ok && lua_istable(L, files)) {
+		lua_pushnil(L);
+		while (lua_next(L, files) != 0) {
+			if (lua_type(L, -2) == LUA_TSTRING) {
+				lua_pushvalue(L, -2);
+				if (lua_istable(L, nonconf))
+					lua_rawget(L, nonconf);
+				else
+					lua_pushnil(L);
+				bool hashed = lua_type(L, -1) == LUA_TSTRING;
+				add_file(w, L, -3, hashed ? -1 : 0, PKGDB_F_LISTED | (hashed ? PKGDB_F_HASHED : 0));
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	if (ok && lua_istable(L, nonconf)) {
+		lua_pushnil(L);
+		while (lua_next(L, nonconf) != 0) {
+			// Hashed files that are not listed are stored separately
+			lua_pushvalue(L, -2);
+			if (lua_istable(L, files))
+				lua_rawget(L, files);
+			else
+				lua_pushnil(L);
+			if (lua_type(L, -3) == LUA_TSTRING && lua_type(L, -2) == LUA_TSTRING && lua_isnil(L, -1))
+				add_file(w, L, -3, -2, PKGDB_F_HASHED);
+			lua_pop(L, 2);
+		}
+	}
+	// Package pointer might be invalidated by push to packages
+	package = (struct pkgdb_package*)w->packages.data + ITEM_CNT(w->packages, struct pkgdb_package) - 1;
+	package->field_cnt = ITEM_CNT(w->fields, struct pkgdb_field) - package->field_start;
+	package->file_cnt = ITEM_CNT(w->files, struct pkgdb_file) - package->file_start;
+	package->flags = lua_istable(L, files) ? PKGDB_P_FILES : 0;
+	lua_settop(L, pkg);
+	return ok;
+}
+
+struct owner_key {
+	const char *path;
+	uint32_t len;
+	uint32_t file;
+};
+
+static int owner_cmp(const void *a, const void *b) {
+	const struct owner_key *ka = a, *kb = b;
+	int cmp = memcmp(ka->path, kb->path, ka->len < kb->len ? ka->len : kb->len);
+	if (cmp)
+		return cmp;
+	return (ka->len > kb->len) - (ka->len < kb->len);
+}
+
+// Sort owners table by paths of files
+static void owners_sort(struct writer *w) {
+	const struct pkgdb_file *files = w->files.data;
+	uint32_t *owners = w->owners.data;
+	size_t cnt = ITEM_CNT(w->owners, uint32_t);
+	struct owner_key *keys = malloc((cnt ? cnt : 1) * sizeof *keys);
+	for (size_t i = 0; i < cnt; i++)
+		keys[i] = (struct owner_key) {
+			.path = (const char*)w->pool.data + files[owners[i]].path.off,
+			.len = files[owners[i]].path.len,
+			.file = owners[i],
+		};
+	qsort(keys, cnt, sizeof *keys, owner_cmp);
+	for (size_t i = 0; i < cnt; i++)
+		owners[i] = keys[i].file;
+	free(keys);
+}
+
+static void writer_free(struct writer *w) {
+	free(w->packages.data);
+	free(w->fields.data);
+	free(w->files.data);
+	free(w->owners.data);
+	free(w->pool.data);
+	struct pool_str *s, *tmp;
+	HASH_ITER(hh, w->strings, s, tmp) {
+		HASH_DEL(w->strings, s);
+		free(s);
+	}
+}
+
+static int lua_pkgdb_write(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	struct writer w = { .strings = NULL };
+	struct pkgdb_header header = {
+		.version = PKGDB_VERSION,
+		.stamp = pool_lstr(&w, L, 2),
+	};
+	memcpy(header.magic, pkgdb_magic, sizeof pkgdb_magic);
+	bool ok = true;
+	lua_pushnil(L);
+	while (ok && lua_next(L, 3) != 0) {
+		ok = lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1) && write_package(&w, L);
+		lua_pop(L, 1);
+	}
+	if (!ok) {
+		lua_pop(L, 1); // pop key left by interrupted iteration
+		writer_free(&w);
+		lua_pushnil(L);
+		lua_pushstring(L, "Package can't be stored in package database");
+		return 2;
+	}
+	owners_sort(&w);
+	header.package_cnt = ITEM_CNT(w.packages, struct pkgdb_package);
+	header.field_cnt = ITEM_CNT(w.fields, struct pkgdb_field);
+	header.file_cnt = ITEM_CNT(w.files, struct pkgdb_file);
+	header.owner_cnt = ITEM_CNT(w.owners, uint32_t);
+	header.pool_len = w.pool.len;
+
+	const struct file_part parts[] = {
+		{ &header, sizeof header },
+		{ w.packages.data, w.packages.len },
+		{ w.fields.data, w.fields.len },
+		{ w.files.data, w.files.len },
+		{ w.owners.data, w.owners.len },
+		{ w.pool.data, w.pool.len },
+	};
+	ok = writefile_atomic(path, parts, sizeof parts / sizeof *parts);
+	writer_free(&w);
+	if (!ok) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Unable to write package database %s: %s", path, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+// Loading //////////////////////////////////////////////////////////////////////
+
+struct pkgdb {
+	const uint8_t *map;
+	size_t len;
+	const struct pkgdb_header *header;
+	const struct pkgdb_package *packages;
+	const struct pkgdb_field *fields;
+	const struct pkgdb_file *files;
+	const uint32_t *owners;
+	const char *pool;
+};
+
+static bool ref_valid(const struct pkgdb *db, struct pkgdb_ref ref) {
+	return ref.off <= db->header->pool_len && ref.len <= db->header->pool_len - ref.off;
+}
+
+static bool range_valid(uint32_t start, uint32_t cnt, uint32_t total) {
+	return start <= total && cnt <= total - start;
+}
+
+// Set section pointers of mapped database and check that it is consistent
+static bool pkgdb_validate(struct pkgdb *db) {
+	const struct pkgdb_header *h = (const void*)db->map;
+	if (db->len < sizeof *h || memcmp(h->magic, pkgdb_magic, sizeof pkgdb_magic) || h->version != PKGDB_VERSION)
+		return false;
+	db->header = h;
+	uint64_t expected = sizeof *h +
+		(uint64_t)h->package_cnt * sizeof *db->packages +
+		(uint64_t)h->field_cnt * sizeof *db->fields +
+		(uint64_t)h->file_cnt * sizeof *db->files +
+		(uint64_t)h->owner_cnt * sizeof *db->owners +
+		h->pool_len;
+	if (expected != db->len)
+		return false;
+	db->packages = (const void*)(h + 1);
+	db->fields = (const void*)(db->packages + h->package_cnt);
+	db->files = (const void*)(db->fields + h->field_cnt);
+	db->owners = (const void*)(db->files + h->file_cnt);
+	db->pool = (const void*)(db->owners + h->owner_cnt);
+	if (!ref_valid(db, h->stamp))
+		return false;
+	for (uint32_t i = 0; i < h->package_cnt; i++) {
+		const struct pkgdb_package *p = &db->packages[i];
+		if (!ref_valid(db, p->name) || !range_valid(p->field_start, p->field_cnt, h->field_cnt) ||
+				!range_valid(p->file_start, p->file_cnt, h->file_cnt))
+			return false;
+	}
+	for (uint32_t i = 0; i < h->field_cnt; i++)
+		if (!ref_valid(db, db->fields[i].name) || !ref_valid(db, db->fields[i].value))
+			return false;
+	for (uint32_t i = 0; i < h->file_cnt; i++)
+		if (!ref_valid(db, db->files[i].path) || !ref_valid(db, db->files[i].md5) ||
+				db->files[i].package >= h->package_cnt)
+			return false;
+	for (uint32_t i = 0; i < h->owner_cnt; i++)
+		if (db->owners[i] >= h->file_cnt)
+			return false;
+	return true;
+}
+
+static void push_ref(lua_State *L, const struct pkgdb *db, struct pkgdb_ref ref) {
+	lua_pushlstring(L, db->pool + ref.off, ref.len);
+}
+
+// Push package of given index as table with fields, files and nonconf
+static void push_package(lua_State *L, const struct pkgdb *db, const struct pkgdb_package *p) {
+	lua_createtable(L, 0, 3);
+	lua_createtable(L, 0, p->field_cnt);
+	for (uint32_t i = p->field_start; i < p->field_start + p->field_cnt; i++) {
+		push_ref(L, db, db->fields[i].name);
+		push_ref(L, db, db->fields[i].value);
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, -2, "fields");
+	if (p->flags & PKGDB_P_FILES)
+		lua_createtable(L, 0, p->file_cnt);
+	else
+		lua_pushnil(L);
+	lua_newtable(L);
+	for (uint32_t i = p->file_start; i < p->file_start + p->file_cnt; i++) {
+		const struct pkgdb_file *f = &db->files[i];
+		if ((f->flags & PKGDB_F_LISTED) && (p->flags & PKGDB_P_FILES)) {
+			push_ref(L, db, f->path);
+			lua_pushboolean(L, true);
+			lua_rawset(L, -4);
+		}
+		if (f->flags & PKGDB_F_HASHED) {
+			push_ref(L, db, f->path);
+			push_ref(L, db, f->md5);
+			lua_rawset(L, -3);
+		}
+	}
+	lua_setfield(L, -3, "nonconf");
+	lua_setfield(L, -2, "files");
+}
+
+// Map database of given path and check it. Returns false if there is no such
+// file, it is corrupted or it was created with different stamp.
+static bool pkgdb_map(struct pkgdb *db, const char *path, const char *stamp, size_t stamp_len) {
+	size_t len;
+	void *map = mapfile(path, &len);
+	if (!map)
+		return false;
+	*db = (struct pkgdb) { .map = map, .len = len };
+	bool valid = pkgdb_validate(db);
+	if (!valid)
+		WARN("Package database %s is corrupted", path);
+	else if (db->header->stamp.len != stamp_len || memcmp(db->pool + db->header->stamp.off, stamp, stamp_len))
+		valid = false;
+	if (!valid)
+		munmap(map, len);
+	return valid;
+}
+
+static int lua_pkgdb_load(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t stamp_len;
+	const char *stamp = luaL_checklstring(L, 2, &stamp_len);
+
+	struct pkgdb db;
+	if (!pkgdb_map(&db, path, stamp, stamp_len))
+		return 0;
+	lua_createtable(L, 0, db.header->package_cnt);
+	for (uint32_t i = 0; i < db.header->package_cnt; i++) {
+		push_ref(L, &db, db.packages[i].name);
+		push_package(L, &db, &db.packages[i]);
+		lua_rawset(L, -3);
+	}
+	munmap((void*)db.map, db.len);
+	return 1;
+}
+
+// Compare path of file of given owners index with given key
+static int owner_path_cmp(const struct pkgdb *db, uint32_t owner, const char *key, size_t len) {
+	struct pkgdb_ref ref = db->files[db->owners[owner]].path;
+	int cmp = memcmp(db->pool + ref.off, key, ref.len < len ? ref.len : len);
+	if (cmp)
+		return cmp;
+	return (ref.len > len) - (ref.len < len);
+}
+
+// Index of first owner with path that is not less than given key
+static uint32_t owners_lower_bound(const struct pkgdb *db, const char *key, size_t len) {
+	uint32_t low = 0, high = db->header->owner_cnt;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (owner_path_cmp(db, mid, key, len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+// Add package owning file of given owners index to table on index result
+static void push_owner(lua_State *L, const struct pkgdb *db, int result, uint32_t owner) {
+	const struct pkgdb_file *file = &db->files[db->owners[owner]];
+	push_ref(L, db, file->path);
+	lua_rawget(L, result);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		push_ref(L, db, file->path);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, result);
+	}
+	push_ref(L, db, db->packages[file->package].name);
+	lua_pushboolean(L, true);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+// Add owners of exactly given path. Returns true if there is some.
+static bool owners_exact(lua_State *L, const struct pkgdb *db, int result, const char *path, size_t len) {
+	uint32_t i = owners_lower_bound(db, path, len);
+	bool found = false;
+	for (; i < db->header->owner_cnt && !owner_path_cmp(db, i, path, len); i++) {
+		push_owner(L, db, result, i);
+		found = true;
+	}
+	return found;
+}
+
+// Add owners of all files in directory of given path (recursively)
+static void owners_under(lua_State *L, const struct pkgdb *db, int result, const char *path, size_t len) {
+	char prefix[len + 1];
+	memcpy(prefix, path, len);
+	prefix[len] = '/';
+	// Files with common prefix follow each other in sorted table
+	for (uint32_t i = owners_lower_bound(db, prefix, len + 1); i < db->header->owner_cnt; i++) {
+		struct pkgdb_ref ref = db->files[db->owners[i]].path;
+		if (ref.len < len + 1 || memcmp(db->pool + ref.off, prefix, len + 1))
+			break;
+		push_owner(L, db, result, i);
+	}
+}
+
+static int lua_pkgdb_owners(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t stamp_len;
+	const char *stamp = luaL_checklstring(L, 2, &stamp_len);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	struct pkgdb db;
+	if (!pkgdb_map(&db, path, stamp, stamp_len))
+		return 0;
+	lua_newtable(L);
+	int result = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, 3) != 0) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			continue;
+		size_t len;
+		const char *file = lua_tolstring(L, -1, &len);
+		// Files on place of parent directories (and everything in them)
+		for (size_t i = 1; i < len; i++)
+			if (file[i] == '/' && owners_exact(L, &db, result, file, i))
+				owners_under(L, &db, result, file, i);
+		owners_exact(L, &db, result, file, len);
+		owners_under(L, &db, result, file, len);
+	}
+	munmap((void*)db.map, db.len);
+	return 1;
+}
+
+static const struct inject_func funcs[] = {
+	{ lua_pkgdb_write, "write" },
+	{ lua_pkgdb_load, "load" },
+	{ lua_pkgdb_owners, "owners" },
+};
+
+void pkgdb_mod_init(lua_State *L) {
+	TRACE("pkgdb module init");
+	lua_newtable(L);
+	inject_func_n(L, "pkgdb", funcs, sizeof funcs / sizeof *funcs);
+	lua_pushvalue(L, -1);
+	lua_setmetatable(L, -2);
+	inject_module(L, "pkgdb");
+}
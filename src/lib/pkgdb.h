@@ -0,0 +1,32 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UPDATER_PKGDB_H
+#define UPDATER_PKGDB_H
+#include <lua.h>
+
+// Binary database of installed packages. It contains same information as opkg
+// status file and package control files in info directory (fields of packages,
+// lists of files and hashes of files) in single file so it can be read without
+// opening files of every package. It is identified by stamp of status file it
+// was created for and it is used only if status file was not modified since.
+
+// Create pkgdb module and inject it into the lua state
+void pkgdb_mod_init(lua_State *L) __attribute__((nonnull));
+
+#endif
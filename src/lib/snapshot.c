@@ -0,0 +1,466 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "snapshot.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "logging.h"
+#include "util.h"
+#include "inject.h"
+
+/*
+ * Snapshot format (all integers are 32 bit in native byte order as snapshot is
+ * never moved between machines):
+ *   header: magic, version, key length, key, number of packages
+ *   package: name, number of fields, fields (name and value), dependencies
+ *   string: length and bytes
+ *   dependencies: tag (enum dep_tag) and tag specific data
+ *     DEP_STRING: string
+ *     DEP_PACKAGE: name and version (version is empty string if not specified)
+ *     DEP_AND, DEP_OR, DEP_NOT: number of sub-dependencies and sub-dependencies
+ */
+
+#define SNAPSHOT_META "updater_snapshot_meta"
+static const char snapshot_magic[8] = "UPDSNAP";
+#define SNAPSHOT_VERSION 1
+
+enum dep_tag {
+	DEP_NIL,
+	DEP_STRING,
+	DEP_PACKAGE,
+	DEP_AND,
+	DEP_OR,
+	DEP_NOT,
+};
+
+static const char *dep_types[] = {
+	[DEP_AND] = "dep-and",
+	[DEP_OR] = "dep-or",
+	[DEP_NOT] = "dep-not",
+};
+
+// Fields decoded on load. Rest is decoded on first access to any other field.
+static const char *eager_fields[] = {
+	"Package", "Version", "Filename", "Provides", "Depends", "Conflicts"
+};
+
+// Field package dependencies are stored in
+#define DEPS_FIELD "index_deps"
+
+// Writing //////////////////////////////////////////////////////////////////////
+
+static void wbuf_u32(struct buffer *b, uint32_t val) {
+	buffer_append(b, &val, sizeof val);
+}
+
+static void wbuf_str(struct buffer *b, const char *str, size_t len) {
+	wbuf_u32(b, len);
+	buffer_append(b, str, len);
+}
+
+// Write string on given index of Lua stack
+static void wbuf_lstr(struct buffer *b, lua_State *L, int index) {
+	size_t len;
+	const char *str = lua_tolstring(L, index, &len);
+	wbuf_str(b, str, len);
+}
+
+// Write dependency on top of the Lua stack. Returns false if dependency can't be
+// stored in snapshot.
+static bool write_deps(struct buffer *b, lua_State *L) {
+	int tp = lua_type(L, -1);
+	if (tp == LUA_TNIL) {
+		wbuf_u32(b, DEP_NIL);
+		return true;
+	} else if (tp == LUA_TSTRING) {
+		wbuf_u32(b, DEP_STRING);
+		wbuf_lstr(b, L, -1);
+		return true;
+	} else if (tp != LUA_TTABLE)
+		return false;
+
+	lua_getfield(L, -1, "tp");
+	const char *dep_tp = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!dep_tp)
+		return false;
+	if (!strcmp(dep_tp, "dep-package")) {
+		wbuf_u32(b, DEP_PACKAGE);
+		lua_getfield(L, -1, "name");
+		lua_getfield(L, -2, "version");
+		bool ok = lua_type(L, -2) == LUA_TSTRING && (lua_isnil(L, -1) || lua_type(L, -1) == LUA_TSTRING);
+		if (ok) {
+			wbuf_lstr(b, L, -2);
+			if (lua_isnil(L, -1))
+				wbuf_str(b, "", 0);
+			else
+				wbuf_lstr(b, L, -1);
+		}
+		lua_pop(L, 2);
+		return ok;
+	}
+	enum dep_tag tag = DEP_NIL;
+	for (enum dep_tag t = DEP_AND; t <= DEP_NOT; t++)
+		if (!strcmp(dep_tp, dep_types[t]))
+			tag = t;
+	if (tag == DEP_NIL)
+		return false;
+	wbuf_u32(b, tag);
+	lua_getfield(L, -1, "sub");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return false;
+	}
+	size_t cnt = lua_objlen(L, -1);
+	wbuf_u32(b, cnt);
+	bool ok = true;
+	for (size_t i = 1; i <= cnt && ok; i++) {
+		lua_rawgeti(L, -1, i);
+		ok = write_deps(b, L);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return ok;
+}
+
+// Write package (table on top of the Lua stack) of given name (on index -2)
+static bool write_package(struct buffer *b, lua_State *L) {
+	wbuf_lstr(b, L, -2);
+	uint32_t cnt = 0;
+	size_t cnt_pos = b->len;
+	wbuf_u32(b, cnt);
+	// Lazy records provide all their fields without being materialized
+	if (luaL_getmetafield(L, -1, "__fields")) {
+		lua_pushvalue(L, -2);
+		lua_call(L, 1, 1);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+		}
+	} else
+		lua_pushvalue(L, -1);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+			wbuf_lstr(b, L, -2);
+			wbuf_lstr(b, L, -1);
+			cnt++;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	memcpy((char*)b->data + cnt_pos, &cnt, sizeof cnt);
+	lua_getfield(L, -1, DEPS_FIELD);
+	bool ok = write_deps(b, L);
+	lua_pop(L, 1);
+	return ok;
+}
+
+static int lua_snapshot_write(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t key_len;
+	const char *key = luaL_checklstring(L, 2, &key_len);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	struct buffer b = { .data = NULL, .len = 0, .allocated = 0 };
+	buffer_append(&b, snapshot_magic, sizeof snapshot_magic);
+	wbuf_u32(&b, SNAPSHOT_VERSION);
+	wbuf_str(&b, key, key_len);
+	uint32_t cnt = 0;
+	size_t cnt_pos = b.len;
+	wbuf_u32(&b, cnt);
+	bool ok = true;
+	lua_pushnil(L);
+	while (ok && lua_next(L, 3) != 0) {
+		ok = lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1) && write_package(&b, L);
+		cnt++;
+		lua_pop(L, 1);
+	}
+	if (!ok) {
+		lua_pop(L, 1); // pop key left by interrupted iteration
+		free(b.data);
+		lua_pushnil(L);
+		lua_pushstring(L, "Package can't be stored in snapshot");
+		return 2;
+	}
+	memcpy((char*)b.data + cnt_pos, &cnt, sizeof cnt);
+
+	ok = writefile_atomic(path, &(struct file_part) { b.data, b.len }, 1);
+	free(b.data);
+	if (!ok) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Unable to write snapshot %s: %s", path, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+// Loading //////////////////////////////////////////////////////////////////////
+
+struct snapshot {
+	uint8_t *map;
+	size_t len;
+};
+
+struct rbuf {
+	const uint8_t *pos, *end;
+	bool ok;
+};
+
+static uint32_t rbuf_u32(struct rbuf *r) {
+	uint32_t val = 0;
+	if (r->ok && (size_t)(r->end - r->pos) >= sizeof val) {
+		memcpy(&val, r->pos, sizeof val);
+		r->pos += sizeof val;
+	} else
+		r->ok = false;
+	return val;
+}
+
+static const char *rbuf_str(struct rbuf *r, size_t *len) {
+	*len = rbuf_u32(r);
+	if (!r->ok || (size_t)(r->end - r->pos) < *len) {
+		r->ok = false;
+		*len = 0;
+		return "";
+	}
+	const char *str = (const char*)r->pos;
+	r->pos += *len;
+	return str;
+}
+
+static bool is_eager(const char *name, size_t len) {
+	for (size_t i = 0; i < sizeof eager_fields / sizeof *eager_fields; i++)
+		if (strlen(eager_fields[i]) == len && !strncmp(eager_fields[i], name, len))
+			return true;
+	return false;
+}
+
+// Set fields from snapshot to table on top of the Lua stack. Either eager or
+// lazy fields are set.
+static void read_fields(lua_State *L, struct rbuf *r, bool eager) {
+	uint32_t cnt = rbuf_u32(r);
+	for (uint32_t i = 0; i < cnt && r->ok; i++) {
+		size_t name_len, value_len;
+		const char *name = rbuf_str(r, &name_len);
+		const char *value = rbuf_str(r, &value_len);
+		if (r->ok && is_eager(name, name_len) == eager) {
+			lua_pushlstring(L, name, name_len);
+			lua_pushlstring(L, value, value_len);
+			lua_rawset(L, -3);
+		}
+	}
+}
+
+// Push dependencies from snapshot to Lua stack
+static void read_deps(lua_State *L, struct rbuf *r, unsigned depth) {
+	enum dep_tag tag = rbuf_u32(r);
+	size_t len;
+	const char *str;
+	if (depth > 64) // Protection against corrupted snapshot
+		r->ok = false;
+	if (!r->ok) {
+		lua_pushnil(L);
+		return;
+	}
+	switch (tag) {
+		case DEP_NIL:
+			lua_pushnil(L);
+			break;
+		case DEP_STRING:
+			str = rbuf_str(r, &len);
+			lua_pushlstring(L, str, len);
+			break;
+		case DEP_PACKAGE:
+			lua_createtable(L, 0, 3);
+			lua_pushstring(L, "dep-package");
+			lua_setfield(L, -2, "tp");
+			str = rbuf_str(r, &len);
+			lua_pushlstring(L, str, len);
+			lua_setfield(L, -2, "name");
+			str = rbuf_str(r, &len);
+			if (len) {
+				lua_pushlstring(L, str, len);
+				lua_setfield(L, -2, "version");
+			}
+			break;
+		case DEP_AND:
+		case DEP_OR:
+		case DEP_NOT: {
+			lua_createtable(L, 0, 2);
+			lua_pushstring(L, dep_types[tag]);
+			lua_setfield(L, -2, "tp");
+			uint32_t cnt = rbuf_u32(r);
+			lua_createtable(L, cnt < 1024 ? cnt : 0, 0);
+			for (uint32_t i = 1; i <= cnt && r->ok; i++) {
+				read_deps(L, r, depth + 1);
+				lua_rawseti(L, -2, i);
+			}
+			lua_setfield(L, -2, "sub");
+			break;
+		}
+		default:
+			r->ok = false;
+			lua_pushnil(L);
+	}
+}
+
+// Check if record with fields starting at given position has field of given
+// name. Nothing is decoded.
+static bool has_field(struct rbuf r, const char *key, size_t key_len) {
+	uint32_t cnt = rbuf_u32(&r);
+	for (uint32_t i = 0; i < cnt && r.ok; i++) {
+		size_t name_len, value_len;
+		const char *name = rbuf_str(&r, &name_len);
+		rbuf_str(&r, &value_len);
+		if (r.ok && name_len == key_len && !memcmp(name, key, key_len))
+			return true;
+	}
+	return false;
+}
+
+// Materialize rest of the record on first access to lazy field. Eager fields
+// and keys that are not fields of record (such as deps) are never decoded.
+static int lua_record_index(lua_State *L) {
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return 0;
+	size_t key_len;
+	const char *key = lua_tolstring(L, 2, &key_len);
+	if (is_eager(key, key_len))
+		return 0;
+	struct snapshot *s = lua_touserdata(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 1);
+	lua_rawget(L, lua_upvalueindex(2));
+	if (lua_isnil(L, -1))
+		return 1; // Already materialized so field is not present
+	size_t offset = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	struct rbuf r = { .pos = s->map + offset, .end = s->map + s->len, .ok = true };
+	if (!has_field(r, key, key_len))
+		return 0;
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(2));
+
+	lua_pushvalue(L, 1);
+	read_fields(L, &r, false);
+	lua_pop(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 1);
+	return 1;
+}
+
+static int lua_snapshot_load(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t key_len;
+	const char *key = luaL_checklstring(L, 2, &key_len);
+
+	size_t len;
+	uint8_t *map = mapfile(path, &len);
+	if (!map)
+		return 0;
+	struct snapshot *s = lua_newuserdata(L, sizeof *s);
+	s->map = map;
+	s->len = len;
+	luaL_getmetatable(L, SNAPSHOT_META);
+	lua_setmetatable(L, -2);
+	int snap_index = lua_gettop(L);
+
+	struct rbuf r = { .pos = map, .end = map + s->len, .ok = true };
+	size_t file_key_len;
+	if (s->len < sizeof snapshot_magic || memcmp(map, snapshot_magic, sizeof snapshot_magic))
+		return 0;
+	r.pos += sizeof snapshot_magic;
+	if (rbuf_u32(&r) != SNAPSHOT_VERSION)
+		return 0;
+	const char *file_key = rbuf_str(&r, &file_key_len);
+	if (!r.ok || file_key_len != key_len || memcmp(file_key, key, key_len))
+		return 0;
+	uint32_t cnt = rbuf_u32(&r);
+
+	// Offsets of not yet materialized records (weak table indexed by records)
+	lua_newtable(L);
+	int offsets_index = lua_gettop(L);
+	lua_newtable(L);
+	lua_pushstring(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	// Metatable shared by all records
+	lua_newtable(L);
+	int record_meta_index = lua_gettop(L);
+	lua_pushvalue(L, snap_index);
+	lua_pushvalue(L, offsets_index);
+	lua_pushcclosure(L, lua_record_index, 2);
+	lua_setfield(L, -2, "__index");
+
+	lua_createtable(L, 0, cnt < 65536 ? cnt : 0);
+	for (uint32_t i = 0; i < cnt && r.ok; i++) {
+		size_t name_len;
+		const char *name = rbuf_str(&r, &name_len);
+		lua_pushlstring(L, name, name_len);
+		lua_createtable(L, 0, sizeof eager_fields / sizeof *eager_fields + 1);
+		size_t offset = r.pos - map;
+		read_fields(L, &r, true);
+		read_deps(L, &r, 0);
+		lua_setfield(L, -2, DEPS_FIELD);
+		lua_pushvalue(L, record_meta_index);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_pushinteger(L, offset);
+		lua_rawset(L, offsets_index);
+		lua_rawset(L, -3);
+	}
+	if (!r.ok || r.pos != r.end) {
+		WARN("Snapshot %s is corrupted", path);
+		return 0;
+	}
+	return 1;
+}
+
+static int lua_snapshot_gc(lua_State *L) {
+	struct snapshot *s = luaL_checkudata(L, 1, SNAPSHOT_META);
+	munmap(s->map, s->len);
+	return 0;
+}
+
+static const struct inject_func funcs[] = {
+	{ lua_snapshot_write, "write" },
+	{ lua_snapshot_load, "load" },
+};
+
+static const struct inject_func snapshot_meta[] = {
+	{ lua_snapshot_gc, "__gc" },
+};
+
+void snapshot_mod_init(lua_State *L) {
+	TRACE("snapshot module init");
+	lua_newtable(L);
+	inject_func_n(L, "snapshot", funcs, sizeof funcs / sizeof *funcs);
+	lua_pushvalue(L, -1);
+	lua_setmetatable(L, -2);
+	inject_module(L, "snapshot");
+	ASSERT(luaL_newmetatable(L, SNAPSHOT_META) == 1);
+	inject_func_n(L, SNAPSHOT_META, snapshot_meta, sizeof snapshot_meta / sizeof *snapshot_meta);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the Turris Updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UPDATER_SNAPSHOT_H
+#define UPDATER_SNAPSHOT_H
+#include <lua.h>
+
+// Binary snapshots of parsed repository indexes. Snapshot contains all string
+// fields of packages and canonical dependencies computed from index. It is
+// identified by key (hash of index it was created from) and is loaded using
+// mmap. Only fields needed for planning are decoded on load and the rest of
+// package is decoded on first access to any other field.
+
+// Create snapshot module and inject it into the lua state
+void snapshot_mod_init(lua_State *L) __attribute__((nonnull));
+
+#endif
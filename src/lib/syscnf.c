@@ -39,6 +39,10 @@ enum e_paths {
 	P_DIR_PKG_UNPACKED,
 	P_DIR_PKG_DOWNLOAD,
 	P_DIR_OPKG_COLLIDED,
+	P_DIR_INDEX_CACHE,
+	P_DIR_PKG_CACHE,
+	P_FILE_HASH_CACHE,
+	P_FILE_PKG_DB,
 	P_LAST
 };
 
@@ -50,6 +54,10 @@ static const char* const default_paths[] = {
 	[P_DIR_PKG_UNPACKED] = "/usr/share/updater/unpacked/",
 	[P_DIR_PKG_DOWNLOAD] = "/usr/share/updater/download/",
 	[P_DIR_OPKG_COLLIDED] = "/usr/share/updater/collided/",
+	[P_DIR_INDEX_CACHE] = "/usr/share/updater/index-cache/",
+	[P_DIR_PKG_CACHE] = "/usr/share/updater/pkg-cache/",
+	[P_FILE_HASH_CACHE] = "/usr/share/updater/file-hashes",
+	[P_FILE_PKG_DB] = "/usr/share/updater/pkgdb",
 };
 
 static char* paths[] = {
@@ -60,6 +68,10 @@ static char* paths[] = {
 	[P_DIR_PKG_UNPACKED] = NULL,
 	[P_DIR_PKG_DOWNLOAD] = NULL,
 	[P_DIR_OPKG_COLLIDED] = NULL,
+	[P_DIR_INDEX_CACHE] = NULL,
+	[P_DIR_PKG_CACHE] = NULL,
+	[P_FILE_HASH_CACHE] = NULL,
+	[P_FILE_PKG_DB] = NULL,
 };
 
 struct os_release_data {
@@ -105,6 +117,10 @@ void set_root_dir(const char *root) {
 	set_path(P_DIR_PKG_UNPACKED, pth);
 	set_path(P_DIR_PKG_DOWNLOAD, pth);
 	set_path(P_DIR_OPKG_COLLIDED, pth);
+	set_path(P_DIR_INDEX_CACHE, pth);
+	set_path(P_DIR_PKG_CACHE, pth);
+	set_path(P_FILE_HASH_CACHE, pth);
+	set_path(P_FILE_PKG_DB, pth);
 	TRACE("Target root directory set to: %s", root_dir());
 }
 
@@ -222,6 +238,22 @@ const char *opkg_collided_dir() {
 	return get_path(P_DIR_OPKG_COLLIDED);
 }
 
+const char *index_cache_dir() {
+	return get_path(P_DIR_INDEX_CACHE);
+}
+
+const char *pkg_cache_dir() {
+	return get_path(P_DIR_PKG_CACHE);
+}
+
+const char *file_hash_cache() {
+	return get_path(P_FILE_HASH_CACHE);
+}
+
+const char *pkg_db_file() {
+	return get_path(P_FILE_PKG_DB);
+}
+
 bool root_dir_is_root() {
 	return !strcmp("/", root_dir());
 }
@@ -273,6 +305,14 @@ static int lua_syscnf_index(lua_State *L) {
 		lua_pushstring(L, pkg_download_dir());
 	else if (!strcmp("opkg_collided_dir", idx))
 		lua_pushstring(L, opkg_collided_dir());
+	else if (!strcmp("index_cache_dir", idx))
+		lua_pushstring(L, index_cache_dir());
+	else if (!strcmp("pkg_cache_dir", idx))
+		lua_pushstring(L, pkg_cache_dir());
+	else if (!strcmp("file_hash_cache", idx))
+		lua_pushstring(L, file_hash_cache());
+	else if (!strcmp("pkg_db_file", idx))
+		lua_pushstring(L, pkg_db_file());
 	else if (luaL_getmetafield(L, 1, idx) == 0)
 		lua_pushnil(L);
 	return 1;
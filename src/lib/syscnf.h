@@ -54,6 +54,10 @@ const char *changelog_file();
 const char *pkg_unpacked_dir();
 const char *pkg_download_dir();
 const char *opkg_collided_dir();
+const char *index_cache_dir();
+const char *pkg_cache_dir();
+const char *file_hash_cache();
+const char *pkg_db_file();
 
 // Returns true if root_dir() is "/", otherwise false.
 bool root_dir_is_root();
@@ -18,13 +18,24 @@
  */
 #include "uri.h"
 #include "signature.h"
+#include "path_utils.h"
+#include "archive.h"
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <strings.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <uriparser/Uri.h>
 #include <base64c.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
 
 
 THREAD_LOCAL enum uri_error uri_errno = 0;
@@ -42,6 +53,7 @@ static const char *error_messages[] = {
 	[URI_E_SIG_FAIL] = "Signature URI failure",
 	[URI_E_VERIFY_FAIL] = "Signature verification failure",
 	[URI_E_NONLOCAL] = "URI to be used for local resources is not local one (file or data)",
+	[URI_E_UNPACK_FAIL] = "Unpack of received package failed",
 };
 
 static const char *schemes_table[] = {
@@ -62,6 +74,7 @@ struct uri_local_list {
 		struct sign_pubkey *pubkey;
 		struct download_pem *pem;
 	} dt;
+	struct download_pem **pems; // Cached collected PEMs (used only in PEM list)
 };
 
 // URI representation
@@ -73,8 +86,18 @@ struct uri {
 	FILE *output;
 	uint8_t *data;
 	size_t data_len;
+	uint8_t *map; // Memory map of local file source (data point to it if there is no output)
+	size_t map_len;
+	struct unpack_stream *unpack; // Set if output is unpacked as package
+	char *resume_path; // Final path of resumable output (data are written to path.part)
+	long resume; // Size of data in partial file download is resumed from
+	char *if_range; // Validator of partially received data
 
 	struct download_i *download_instance;
+	download_race_t race; // Download race URI participates in
+	struct download_i *race_lead; // Download of URI signature belongs to (it follows its race)
+	bool has_stats; // If stats are valid
+	struct download_stats stats; // Statistics of finished download
 
 	// HTTPS options
 	bool ssl_verify; // If SSL should be verified
@@ -84,9 +107,21 @@ struct uri {
 	// Signature verification
 	struct uri_local_list *pubkey; // URIs to public keys used for verification
 	struct uri *sig_uri; // signature URI
+	// Persistent cache
+	char *cache; // Path to file with cached content (validators are in cache.meta)
+	bool cached; // If content was provided from cache
+	char *etag; // ETag of received content (valid only if cache is set)
+	long last_modified; // Modification time of received content (valid only if cache is set)
+	// Sums of received data
+	bool hash; // If sums should be computed
+	bool notify; // If downloader_run should return once URI is downloaded
+	MD5_CTX md5;
+	SHA256_CTX sha256;
+	uint8_t md5_sum[MD5_DIGEST_LENGTH];
+	uint8_t sha256_sum[SHA256_DIGEST_LENGTH];
 };
 
-static struct download_pem **list_pem_collect(struct uri_local_list*, size_t level);
+static struct download_pem **list_pems(struct uri_local_list*);
 static struct sign_pubkey **list_pubkey_collect(struct uri_local_list*, size_t level);
 
 // Bup reference count
@@ -123,6 +158,8 @@ static void list_dealloc(struct uri_local_list *list, void (*list_free)(struct u
 
 // Helper function to set default signature path if no signature set
 static void ensure_default_signature(struct uri *uri) {
+	ASSERT_MSG(!uri->unpack || (!uri->pubkey && !uri->cache),
+		"(%s) Signature verification and cache are not supported with unpack output", uri->uri);
 	if (uri->pubkey && !uri->sig_uri)
 		ASSERT_MSG(uri_set_sig(uri, NULL),
 			"URI creation passed so signature creation should not cause error.");
@@ -248,7 +285,22 @@ uri_t uri(const char *uri_str, const uri_t parent) {
 	ret->output = NULL;
 	ret->data = NULL;
 	ret->data_len = 0;
+	ret->map = NULL;
+	ret->map_len = 0;
+	ret->unpack = NULL;
+	ret->resume_path = NULL;
+	ret->resume = 0;
+	ret->if_range = NULL;
 	ret->download_instance = NULL;
+	ret->race = NULL;
+	ret->race_lead = NULL;
+	ret->has_stats = false;
+	ret->cache = NULL;
+	ret->cached = false;
+	ret->etag = NULL;
+	ret->last_modified = -1;
+	ret->hash = false;
+	ret->notify = false;
 	return ret;
 }
 
@@ -261,10 +313,20 @@ void uri_free(struct uri *uri) {
 		uri_free(uri->sig_uri);
 	list_dealloc(uri->pem, list_pem_free);
 	list_dealloc(uri->pubkey, list_pubkey_free);
-	if (uri->output)
+	if (uri->unpack)
+		unpack_stream_free(uri->unpack);
+	else if (uri->output)
 		fclose(uri->output);
-	if (uri->data)
+	if (uri->map)
+		munmap(uri->map, uri->map_len);
+	if (uri->data && uri->data != uri->map)
 		free(uri->data);
+	free(uri->cache);
+	free(uri->etag);
+	free(uri->resume_path);
+	free(uri->if_range);
+	if (uri->race)
+		download_race_free(uri->race);
 	free(uri);
 }
 
@@ -317,6 +379,53 @@ bool uri_output_tmpfile(uri_t u, char *path_template) {
 	return true;
 }
 
+bool uri_output_unpack(uri_t u, const char *dir_path) {
+	OUTPUT_GUARD;
+	u->unpack = unpack_package_stream(dir_path);
+	u->output = unpack_stream_file(u->unpack);
+	return true;
+}
+
+static bool cache_validators(const char *cache, const char *url, char **etag, long *last_modified);
+
+bool uri_output_resumable(uri_t u, const char *path) {
+	OUTPUT_GUARD;
+	char *part = aprintf("%s.part", path);
+	char *etag = NULL;
+	long last_modified = -1;
+	// Validators are bound to URL as mirrors have different ones for same content
+	bool resume = !uri_is_local(u) && cache_validators(part, u->uri, &etag, &last_modified);
+	if (etag && !strncmp(etag, "W/", 2)) { // Weak ETag can't be used in If-Range
+		free(etag);
+		etag = NULL;
+		resume = last_modified >= 0;
+	}
+	u->output = fopen(part, resume ? "a+" : "w+");
+	if (!u->output) {
+		free(etag);
+		uri_errno = URI_E_OUTPUT_OPEN_FAIL;
+		return false;
+	}
+	u->resume_path = strdup(path);
+	if (resume) {
+		fseek(u->output, 0, SEEK_END);
+		u->resume = ftell(u->output);
+	}
+	if (u->resume > 0) {
+		if (etag)
+			u->if_range = etag;
+		else {
+			char date[64];
+			time_t tm = last_modified;
+			strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&tm));
+			u->if_range = strdup(date);
+		}
+		TRACE("URI (%s) resuming from %ld bytes: %s", u->uri, u->resume, part);
+	} else
+		free(etag);
+	return true;
+}
+
 #undef OUTPUT_GUARD
 
 static void ensure_output(uri_t uri) {
@@ -324,6 +433,124 @@ static void ensure_output(uri_t uri) {
 		uri->output = open_memstream((char**)&uri->data, &uri->data_len);
 }
 
+// Read validators of cached content. Returns false if there is no valid cache.
+// If url is not NULL then validators are valid only if they were stored for it.
+// Note that etag is set to malloc allocated string or to NULL.
+static bool cache_validators(const char *cache, const char *url, char **etag, long *last_modified) {
+	const char *meta_path = aprintf("%s.meta", cache);
+	if (!statfile(cache, R_OK) || !statfile(meta_path, R_OK))
+		return false;
+	char *meta = readfile(meta_path);
+	if (!meta)
+		return false;
+	char *end;
+	errno = 0;
+	*last_modified = strtol(meta, &end, 10);
+	bool valid = !errno && *end == '\n';
+	if (valid) {
+		char *etag_end = strchr(++end, '\n');
+		*etag = etag_end && etag_end > end ? strndup(end, etag_end - end) : NULL;
+		valid = *etag || *last_modified >= 0;
+		if (valid && url) {
+			const char *url_end = etag_end ? strchr(++etag_end, '\n') : NULL;
+			valid = url_end && (size_t)(url_end - etag_end) == strlen(url) &&
+				!strncmp(etag_end, url, url_end - etag_end);
+			if (!valid) {
+				free(*etag);
+				*etag = NULL;
+			}
+		}
+	}
+	if (!valid)
+		*last_modified = -1;
+	free(meta);
+	return valid;
+}
+
+// Remove cached content and its validators
+static void cache_drop(const char *cache) {
+	unlink(aprintf("%s.meta", cache));
+	unlink(cache);
+}
+
+// Write given data to file atomically (trough temporally file and rename)
+static bool cache_write(const char *path, const uint8_t *data, size_t len) {
+	char *tmp = aprintf("%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return false;
+	bool ok = fwrite(data, 1, len, f) == len;
+	ok = !fclose(f) && ok;
+	if (ok && rename(tmp, path) == 0)
+		return true;
+	unlink(tmp);
+	return false;
+}
+
+// Remove partial file of resumable output
+static void resume_drop(struct uri *uri) {
+	cache_drop(aprintf("%s.part", uri->resume_path));
+}
+
+// Store validators of partially received content so download can be resumed
+// later. This is called by downloader once it starts receiving data.
+static void resume_start_callback(download_i_t inst, void *data) {
+	struct uri *uri = data;
+	const char *meta = aprintf("%s.part.meta", uri->resume_path);
+	const char *etag = download_etag(inst);
+	long last_modified = download_last_modified(inst);
+	if (!etag && last_modified < 0) {
+		unlink(meta); // We can't safely resume without validators
+		return;
+	}
+	const char *content = aprintf("%ld\n%s\n%s\n", last_modified, etag ?: "", uri->uri);
+	if (!cache_write(meta, (const uint8_t*)content, strlen(content)))
+		DBG("Unable to write validators of partial download: %s", meta);
+}
+
+// Move partial file of resumable output to its final path
+static bool resume_finish(struct uri *uri) {
+	const char *part = aprintf("%s.part", uri->resume_path);
+	unlink(aprintf("%s.meta", part));
+	if (rename(part, uri->resume_path)) {
+		uri_errno = URI_E_OUTPUT_WRITE_FAIL;
+		return false;
+	}
+	return true;
+}
+
+// Store verified content of URI and its validators to cache
+static void cache_store(struct uri *uri) {
+	char *dir = strdup(uri->cache);
+	bool dir_ok = mkdir_p(dirname(dir));
+	free(dir);
+	if (!dir_ok) {
+		char *err = path_utils_error();
+		WARN("Unable to create cache directory for %s: %s", uri->cache, err);
+		free(err);
+		return;
+	}
+	uint8_t *data;
+	size_t data_len;
+	if (uri->data) {
+		data = uri->data;
+		data_len = uri->data_len;
+	} else if ((data_len = ftell(uri->output)) > 0) {
+		ASSERT((data = mmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fileno(uri->output), 0)) != MAP_FAILED);
+	} else
+		data = NULL;
+	// Validators are removed first so they never describe different content
+	unlink(aprintf("%s.meta", uri->cache));
+	const char *meta = aprintf("%ld\n%s\n", uri->last_modified, uri->etag ?: "");
+	if (!cache_write(uri->cache, data, data_len) ||
+			!cache_write(aprintf("%s.meta", uri->cache), (const uint8_t*)meta, strlen(meta)))
+		WARN("Unable to store cache for %s (%s): %s", uri->uri, uri->cache, strerror(errno));
+	else
+		TRACE("URI (%s) stored to cache: %s", uri->uri, uri->cache);
+	if (!uri->data && data)
+		munmap(data, data_len);
+}
+
 bool uri_downloader_register(uri_t uri, downloader_t downloader) {
 	ASSERT_MSG(!uri->download_instance && !uri->finished,
 		"uri_download_register can be called only on not yet registered uri");
@@ -332,20 +559,36 @@ bool uri_downloader_register(uri_t uri, downloader_t downloader) {
 	ensure_output(uri);
 	ensure_default_signature(uri);
 
-	struct download_pem **pems = list_pem_collect(uri->pem, 0);
-
 	struct download_opts opts;
 	download_opts_def(&opts);
 	opts.ssl_verify = uri->ssl_verify;
 	opts.ocsp = uri->ocsp;
-	opts.pems = pems;
+	opts.pems = list_pems(uri->pem);
+	opts.hash = uri->hash;
+	opts.race = uri->race;
+	opts.race_lead = uri->race_lead;
+	opts.notify = uri->notify;
+	if (uri->resume_path) {
+		opts.resume = uri->resume;
+		opts.if_range = uri->if_range;
+		opts.start_callback = resume_start_callback;
+		opts.start_callback_data = uri;
+	}
 	if (uri->ca_pin) {
 		opts.cacert_file = NULL;
 		opts.capath = NULL;
 	}
+	char *etag = NULL;
+	if (uri->cache && cache_validators(uri->cache, NULL, &etag, &opts.last_modified))
+		opts.etag = etag;
 	uri->download_instance = download(downloader, uri->uri, uri->output, &opts);
-	free(pems);
+	free(etag);
 
+	if (uri->pubkey) {
+		uri->sig_uri->notify = uri->notify; // Signature is needed to finish URI
+		// Signature is not needed if URI loses race so it is cancelled with it
+		uri->sig_uri->race_lead = uri->race ? uri->download_instance : NULL;
+	}
 	if (uri->pubkey && !uri_downloader_register(uri->sig_uri, downloader)) {
 		uri_sub_errno = uri_errno;
 		uri_sub_err_uri = uri->sig_uri;
@@ -358,29 +601,117 @@ bool uri_downloader_register(uri_t uri, downloader_t downloader) {
 	return true;
 }
 
+void uri_downloader_unregister(uri_t uri) {
+	if (uri->download_instance) {
+		download_i_free(uri->download_instance);
+		uri->download_instance = NULL;
+	}
+	if (uri->sig_uri)
+		uri_downloader_unregister(uri->sig_uri);
+}
+
 download_i_t uri_download_instance(uri_t u) {
 	return u->download_instance;
 }
 
-static bool uri_finish_file(struct uri *uri) {
-	char *srcpath = uri_path(uri);
-	int fdin = open(srcpath, O_RDONLY);
-	free(srcpath);
-	if (fdin == -1) {
-		uri_errno = URI_E_FILE_INPUT_ERROR;
-		return false;
-	}
+download_i_t uri_sig_download_instance(uri_t u) {
+	return u->sig_uri ? u->sig_uri->download_instance : NULL;
+}
 
+// Update sums with data written to output (used only if data are not received
+// by downloader)
+static void hash_update(struct uri *uri, const void *data, size_t len) {
+	if (!uri->hash)
+		return;
+	MD5_Update(&uri->md5, data, len);
+	SHA256_Update(&uri->sha256, data, len);
+}
+
+// Copy content of given file descriptor to output of URI trough user space buffer
+static bool copy_fd_to_output(struct uri *uri, int fdin) {
 	char buf[BUFSIZ];
 	ssize_t rd;
 	while ((rd = read(fdin, buf, BUFSIZ)) > 0)
 		if (fwrite(buf, sizeof(char), rd, uri->output) != (size_t)rd) {
-			close(fdin);
 			uri_errno = URI_E_OUTPUT_WRITE_FAIL;
 			return false;
+		} else
+			hash_update(uri, buf, rd);
+	if (rd < 0) {
+		uri_errno = URI_E_FILE_INPUT_ERROR;
+		return false;
+	}
+	return true;
+}
+
+// Copy given file to output of URI in kernel (reflink or copy_file_range) if
+// output is file. Returns number of bytes copied. Rest has to be written trough
+// output stream.
+static size_t copy_in_kernel(struct uri *uri, int fdin, size_t len) {
+	int fdout = fileno(uri->output);
+	if (fdout == -1 || fflush(uri->output))
+		return 0; // Not a file or we can't write to it directly
+	size_t copied = 0;
+#ifdef FICLONE
+	if (ftell(uri->output) == 0 && !ioctl(fdout, FICLONE, fdin))
+		copied = len;
+#endif
+	while (copied < len) {
+		ssize_t ret = copy_file_range(fdin, NULL, fdout, NULL, len - copied, 0);
+		if (ret <= 0)
+			break;
+		copied += ret;
+	}
+	fseek(uri->output, 0, SEEK_END); // Output stream has to follow file descriptor
+	return copied;
+}
+
+/*
+Provide content of file on given path as output of URI. File is mapped to memory
+and if URI has no output then mapped memory is used directly as its data.
+Otherwise file is copied in kernel if possible and it is written trough output
+stream only as a fallback. Mapping is preserved in URI (for signature
+verification) and unmapped once URI is finished.
+*/
+static bool copy_to_output(struct uri *uri, const char *srcpath) {
+	int fdin = open(srcpath, O_RDONLY);
+	if (fdin == -1) {
+		uri_errno = URI_E_FILE_INPUT_ERROR;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fdin, &st) || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+			(uri->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdin, 0)) == MAP_FAILED) {
+		// Fallback for empty and special files
+		uri->map = NULL;
+		ensure_output(uri);
+		bool ret = copy_fd_to_output(uri, fdin);
+		close(fdin);
+		return ret;
+	}
+	uri->map_len = st.st_size;
+	hash_update(uri, uri->map, uri->map_len);
+	bool ret = true;
+	if (!uri->output) {
+		uri->data = uri->map;
+		uri->data_len = uri->map_len;
+	} else {
+		size_t copied = copy_in_kernel(uri, fdin, uri->map_len);
+		if (copied < uri->map_len && fwrite(uri->map + copied, 1, uri->map_len - copied, uri->output)
+				!= uri->map_len - copied) {
+			uri_errno = URI_E_OUTPUT_WRITE_FAIL;
+			ret = false;
 		}
+	}
 	close(fdin);
-	return true;
+	return ret;
+}
+
+static bool uri_finish_file(struct uri *uri) {
+	char *srcpath = uri_path(uri);
+	bool ret = copy_to_output(uri, srcpath);
+	free(srcpath);
+	return ret;
 }
 
 static const char *data_param_base64 = "base64";
@@ -402,6 +733,7 @@ static bool uri_finish_data(struct uri *uri) {
 		uint8_t *buf;
 		size_t bufsiz = base64_mdecode(start, len, &buf);
 		size_t written = fwrite(buf, 1, bufsiz, uri->output);
+		hash_update(uri, buf, bufsiz);
 		free(buf);
 		if (written != bufsiz) {
 			uri_errno = URI_E_OUTPUT_WRITE_FAIL;
@@ -410,7 +742,8 @@ static bool uri_finish_data(struct uri *uri) {
 	} else if (fputs(start, uri->output) <= 0) {
 		uri_errno = URI_E_OUTPUT_WRITE_FAIL;
 		return false;
-	}
+	} else
+		hash_update(uri, start, len);
 	return true;
 }
 
@@ -431,7 +764,10 @@ static bool verify_signature(struct uri *uri) {
 
 	uint8_t *data;
 	size_t data_len;
-	if (uri->data) {
+	if (uri->map) { // Verify local file in place
+		data = uri->map;
+		data_len = uri->map_len;
+	} else if (uri->data) {
 		data = uri->data;
 		data_len = uri->data_len;
 	} else {
@@ -446,7 +782,7 @@ static bool verify_signature(struct uri *uri) {
 		uri_errno = URI_E_VERIFY_FAIL;
 	}
 
-	if (!uri->data)
+	if (!uri->map && !uri->data)
 		munmap(data, data_len);
 	free(pubkeys);
 	uri_free(uri->sig_uri);
@@ -459,15 +795,19 @@ bool uri_finish(uri_t uri, const uint8_t **data, size_t *len) {
 	if (uri->finished)
 		goto tail;
 	TRACE("URI finish: %s", uri->uri);
+	if (uri->hash) {
+		MD5_Init(&uri->md5);
+		SHA256_Init(&uri->sha256);
+	}
 	if (uri_is_local(uri)) {
-		ensure_output(uri);
 		ensure_default_signature(uri);
 		switch (uri->scheme) {
-			case URI_S_FILE:
+			case URI_S_FILE: // Output is ensured only if file can't be mapped
 				if (!uri_finish_file(uri))
 					return false;
 				break;
 			case URI_S_DATA:
+				ensure_output(uri);
 				if (!uri_finish_data(uri))
 					return false;
 				break;
@@ -481,16 +821,62 @@ bool uri_finish(uri_t uri, const uint8_t **data, size_t *len) {
 			uri_errno = download_is_done(uri->download_instance) ? URI_E_DOWNLOAD_FAIL : URI_E_UNFINISHED_DOWNLOAD;
 			return false;
 		}
+		if (uri->cache) {
+			uri->cached = download_is_not_modified(uri->download_instance);
+			const char *etag = download_etag(uri->download_instance);
+			uri->etag = etag ? strdup(etag) : NULL;
+			uri->last_modified = download_last_modified(uri->download_instance);
+		}
+		uri->stats = *download_stats(uri->download_instance);
+		uri->has_stats = true;
+		if (uri->hash && !uri->cached) {
+			memcpy(uri->md5_sum, download_md5(uri->download_instance), MD5_DIGEST_LENGTH);
+			memcpy(uri->sha256_sum, download_sha256(uri->download_instance), SHA256_DIGEST_LENGTH);
+		}
 		download_i_free(uri->download_instance);
 		uri->download_instance = NULL;
+		if (uri->cached) {
+			TRACE("URI (%s) not modified, using cache: %s", uri->uri, uri->cache);
+			if (!copy_to_output(uri, uri->cache)) {
+				cache_drop(uri->cache);
+				return false;
+			}
+		}
+	}
+	if (uri->hash && (uri_is_local(uri) || uri->cached)) {
+		MD5_Final(uri->md5_sum, &uri->md5);
+		SHA256_Final(uri->sha256_sum, &uri->sha256);
 	}
-	fflush(uri->output);
 	uri->finished = true;
-	if (!verify_signature(uri))
+	if (uri->unpack) {
+		uri->output = NULL;
+		if (!unpack_stream_finish(uri->unpack)) {
+			uri_errno = URI_E_UNPACK_FAIL;
+			return false;
+		}
+		goto tail;
+	}
+	if (uri->output)
+		fflush(uri->output);
+	if (!verify_signature(uri)) {
+		if (uri->cached) // Cached content is no longer valid so drop it
+			cache_drop(uri->cache);
+		if (uri->resume_path) // Partial content is not valid either
+			resume_drop(uri);
 		return false;
-	fclose(uri->output);
+	}
+	if (uri->cache && !uri->cached && (uri->etag || uri->last_modified >= 0))
+		cache_store(uri);
+	if (uri->output)
+		fclose(uri->output);
 	uri->output = NULL;
+	if (uri->resume_path && !resume_finish(uri))
+		return false;
 tail:
+	if (uri->map && uri->data != uri->map) { // Mapping is no longer needed
+		munmap(uri->map, uri->map_len);
+		uri->map = NULL;
+	}
 	if (data)
 		*data = uri->data;
 	if (len)
@@ -509,6 +895,25 @@ const char *uri_download_error(struct uri *uri) {
 	return download_error(uri->download_instance);
 }
 
+const struct download_stats *uri_download_stats(const uri_t uri) {
+	if (uri->download_instance)
+		return download_is_done(uri->download_instance) ? download_stats(uri->download_instance) : NULL;
+	return uri->has_stats ? &uri->stats : NULL;
+}
+
+const char *uri_unpack_error(struct uri *uri) {
+	ASSERT_MSG(uri->unpack, "uri_unpack_error can be called only on URIs with unpack output.");
+	return unpack_stream_error(uri->unpack);
+}
+
+const uint8_t *uri_md5(const uri_t uri) {
+	return (uri->hash && uri->finished) ? uri->md5_sum : NULL;
+}
+
+const uint8_t *uri_sha256(const uri_t uri) {
+	return (uri->hash && uri->finished) ? uri->sha256_sum : NULL;
+}
+
 const char *uri_scheme_string(enum uri_scheme scheme) {
 	return schemes_table[scheme];
 }
@@ -547,8 +952,20 @@ static struct download_pem **list_pem_collect(struct uri_local_list *list, size_
 	return pems;
 }
 
+// Returns collected PEMs or NULL if there are none. Lists are never modified
+// once created (new PEMs are added as new head) so we collect PEMs only once and
+// keep result in head of the list.
+static struct download_pem **list_pems(struct uri_local_list *list) {
+	if (!list)
+		return NULL;
+	if (!list->pems)
+		list->pems = list_pem_collect(list, 0);
+	return list->pems[0] ? list->pems : NULL;
+}
+
 // deallocation handler for CA and CRL list
 static void list_pem_free(struct uri_local_list *list) {
+	free(list->pems);
 	if (list->uri)
 		uri_free(list->uri);
 	if (list->dt.pem)
@@ -660,3 +1077,57 @@ bool uri_set_sig(uri_t u, const char *sig_uri) {
 	TRACE("URI signature set (%s): %s", u->uri, u->sig_uri->uri);
 	return true;
 }
+
+void uri_set_cache(uri_t u, const char *path) {
+	CONFIG_GUARD;
+	free(u->cache);
+	u->cache = path ? strdup(path) : NULL;
+	TRACE("URI cache (%s): %s", u->uri, path ?: "none");
+}
+
+void uri_set_hash(uri_t u, bool enabled) {
+	CONFIG_GUARD;
+	TRACE("URI hash (%s): %s", u->uri, STRBOOL(enabled));
+	u->hash = enabled;
+}
+
+void uri_set_notify(uri_t u, bool enabled) {
+	CONFIG_GUARD;
+	TRACE("URI notify (%s): %s", u->uri, STRBOOL(enabled));
+	u->notify = enabled;
+}
+
+bool uri_is_ready(const uri_t u) {
+	if (u->finished || uri_is_local(u))
+		return true;
+	if (!u->download_instance || !download_is_done(u->download_instance)
+			|| !download_is_success(u->download_instance))
+		return false;
+	return !u->pubkey || uri_is_ready(u->sig_uri);
+}
+
+bool uri_is_cached(const uri_t u) {
+	return u->cached;
+}
+
+void uri_race_join(uri_t u, uri_t other) {
+	CONFIG_GUARD;
+	ASSERT_MSG(!other->download_instance && !other->finished,
+		"(%s) URI can't join race of already registered URI (%s)", u->uri, other->uri);
+	TRACE("URI race (%s): %s", u->uri, other->uri);
+	if (!other->race)
+		other->race = download_race_new();
+	if (u->race)
+		download_race_free(u->race);
+	u->race = download_race_ref(other->race);
+}
+
+bool uri_race_won(const uri_t u) {
+	return u->download_instance && download_is_done(u->download_instance)
+		&& download_race_won(u->download_instance);
+}
+
+bool uri_is_cancelled(const uri_t u) {
+	return u->download_instance && download_is_done(u->download_instance)
+		&& download_is_cancelled(u->download_instance);
+}
@@ -37,6 +37,7 @@ enum uri_error {
 	URI_E_SIG_FAIL, // Getting configured signature failed (see uri_sub_errno)
 	URI_E_VERIFY_FAIL, // Signature does not match any public key or content does not hold integrity
 	URI_E_NONLOCAL, // Configuration URI is not of local type
+	URI_E_UNPACK_FAIL, // Unpack of received data failed (see uri_unpack_error)
 };
 
 // URI error number
@@ -98,6 +99,28 @@ bool uri_output_file(uri_t uri, const char *path) __attribute__((nonnull));
 // Possible errors: URI_E_OUTPUT_OPEN_FAIL
 bool uri_output_tmpfile(uri_t uri, char *path_template) __attribute__((nonnull));
 
+// Set output for given URI. Data are written to file on given path with .part
+// appended and file is moved to given path once URI is successfully finished.
+// If such partial file already exists (previous download was interrupted) then
+// download is resumed from its end (HTTP Range request). Validators of partial
+// content are stored to file with .part.meta appended together with URI they
+// were received from so resume is performed only for same URI and only if content
+// on server was not changed in the meantime. If server refuses resume then
+// partial file is dropped and whole content is received again.
+// uri: uri object to register output to
+// path: path to file data should be written to
+// Returns true on success or false on error.
+// Possible errors: URI_E_OUTPUT_OPEN_FAIL
+bool uri_output_resumable(uri_t uri, const char *path) __attribute__((nonnull));
+
+// Set output for given URI. Received data are expected to be package and are
+// unpacked to given directory as they are received (see unpack_package).
+// Signature verification and cache can't be used with this output.
+// uri: uri object to register output to
+// dir_path: path to directory package should be unpacked to
+// Returns true on success or false on error.
+bool uri_output_unpack(uri_t uri, const char *dir_path) __attribute__((nonnull));
+
 // Register given URI to downloader to be downloaded
 // uri: URI object downloader is registered to
 // downloader: Downloader object
@@ -106,10 +129,21 @@ bool uri_output_tmpfile(uri_t uri, char *path_template) __attribute__((nonnull))
 bool uri_downloader_register(uri_t uri, downloader_t downloader)
 	__attribute__((nonnull));
 
+// Remove URI (and its signature URI) from downloader it was registered to.
+// This frees download instance so it is no longer valid. You have to call this
+// before URI is freed if downloader outlives it.
+// uri: URI object to be unregistered
+void uri_downloader_unregister(uri_t uri) __attribute__((nonnull));
+
 // Provides access to download instance.
 // uri: URI object to get download instance for
 // Returns download instance or NULL in case uri_downloader_register wasn't called.
 download_i_t uri_download_instance(uri_t uri) __attribute__((nonnull));
+// Provides access to download instance of signature.
+// uri: URI object to get download instance of its signature for
+// Returns download instance or NULL in case there is no signature or
+// uri_downloader_register wasn't called.
+download_i_t uri_sig_download_instance(uri_t uri) __attribute__((nonnull));
 
 // Ensure that URI is received and provide access to data.
 // You can call this only after any uri_output function.
@@ -122,18 +156,52 @@ download_i_t uri_download_instance(uri_t uri) __attribute__((nonnull));
 // Returns true on retrieval success otherwise false.
 // Possible errors: URI_E_UNFINISHED_DOWNLOAD, URI_E_DOWNLOAD_FAILED,
 // URI_E_OUTPUT_OPEN_FAIL, URI_E_FILE_INPUT_ERROR, URI_E_OUTPUT_WRITE_FAIL,
-// URI_E_VERIFY_FAIL, URI_E_SIG_FAIL
+// URI_E_VERIFY_FAIL, URI_E_SIG_FAIL, URI_E_UNPACK_FAIL
 bool uri_finish(uri_t uri, const uint8_t **data, size_t *len) __attribute__((nonnull(1)));
 
 // Build error message of URI retrieval failure.
 // Returns string with error message.
 const char *uri_error_msg(enum uri_error);
 
+// Check if content of URI was provided from persistent cache (see uri_set_cache).
+// This is valid only after successful uri_finish.
+bool uri_is_cached(const uri_t) __attribute__((nonnull));
+
 // Returns pointer to error string for URI that reported URI_E_DOWNLOAD_FAILED
 // when uri_finish was called.
 // Returned string is valid until uri object is freed.
 const char *uri_download_error(uri_t) __attribute((nonnull));
 
+// Returns statistics of URI download (see download_stats).
+// NULL is returned for local URIs and for URIs that were not yet downloaded.
+// Returned pointer is valid until uri object is freed.
+const struct download_stats *uri_download_stats(const uri_t) __attribute__((nonnull));
+
+// Check if URI and its signature (if verified) were successfully downloaded so
+// it can be finished while downloader is not done with other URIs yet (see
+// uri_set_notify). Local and already finished URIs are always ready.
+bool uri_is_ready(const uri_t) __attribute__((nonnull));
+
+// Check if URI won download race (see uri_race_join).
+// This is valid only after downloader_run and false is returned otherwise.
+bool uri_race_won(const uri_t) __attribute__((nonnull));
+
+// Check if URI download was cancelled because other URI won download race (see
+// uri_race_join). Such URI can't be finished.
+// This is valid only after downloader_run and false is returned otherwise.
+bool uri_is_cancelled(const uri_t) __attribute__((nonnull));
+
+// Returns pointer to error string for URI that reported URI_E_UNPACK_FAIL when
+// uri_finish was called.
+// Returned string is valid until uri object is freed.
+const char *uri_unpack_error(uri_t) __attribute((nonnull));
+
+// Returns MD5 (16 bytes) or SHA256 (32 bytes) sum of received data. These are
+// computed as data are received and are available only after uri_finish of URI
+// with enabled hashing (see uri_set_hash). Otherwise NULL is returned.
+const uint8_t *uri_md5(const uri_t) __attribute__((nonnull));
+const uint8_t *uri_sha256(const uri_t) __attribute__((nonnull));
+
 // HTTPS configurations //
 // Set if SSL certification verification should be done
 // uri: URI object system CA to be set to
@@ -185,5 +253,42 @@ bool uri_add_pubkey(uri_t uri, const char *pubkey_uri) __attribute__((nonnull(1)
 // This option is not inherited!
 // Possible errors: all errors by uri_to_temp_file
 bool uri_set_sig(uri_t uri, const char *sig_uri) __attribute__((nonnull(1)));
+// Cache configuration //
+// Set persistent cache for given URI. Content is stored to file on given path
+// after it is successfully received and verified together with validators (ETag
+// and modification time) provided by server (those are stored to path with
+// appended .meta). When cache exists then conditional request is used and if
+// server reports that content was not modified then cached content is used
+// instead. Cached content still goes trough signature verification.
+// uri: URI object cache is set for
+// path: path to file with cached content. You can pass NULL to disable cache.
+// This has effect only on remote URIs.
+// This option is not inherited!
+void uri_set_cache(uri_t uri, const char *path) __attribute__((nonnull(1)));
+// Set if MD5 and SHA256 sums of received data should be computed. Sums are
+// computed while data are received so there is no need to read output again.
+// Use uri_md5 and uri_sha256 to get them.
+// uri: URI object hashing is configured for
+// enabled: If sums should be computed
+// In default this is disabled.
+// This option is not inherited!
+void uri_set_hash(uri_t uri, bool enabled) __attribute__((nonnull));
+// Set if downloader_run should return once URI is successfully downloaded. This
+// way URI can be finished and processed while other downloads are still running
+// (see uri_is_ready). Signature of URI is notified as well.
+// uri: URI object notification is configured for
+// enabled: If downloader_run should return
+// In default this is disabled.
+// This option is not inherited!
+void uri_set_notify(uri_t uri, bool enabled) __attribute__((nonnull));
+// Make URI race with other URI (and all URIs that already race with it). The
+// first of them that receives data wins and downloads of all others are
+// cancelled. Failure of URI that did not win is not reported unless there is no
+// other URI left to win. This is intended for same content provided by multiple
+// mirrors. Local URIs are not downloaded so they do not participate in race.
+// uri: URI object joining the race
+// other: URI object race is joined with
+// This option is not inherited!
+void uri_race_join(uri_t uri, uri_t other) __attribute__((nonnull));
 
 #endif
@@ -31,10 +31,22 @@
 
 #define URI_MASTER_META "updater_uri_master_meta"
 #define URI_MASTER_REGISTRY "libupdater_uri_master"
+#define URI_MASTER_INSTANCES "libupdater_uri_master_instances"
+#define URI_MASTER_PENDING "libupdater_uri_master_pending"
 #define URI_META "updater_uri_meta"
 
 struct uri_lua;
 
+// Downloader shared by all URI masters so connections and TLS sessions are
+// reused between them. It is never freed as it lives as long as process does.
+static struct downloader *shared_downloader = NULL;
+
+static struct downloader *get_shared_downloader(void) {
+	if (!shared_downloader)
+		shared_downloader = downloader_new(DEFAULT_PARALLEL_DOWNLOAD);
+	return shared_downloader;
+}
+
 struct uri_master {
 	struct downloader *downloader;
 	unsigned rid;
@@ -44,7 +56,7 @@ static int lua_uri_master_new(lua_State *L) {
 	struct uri_master *urim = lua_newuserdata(L, sizeof *urim);
 	static unsigned rid_seq = 0; // Note: no rollover expected
 	urim->rid = rid_seq++;
-	urim->downloader = downloader_new(DEFAULT_PARALLEL_DOWNLOAD);
+	urim->downloader = get_shared_downloader();
 	luaL_getmetatable(L, URI_MASTER_META);
 	lua_setmetatable(L, -2);
 
@@ -53,13 +65,40 @@ static int lua_uri_master_new(lua_State *L) {
 	lua_newtable(L);
 	lua_settable(L, -3);
 	lua_pop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_INSTANCES);
+	lua_pushinteger(L, urim->rid);
+	lua_newtable(L);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_PENDING);
+	lua_pushinteger(L, urim->rid);
+	lua_newtable(L);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
 
 	TRACE("Allocated new URI master");
 	return 1;
 }
 
+static int lua_uri_download_limits(lua_State *L) {
+	struct downloader *d = get_shared_downloader();
+	if (lua_gettop(L) > 0) {
+		int total = luaL_checkinteger(L, 1);
+		int per_host = luaL_optinteger(L, 2, 0);
+		bool adaptive = lua_toboolean(L, 3);
+		if (total < 1)
+			return luaL_argerror(L, 1, "limit has to be positive number");
+		if (per_host < 0)
+			return luaL_argerror(L, 2, "limit can't be negative");
+		downloader_set_limits(d, total, per_host, adaptive);
+	}
+	lua_pushinteger(L, downloader_limit(d));
+	return 1;
+}
+
 static const struct inject_func funcs[] = {
-	{ lua_uri_master_new, "new" }
+	{ lua_uri_master_new, "new" },
+	{ lua_uri_download_limits, "download_limits" }
 };
 
 struct uri_lua {
@@ -67,14 +106,28 @@ struct uri_lua {
 	char *fpath; // used only when outputing to file
 };
 
-// Pushes registry table for given uri master
-static void lua_uri_master_registry(lua_State *L, struct uri_master *urim) {
-	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_REGISTRY);
+// Pushes table for given uri master from given registry
+static void lua_uri_master_table(lua_State *L, struct uri_master *urim, const char *registry) {
+	lua_getfield(L, LUA_REGISTRYINDEX, registry);
 	lua_pushinteger(L, urim->rid);
 	lua_gettable(L, -2);
 	lua_replace(L, -2);
 }
 
+// Pushes registry table for given uri master (URIs not yet registered for download)
+static void lua_uri_master_registry(lua_State *L, struct uri_master *urim) {
+	lua_uri_master_table(L, urim, URI_MASTER_REGISTRY);
+}
+
+// Replaces table for given uri master in given registry with empty one
+static void lua_uri_master_table_reset(lua_State *L, struct uri_master *urim, const char *registry) {
+	lua_getfield(L, LUA_REGISTRYINDEX, registry);
+	lua_pushinteger(L, urim->rid);
+	lua_newtable(L);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+}
+
 static int lua_new_uri_tail(lua_State *L, struct uri_master *urim, struct uri *u, char *fpath) {
 	// Verify uri
 	if (!u) {
@@ -112,6 +165,20 @@ static int lua_uri_master_to_file(lua_State *L) {
 	return lua_new_uri_tail(L, urim, u, strdup(output_path));
 }
 
+static int lua_uri_master_to_resumable_file(lua_State *L) {
+	struct uri_master *urim = luaL_checkudata(L, 1, URI_MASTER_META);
+	const char *str_uri = luaL_checkstring(L, 2);
+	const char *output_path = luaL_checkstring(L, 3);
+	struct uri *parent = NULL;
+	if (!lua_isnoneornil(L, 4))
+		parent = ((struct uri_lua*)luaL_checkudata(L, 4, URI_META))->uri;
+
+	struct uri *u = uri(str_uri, parent);
+	if (u)
+		uri_output_resumable(u, output_path);
+	return lua_new_uri_tail(L, urim, u, strdup(output_path));
+}
+
 static int lua_uri_master_to_temp_file(lua_State *L) {
 	struct uri_master *urim = luaL_checkudata(L, 1, URI_MASTER_META);
 	const char *str_uri = luaL_checkstring(L, 2);
@@ -126,6 +193,20 @@ static int lua_uri_master_to_temp_file(lua_State *L) {
 	return lua_new_uri_tail(L, urim, u, fpath);
 }
 
+static int lua_uri_master_to_unpacked(lua_State *L) {
+	struct uri_master *urim = luaL_checkudata(L, 1, URI_MASTER_META);
+	const char *str_uri = luaL_checkstring(L, 2);
+	const char *dir_path = luaL_checkstring(L, 3);
+	struct uri *parent = NULL;
+	if (!lua_isnoneornil(L, 4))
+		parent = ((struct uri_lua*)luaL_checkudata(L, 4, URI_META))->uri;
+
+	struct uri *u = uri(str_uri, parent);
+	if (u)
+		uri_output_unpack(u, dir_path);
+	return lua_new_uri_tail(L, urim, u, NULL);
+}
+
 static int lua_uri_master_to_buffer(lua_State *L) {
 	struct uri_master *urim = luaL_checkudata(L, 1, URI_MASTER_META);
 	const char *str_uri = luaL_checkstring(L, 2);
@@ -137,17 +218,70 @@ static int lua_uri_master_to_buffer(lua_State *L) {
 	return lua_new_uri_tail(L, urim, u, NULL);
 }
 
+// Check if value on given index is URI object that owns given download
+// instance. Instance of signature is considered only if sig is set.
+static bool lua_uri_owns_instance(lua_State *L, int index, struct download_i *inst, bool sig) {
+	if (lua_isnil(L, index))
+		return false;
+	struct uri *u = ((struct uri_lua*)luaL_checkudata(L, index, URI_META))->uri;
+	// URI might have been finished and its instance address reused
+	return uri_download_instance(u) == inst || (sig && uri_sig_download_instance(u) == inst);
+}
+
+/*
+ * Downloader is shared so download of one master also finishes instances of
+ * other masters. This finds URI object of given instance in instances tables of
+ * all masters and adds it to pending table of its master so it is reported by
+ * download of that master. Pending entry is pair of URI object and notify flag.
+ * Failed instance is reported only for URI itself (failed signatures are
+ * reported on URI finish) but notify is reported for signature as well. Returns
+ * false if there is no such URI.
+ */
+static bool lua_uri_master_pend(lua_State *L, struct download_i *inst, bool notify) {
+	bool found = false;
+	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_INSTANCES);
+	lua_pushnil(L);
+	while (!found && lua_next(L, -2) != 0) {
+		lua_pushlightuserdata(L, inst);
+		lua_rawget(L, -2);
+		if (lua_uri_owns_instance(L, -1, inst, notify)) {
+			lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_PENDING);
+			lua_pushvalue(L, -4); // rid of master
+			lua_rawget(L, -2);
+			lua_createtable(L, 2, 0);
+			lua_pushvalue(L, -4);
+			lua_rawseti(L, -2, 1);
+			lua_pushboolean(L, notify);
+			lua_rawseti(L, -2, 2);
+			lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+			lua_pop(L, 2); // pop pending table and registry
+			found = true;
+		}
+		lua_pop(L, 2); // pop URI and instances table of master
+	}
+	if (found)
+		lua_pop(L, 1); // pop key as traversal was not finished
+	lua_pop(L, 1); // pop instances registry
+	return found;
+}
+
+/*
+ * URIs are moved on registration for download from registry table to instances
+ * table. That one maps download instances (as light user data) to URI objects so
+ * failed instance can be mapped back to URI without scanning all URIs. Instance
+ * of signature is mapped to URI object that owns it.
+ */
 static int lua_uri_master_download(lua_State *L) {
 	TRACE("URI master download");
 	struct uri_master *urim = luaL_checkudata(L, 1, URI_MASTER_META);
+	lua_uri_master_table(L, urim, URI_MASTER_INSTANCES);
 	lua_uri_master_registry(L, urim);
 	lua_pushnil(L);
 	while (lua_next(L, -2) != 0) {
 		lua_pop(L, 1); // pop value (just boolean true)
 		struct uri_lua *uri = luaL_checkudata(L, -1, URI_META);
-		if (uri_download_instance(uri->uri))
-			continue;
-		if (!uri_downloader_register(uri->uri, urim->downloader)) {
+		if (!uri_download_instance(uri->uri) &&
+				!uri_downloader_register(uri->uri, urim->downloader)) {
 			char *err;
 			if (uri_errno == URI_E_SIG_FAIL)
 				err = aprintf("Error while registering for download: %s: %s: %s: %s",
@@ -158,30 +292,64 @@ static int lua_uri_master_download(lua_State *L) {
 						uri_uri(uri->uri), uri_error_msg(uri_errno));
 			return luaL_error(L, err);
 		}
+		lua_pushlightuserdata(L, uri_download_instance(uri->uri));
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -5);
+		if (uri_sig_download_instance(uri->uri)) {
+			lua_pushlightuserdata(L, uri_sig_download_instance(uri->uri));
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -5);
+		}
+	}
+	lua_pop(L, 1); // pop registry table
+	lua_uri_master_table_reset(L, urim, URI_MASTER_REGISTRY);
+
+	// Report URIs that failed or were notified in download of some other master first
+	lua_uri_master_table(L, urim, URI_MASTER_PENDING);
+	size_t pending = lua_objlen(L, -1);
+	if (pending > 0) {
+		lua_rawgeti(L, -1, pending);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, pending);
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		if (lua_toboolean(L, -1))
+			return 2;
+		lua_pop(L, 1);
+		return 1;
 	}
+	lua_pop(L, 1);
 
 	struct download_i *inst;
 	do {
 		inst = downloader_run(urim->downloader);
-		if (inst) {
-			lua_pushnil(L);
-			while (lua_next(L, -2) != 0) {
-				lua_pop(L, 1);
-				struct uri_lua *uri = luaL_checkudata(L, -1, URI_META);
-				if (uri_download_instance(uri->uri) == inst)
-					return 1; // Just return this URI object
+		if (inst && download_is_success(inst)) {
+			// Finished URI with notify (or its signature)
+			lua_pushlightuserdata(L, inst);
+			lua_rawget(L, -2);
+			if (lua_uri_owns_instance(L, -1, inst, true)) {
+				lua_pushboolean(L, true);
+				return 2;
 			}
-			// We continue as this should be failed signature and those are
-			// resolved later on when we call finish on uri object that owns given
-			// signature
+			lua_pop(L, 1);
+			// Notification of URI of other master is reported by download of that master
+			lua_uri_master_pend(L, inst, true);
+		} else if (inst) {
+			lua_pushlightuserdata(L, inst);
+			lua_rawget(L, -2);
+			if (lua_uri_owns_instance(L, -1, inst, false))
+				return 1; // Just return this URI object
+			lua_pop(L, 1);
+			// Failed URI of other master is reported by download of that master.
+			// Otherwise we continue as this should be failed signature and those
+			// are resolved later on when we call finish on uri object that owns
+			// given signature.
+			lua_uri_master_pend(L, inst, false);
 		}
 	} while (inst);
 
-	// Push empty table so we drop reference to all completed uris
-	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_REGISTRY);
-	lua_pushinteger(L, urim->rid);
-	lua_newtable(L);
-	lua_settable(L, -3);
+	// Drop reference to all completed uris
+	lua_uri_master_table_reset(L, urim, URI_MASTER_INSTANCES);
 	return 0;
 }
 
@@ -192,13 +360,22 @@ static int lua_uri_master_gc(lua_State *L) {
 	lua_pushinteger(L, urim->rid);
 	lua_pushnil(L);
 	lua_settable(L, -3);
-	downloader_free(urim->downloader);
+	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_INSTANCES);
+	lua_pushinteger(L, urim->rid);
+	lua_pushnil(L);
+	lua_settable(L, -3);
+	lua_getfield(L, LUA_REGISTRYINDEX, URI_MASTER_PENDING);
+	lua_pushinteger(L, urim->rid);
+	lua_pushnil(L);
+	lua_settable(L, -3);
 	return 0;
 }
 
 static const struct inject_func uri_master_meta[] = {
 	{ lua_uri_master_to_file, "to_file" },
+	{ lua_uri_master_to_resumable_file, "to_resumable_file" },
 	{ lua_uri_master_to_temp_file, "to_temp_file" },
+	{ lua_uri_master_to_unpacked, "to_unpacked" },
 	{ lua_uri_master_to_buffer, "to_buffer" },
 	{ lua_uri_master_download, "download" },
 	{ lua_uri_master_gc, "__gc" }
@@ -224,6 +401,10 @@ static int lua_uri_finish(lua_State *L) {
 				return luaL_error(L, "Unable to finish URI (%s): %s: %s: %s",
 						uri_uri(uri->uri), uri_error_msg(uri_errno),
 						uri_uri(uri_sub_err_uri), uri_error_msg(uri_sub_errno));
+			case URI_E_UNPACK_FAIL:
+				return luaL_error(L, "Unable to finish URI (%s): %s: %s",
+						uri_uri(uri->uri), uri_error_msg(uri_errno),
+						uri_unpack_error(uri->uri));
 			default:
 				return luaL_error(L, "Unable to finish URI (%s): %s",
 						uri_uri(uri->uri), uri_error_msg(uri_errno));
@@ -313,6 +494,106 @@ static int lua_uri_set_sig(lua_State *L) {
 	return 0;
 }
 
+static int lua_uri_set_cache(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	const char *path = NULL;
+	if (!lua_isnoneornil(L, 2))
+		path = luaL_checkstring(L, 2);
+	uri_set_cache(uri->uri, path);
+	return 0;
+}
+
+static int lua_uri_set_hash(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	uri_set_hash(uri->uri, lua_toboolean(L, 2));
+	return 0;
+}
+
+static int lua_uri_set_notify(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	uri_set_notify(uri->uri, lua_toboolean(L, 2));
+	return 0;
+}
+
+static int lua_uri_is_ready(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	lua_pushboolean(L, uri_is_ready(uri->uri));
+	return 1;
+}
+
+static int lua_uri_is_cached(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	lua_pushboolean(L, uri_is_cached(uri->uri));
+	return 1;
+}
+
+static int lua_uri_race_join(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	struct uri_lua *other = luaL_checkudata(L, 2, URI_META);
+	uri_race_join(uri->uri, other->uri);
+	return 0;
+}
+
+static int lua_uri_race_won(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	lua_pushboolean(L, uri_race_won(uri->uri));
+	return 1;
+}
+
+static int lua_uri_is_cancelled(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	lua_pushboolean(L, uri_is_cancelled(uri->uri));
+	return 1;
+}
+
+// Push hexadecimal representation of given sum or nil if sum is NULL
+static void push_sum(lua_State *L, const uint8_t *sum, size_t len) {
+	if (!sum) {
+		lua_pushnil(L);
+		return;
+	}
+	char hex[2*len + 1];
+	for (size_t i = 0; i < len; i++)
+		sprintf(hex + 2*i, "%02x", sum[i]);
+	lua_pushlstring(L, hex, 2*len);
+}
+
+static int lua_uri_md5(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	push_sum(L, uri_md5(uri->uri), 16);
+	return 1;
+}
+
+static int lua_uri_sha256(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	push_sum(L, uri_sha256(uri->uri), 32);
+	return 1;
+}
+
+static int lua_uri_download_stats(lua_State *L) {
+	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
+	const struct download_stats *stats = uri_download_stats(uri->uri);
+	if (!stats)
+		return 0;
+	lua_newtable(L);
+	lua_pushnumber(L, stats->size);
+	lua_setfield(L, -2, "size");
+#define STAT_TIME(FIELD) do { \
+		lua_pushnumber(L, stats->FIELD / 1000000.0); \
+		lua_setfield(L, -2, #FIELD); \
+	} while (false)
+	STAT_TIME(connect_time);
+	STAT_TIME(tls_time);
+	STAT_TIME(first_byte_time);
+	STAT_TIME(total_time);
+	STAT_TIME(start);
+	STAT_TIME(finish);
+#undef STAT_TIME
+	lua_pushnumber(L, stats->speed);
+	lua_setfield(L, -2, "speed");
+	return 1;
+}
+
 static int lua_uri_download_error(lua_State *L) {
 	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
 	lua_pushstring(L, uri_download_error(uri->uri));
@@ -323,6 +604,8 @@ static int lua_uri_gc(lua_State *L) {
 	struct uri_lua *uri = luaL_checkudata(L, 1, URI_META);
 	TRACE("Freeing uri");
 	free(uri->fpath);
+	// Downloader is shared and outlives this URI so we have to unregister it
+	uri_downloader_unregister(uri->uri);
 	uri_free(uri->uri);
 	return 0;
 }
@@ -339,7 +622,18 @@ static const struct inject_func uri_meta[] = {
 	{ lua_uri_set_ocsp, "set_ocsp" },
 	{ lua_uri_add_pubkey, "add_pubkey" },
 	{ lua_uri_set_sig, "set_sig" },
+	{ lua_uri_set_cache, "set_cache" },
+	{ lua_uri_is_cached, "is_cached" },
+	{ lua_uri_set_hash, "set_hash" },
+	{ lua_uri_set_notify, "set_notify" },
+	{ lua_uri_is_ready, "is_ready" },
+	{ lua_uri_md5, "md5" },
+	{ lua_uri_sha256, "sha256" },
+	{ lua_uri_race_join, "race_join" },
+	{ lua_uri_race_won, "race_won" },
+	{ lua_uri_is_cancelled, "is_cancelled" },
 	{ lua_uri_download_error, "download_error" },
+	{ lua_uri_download_stats, "download_stats" },
 	{ lua_uri_gc, "__gc" }
 };
 
@@ -352,6 +646,10 @@ void uri_mod_init(lua_State *L) {
 	inject_func_n(L, URI_MASTER_META, uri_master_meta, sizeof uri_master_meta / sizeof *uri_master_meta);
 	lua_newtable(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, URI_MASTER_REGISTRY);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, URI_MASTER_INSTANCES);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, URI_MASTER_PENDING);
 	inject_metatable_self_index(L, URI_META);
 	inject_func_n(L, URI_META, uri_meta, sizeof uri_meta / sizeof *uri_meta);
 }
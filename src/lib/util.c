@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
 #include <poll.h>
@@ -57,6 +59,51 @@ char *readfile(const char *file) {
 	return ret;
 }
 
+bool writefile_atomic(const char *file, const struct file_part *parts, size_t cnt) {
+	char *tmp = aprintf("%s.tmp", file);
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return false;
+	bool ok = true;
+	for (size_t i = 0; i < cnt && ok; i++)
+		ok = fwrite(parts[i].data, 1, parts[i].len, f) == parts[i].len;
+	ok = !fclose(f) && ok;
+	ok = ok && !rename(tmp, file);
+	if (!ok) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+	}
+	return ok;
+}
+
+void *mapfile(const char *file, size_t *len) {
+	int fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return map;
+}
+
+void *buffer_append(struct buffer *buf, const void *data, size_t len) {
+	if (buf->len + len > buf->allocated) {
+		buf->allocated = 2 * (buf->len + len);
+		buf->data = realloc(buf->data, buf->allocated);
+	}
+	char *space = (char*)buf->data + buf->len;
+	if (data && len)
+		memcpy(space, data, len);
+	buf->len += len;
+	return space;
+}
+
 bool statfile(const char *file, int mode) {
 	struct stat st;
 	if (stat(file, &st))
@@ -39,6 +39,26 @@ char *readfile(const char *file) __attribute__((nonnull));
 // returned memory and to unlink created file. On error NULL is returned.
 char *writetempfile(char *buf, size_t len) __attribute__((nonnull));
 
+// Write given parts to file trough temporally file renamed to its place so there
+// is never partially written file. On error false is returned and errno is set.
+struct file_part {
+	const void *data;
+	size_t len;
+};
+bool writefile_atomic(const char *file, const struct file_part *parts, size_t cnt) __attribute__((nonnull));
+// Map whole file for reading. Returns NULL if file doesn't exist, is empty or
+// can't be mapped. Mapping has to be released by munmap with returned length.
+void *mapfile(const char *file, size_t *len) __attribute__((nonnull));
+
+// Growing buffer of bytes. Initialize it to zero and free data once done.
+struct buffer {
+	void *data;
+	size_t len, allocated;
+};
+// Append len bytes to buffer. If data is NULL then space is only reserved.
+// Returns pointer to appended space that is valid until next append.
+void *buffer_append(struct buffer *buf, const void *data, size_t len) __attribute__((nonnull(1)));
+
 // Returns true if file exists and is accessible in given mode
 // Mode is bitwise OR of one or more of R_OK, W_OK, and X_OK.
 bool statfile(const char *file, int mode);
@@ -0,0 +1,47 @@
+--[[
+Copyright 2026, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+
+This file is part of the turris updater.
+
+Updater is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Updater is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+]]--
+
+require 'lunit'
+local B = require 'backend'
+require 'utils'
+
+module("backend-bench", package.seeall, lunit.testcase)
+
+local datadir = (os.getenv("DATADIR") or "../data")
+
+-- Benchmark of native parser against reference implementation on 4 MB index
+function test_repo_parse_benchmark()
+	local content = string.rep(utils.read_file(datadir .. "/repo/Packages") .. "\n", 4096)
+	local start = os.clock()
+	local reference = {}
+	for block in B.block_split(content) do
+		local pkg = B.block_parse(block)
+		if next(pkg) then
+			pkg = B.package_postprocess(pkg)
+			reference[pkg.Package] = pkg
+		end
+	end
+	local reference_time = os.clock() - start
+	start = os.clock()
+	local native = B.repo_parse(content)
+	local native_time = os.clock() - start
+	assert_table_equal(reference, native)
+	print(string.format("Parse of index (%d bytes): reference %.3f s, native %.3f s",
+		content:len(), reference_time, native_time))
+end
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2026, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the turris updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <check.h>
+#include <download.h>
+#include <syscnf.h>
+#include "test_data.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+void unittests_add_suite(Suite*);
+
+// Benchmark of instances bookkeeping with large number of local downloads. Half
+// of them is freed in order of registration and rest is downloaded.
+START_TEST(many_instances) {
+	struct downloader *d = downloader_new(3);
+	struct download_opts opts;
+	download_opts_def(&opts);
+	char *url = aprintf("file://%s", FILE_LOREM_IPSUM_SHORT);
+
+	char *data;
+	size_t data_len;
+	FILE *f = open_memstream(&data, &data_len);
+
+	const size_t cnt = 10000;
+	struct download_i **insts = malloc(cnt * sizeof *insts);
+	struct timespec start, registered, freed, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < cnt; i++)
+		insts[i] = download(d, url, f, &opts);
+	clock_gettime(CLOCK_MONOTONIC, &registered);
+	for (size_t i = 0; i < cnt; i += 2)
+		download_i_free(insts[i]);
+	clock_gettime(CLOCK_MONOTONIC, &freed);
+	ck_assert_ptr_null(downloader_run(d));
+	for (size_t i = 1; i < cnt; i += 2)
+		download_i_free(insts[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+#define ELAPSED(FROM, TO) ((TO.tv_sec - FROM.tv_sec) + (TO.tv_nsec - FROM.tv_nsec) / 1e9)
+	printf("Download instances (%zu): register %.3f s, free %.3f s, download and free %.3f s\n",
+			cnt, ELAPSED(start, registered), ELAPSED(registered, freed), ELAPSED(freed, end));
+#undef ELAPSED
+
+	fclose(f);
+	ck_assert_uint_eq((cnt / 2) * LOREM_IPSUM_SHORT_SIZE, data_len);
+	free(data);
+	free(insts);
+	downloader_free(d);
+}
+END_TEST
+
+
+__attribute__((constructor))
+static void suite() {
+	Suite *suite = suite_create("download");
+
+	TCase *download_case = tcase_create("download");
+	tcase_set_timeout(download_case, 120);
+	tcase_add_checked_fixture(download_case, system_detect, NULL); // To fill in agent with meaningful values
+	tcase_add_test(download_case, many_instances);
+	suite_add_tcase(suite, download_case);
+
+	unittests_add_suite(suite);
+}
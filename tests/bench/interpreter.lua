@@ -0,0 +1,61 @@
+--[[
+Copyright 2026, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+
+This file is part of the turris updater.
+
+Updater is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Updater is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+]]--
+
+require 'lunit'
+require 'utils'
+
+module("interpreter-bench", package.seeall, lunit.testcase)
+
+local tmp_dirs = {}
+
+-- Benchmark of hashing of 64 files of 1 MB one by one against batch hashing
+function test_hashing_benchmark()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	local content = string.rep("0123456789abcdef", 65536)
+	local paths = {}
+	for i = 1, 64 do
+		paths[i] = dir .. "/file" .. tostring(i)
+		utils.write_file(paths[i], content .. tostring(i))
+	end
+	local function clock()
+		local f = io.popen("date +%s.%N")
+		local time = tonumber(f:read("*a"))
+		f:close()
+		return time
+	end
+	local start = clock()
+	local single = {}
+	for _, path in ipairs(paths) do
+		single[path] = {md5 = md5_file(path), sha256 = sha256_file(path), size = content:len() + #path:match("%d+$")}
+	end
+	local single_time = clock() - start
+	start = clock()
+	local batch = hashing.files(paths, {"md5", "sha256"})
+	local batch_time = clock() - start
+	assert_table_equal(single, batch)
+	print(string.format("Hashing of %d files (%d bytes): one by one %.3f s (%.1f MB/s), batch %.3f s (%.1f MB/s)",
+		#paths, #paths * content:len(), single_time, #paths * content:len() / single_time / 1e6,
+		batch_time, #paths * content:len() / batch_time / 1e6))
+end
+
+function teardown()
+	utils.cleanup_dirs(tmp_dirs)
+	tmp_dirs = {}
+end
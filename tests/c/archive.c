@@ -185,6 +185,63 @@ START_TEST(unpack_package_valid) {
 }
 END_TEST
 
+START_TEST(unpack_package_stream_valid) {
+	char *unpack = untar_package(UNPACK_PACKAGE_VALID_IPK);
+
+	struct unpack_stream *stream = unpack_package_stream(updater_test_unpack_dir);
+	FILE *f = fopen(UNPACK_PACKAGE_VALID_IPK, "r");
+	ck_assert_ptr_nonnull(f);
+	FILE *out = unpack_stream_file(stream);
+	char buf[BUFSIZ];
+	size_t rd;
+	while ((rd = fread(buf, 1, BUFSIZ, f)) > 0)
+		ck_assert_int_eq(rd, fwrite(buf, 1, rd, out));
+	fclose(f);
+	ck_assert(unpack_stream_finish(stream));
+	ck_assert_ptr_null(unpack_stream_error(stream));
+	unpack_stream_free(stream);
+	compare_tree(unpack, updater_test_unpack_dir);
+
+	remove_recursive(unpack);
+	free(unpack);
+}
+END_TEST
+
+START_TEST(unpack_package_stream_trailing) {
+	char *unpack = untar_package(UNPACK_PACKAGE_VALID_IPK);
+
+	struct unpack_stream *stream = unpack_package_stream(updater_test_unpack_dir);
+	FILE *f = fopen(UNPACK_PACKAGE_VALID_IPK, "r");
+	ck_assert_ptr_nonnull(f);
+	FILE *out = unpack_stream_file(stream);
+	char buf[BUFSIZ];
+	size_t rd;
+	while ((rd = fread(buf, 1, BUFSIZ, f)) > 0)
+		ck_assert_int_eq(rd, fwrite(buf, 1, rd, out));
+	fclose(f);
+	// Data after end of archive are not read by unpack but it has to succeed
+	memset(buf, 0, BUFSIZ);
+	for (size_t i = 0; i < (1024 * 1024) / BUFSIZ; i++)
+		ck_assert_int_eq(BUFSIZ, fwrite(buf, 1, BUFSIZ, out));
+	ck_assert(unpack_stream_finish(stream));
+	ck_assert_ptr_null(unpack_stream_error(stream));
+	unpack_stream_free(stream);
+	compare_tree(unpack, updater_test_unpack_dir);
+
+	remove_recursive(unpack);
+	free(unpack);
+}
+END_TEST
+
+START_TEST(unpack_package_stream_invalid) {
+	struct unpack_stream *stream = unpack_package_stream(updater_test_unpack_dir);
+	fputs("This is not a package", unpack_stream_file(stream));
+	ck_assert(!unpack_stream_finish(stream));
+	ck_assert_ptr_nonnull(unpack_stream_error(stream));
+	unpack_stream_free(stream);
+}
+END_TEST
+
 
 __attribute__((constructor))
 static void suite() {
@@ -202,6 +259,9 @@ static void suite() {
 	tcase_add_checked_fixture(unpack_case, unpack_package_setup,
 			unpack_package_teardown);
 	tcase_add_test(unpack_case, unpack_package_valid);
+	tcase_add_test(unpack_case, unpack_package_stream_valid);
+	tcase_add_test(unpack_case, unpack_package_stream_trailing);
+	tcase_add_test(unpack_case, unpack_package_stream_invalid);
 	suite_add_tcase(suite, unpack_case);
 
 	unittests_add_suite(suite);
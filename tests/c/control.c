@@ -0,0 +1,125 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the turris updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <check.h>
+#include <string.h>
+#include <control.h>
+
+void unittests_add_suite(Suite*);
+
+static void assert_field(struct control_parser *p, const char *name, const char *value) {
+	struct control_field field;
+	ck_assert_int_eq(CONTROL_T_FIELD, control_next(p, &field));
+	ck_assert_uint_eq(strlen(name), field.name_len);
+	ck_assert_mem_eq(name, field.name, field.name_len);
+	ck_assert_uint_eq(strlen(value), field.value_len);
+	ck_assert_mem_eq(value, field.value, field.value_len);
+}
+
+static void assert_token(struct control_parser *p, enum control_token token) {
+	struct control_field field;
+	ck_assert_int_eq(token, control_next(p, &field));
+}
+
+START_TEST(empty) {
+	struct control_parser p;
+	control_parser_init(&p, "", 0);
+	assert_token(&p, CONTROL_T_END);
+	const char *text = "\n\n\n";
+	control_parser_init(&p, text, strlen(text));
+	assert_token(&p, CONTROL_T_END);
+}
+END_TEST
+
+START_TEST(blocks) {
+	const char *text =
+		"\n"
+		"Package: pkg1\n"
+		"Version:1.0\n"
+		"\n\n"
+		"Package: pkg2\n"
+		"Description: first line\n"
+		" second line\n"
+		"\tthird line\n"
+		"Empty:\n"
+		"Name:with:colons value\n"
+		"\n";
+	struct control_parser p;
+	control_parser_init(&p, text, strlen(text));
+	assert_field(&p, "Package", "pkg1");
+	assert_field(&p, "Version", "1.0");
+	assert_token(&p, CONTROL_T_BLOCK_END);
+	assert_field(&p, "Package", "pkg2");
+	assert_field(&p, "Description", "first line\n second line\n\tthird line");
+	assert_field(&p, "Empty", "");
+	assert_field(&p, "Name:with", "colons value");
+	assert_token(&p, CONTROL_T_BLOCK_END);
+	assert_token(&p, CONTROL_T_END);
+}
+END_TEST
+
+START_TEST(no_trailing_newline) {
+	const char *text = "Package: pkg\nDescription:\n continued";
+	struct control_parser p;
+	control_parser_init(&p, text, strlen(text));
+	assert_field(&p, "Package", "pkg");
+	assert_field(&p, "Description", "\n continued");
+	assert_token(&p, CONTROL_T_BLOCK_END);
+	assert_token(&p, CONTROL_T_END);
+}
+END_TEST
+
+START_TEST(errors) {
+	struct control_parser p;
+	const char *text = "Package: pkg\n\n continuation\n";
+	control_parser_init(&p, text, strlen(text));
+	assert_field(&p, "Package", "pkg");
+	assert_token(&p, CONTROL_T_BLOCK_END);
+	assert_token(&p, CONTROL_T_ERROR);
+	ck_assert_int_eq(CONTROL_E_CONTINUATION, p.err);
+	ck_assert_uint_eq(13, p.err_line_len);
+	ck_assert_mem_eq(" continuation", p.err_line, p.err_line_len);
+
+	text = "Package: pkg\nmalformed\n";
+	control_parser_init(&p, text, strlen(text));
+	assert_field(&p, "Package", "pkg");
+	assert_token(&p, CONTROL_T_ERROR);
+	ck_assert_int_eq(CONTROL_E_MALFORMED, p.err);
+	ck_assert_mem_eq("malformed", p.err_line, p.err_line_len);
+
+	text = ":value\n";
+	control_parser_init(&p, text, strlen(text));
+	assert_token(&p, CONTROL_T_ERROR);
+	ck_assert_int_eq(CONTROL_E_MALFORMED, p.err);
+}
+END_TEST
+
+
+__attribute__((constructor))
+static void suite() {
+	Suite *suite = suite_create("control");
+
+	TCase *parse_case = tcase_create("parse");
+	tcase_add_test(parse_case, empty);
+	tcase_add_test(parse_case, blocks);
+	tcase_add_test(parse_case, no_trailing_newline);
+	tcase_add_test(parse_case, errors);
+	suite_add_tcase(suite, parse_case);
+
+	unittests_add_suite(suite);
+}
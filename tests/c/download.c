@@ -101,6 +101,42 @@ START_TEST(multiple_downloads) {
 }
 END_TEST
 
+// Multiple downloads with adaptive limit of connections. Limit has to stay in
+// given bounds.
+START_TEST(adaptive_downloads) {
+	struct downloader *d = downloader_new(1);
+	downloader_set_limits(d, 4, 2, true);
+	ck_assert_int_eq(2, downloader_limit(d));
+	struct download_opts opts;
+	download_opts_def(&opts);
+
+	const size_t cnt = 16;
+	char *data[cnt];
+	size_t data_len[cnt];
+	FILE *fs[cnt];
+	for (size_t i = 0; i < cnt; i++) {
+		fs[i] = open_memstream(&data[i], &data_len[i]);
+		download(d, HTTP_LOREM_IPSUM_SHORT, fs[i], &opts);
+	}
+
+	ck_assert_ptr_null(downloader_run(d));
+	ck_assert_int_ge(downloader_limit(d), 1);
+	ck_assert_int_le(downloader_limit(d), 4);
+
+	for (size_t i = 0; i < cnt; i++) {
+		fclose(fs[i]);
+		ck_assert_uint_eq(LOREM_IPSUM_SHORT_SIZE, data_len[i]);
+		ck_assert_mem_eq(LOREM_IPSUM_SHORT, data[i], data_len[i]);
+		free(data[i]);
+	}
+
+	downloader_set_limits(d, 5, 0, false);
+	ck_assert_int_eq(5, downloader_limit(d));
+
+	downloader_free(d);
+}
+END_TEST
+
 // Check if we can selectivelly free handlers
 START_TEST(free_instances) {
 	struct downloader *d = downloader_new(3);
@@ -191,6 +227,89 @@ START_TEST(invalid_continue) {
 }
 END_TEST
 
+// Test that downloader returns downloads with notify once they are finished and
+// that it can continue with the rest of them.
+START_TEST(notify) {
+	struct downloader *d = downloader_new(3);
+	struct download_opts opts;
+	download_opts_def(&opts);
+
+	const size_t cnt = 4;
+	char *data[cnt];
+	size_t data_len[cnt];
+	FILE *fs[cnt];
+	struct download_i *insts[cnt];
+	for (size_t i = 0; i < cnt; i++) {
+		opts.notify = i % 2;
+		fs[i] = open_memstream(&data[i], &data_len[i]);
+		insts[i] = download(d, i < 2 ? HTTP_LOREM_IPSUM : HTTP_LOREM_IPSUM_SHORT, fs[i], &opts);
+	}
+
+	bool notified[cnt];
+	memset(notified, 0, sizeof notified);
+	struct download_i *inst;
+	while ((inst = downloader_run(d))) {
+		ck_assert(download_is_success(inst));
+		for (size_t i = 0; i < cnt; i++)
+			if (insts[i] == inst) {
+				ck_assert(i % 2);
+				ck_assert(!notified[i]);
+				notified[i] = true;
+			}
+	}
+	for (size_t i = 0; i < cnt; i++) {
+		ck_assert(download_is_done(insts[i]));
+		ck_assert(notified[i] == (i % 2));
+		fclose(fs[i]);
+		free(data[i]);
+	}
+
+	downloader_free(d);
+}
+END_TEST
+
+// Test that download following race of other download is cancelled when that
+// one loses and that it continues when it wins.
+START_TEST(race_lead) {
+	struct downloader *d = downloader_new(4);
+	struct download_opts opts;
+	download_opts_def(&opts);
+
+	opts.race = download_race_new();
+	FILE *fwinner = fmemopen(NULL, BUFSIZ, "wb");
+	struct download_i *winner = download(d, HTTP_LOREM_IPSUM_SHORT, fwinner, &opts);
+	FILE *floser = fmemopen(NULL, BUFSIZ, "wb");
+	struct download_i *loser = download(d, HTTP_APPLICATION_TEST "/invalid", floser, &opts);
+	download_race_free(opts.race);
+	opts.race = NULL;
+
+	char *data[2];
+	size_t data_len[2];
+	FILE *fs[2];
+	struct download_i *followers[2];
+	fs[0] = open_memstream(&data[0], &data_len[0]);
+	opts.race_lead = winner;
+	followers[0] = download(d, HTTP_LOREM_IPSUM_SHORT, fs[0], &opts);
+	fs[1] = open_memstream(&data[1], &data_len[1]);
+	opts.race_lead = loser;
+	followers[1] = download(d, HTTP_LOREM_IPSUM, fs[1], &opts);
+
+	ck_assert_ptr_null(downloader_run(d));
+	ck_assert(download_race_won(winner));
+	ck_assert(download_is_success(followers[0]));
+	ck_assert(!download_is_success(followers[1]));
+	ck_assert(download_is_cancelled(followers[1]));
+
+	downloader_free(d);
+	fclose(fwinner);
+	fclose(floser);
+	for (size_t i = 0; i < 2; i++) {
+		fclose(fs[i]);
+		free(data[i]);
+	}
+}
+END_TEST
+
 // Test certification pinning
 START_TEST(cert_pinning) {
 	struct downloader *d = downloader_new(1);
@@ -285,6 +404,54 @@ START_TEST(pem_cert_pinning) {
 }
 END_TEST
 
+// Multiple downloads pinned to same and different sets of PEMs. Certificate
+// stores are shared between same sets so this checks that sets are not mixed.
+START_TEST(pem_cert_pinning_multiple) {
+	struct downloader *d = downloader_new(2);
+	struct download_opts opts;
+	download_opts_def(&opts);
+	opts.cacert_file = NULL;
+	opts.capath = NULL;
+
+	char *pem = readfile(FILE_LETS_ENCRYPT_ROOTS);
+	download_pem_t pems1[] = { download_pem((uint8_t*)pem, strlen(pem)), NULL };
+	download_pem_t pems2[] = { download_pem((uint8_t*)pem, strlen(pem)), NULL };
+	free(pem);
+	pem = readfile(FILE_OPENTRUST_CA_G1);
+	download_pem_t pems_invalid[] = { download_pem((uint8_t*)pem, strlen(pem)), NULL };
+	free(pem);
+
+	char *data[2];
+	size_t data_len[2];
+	FILE *f[2];
+	download_pem_t *pems[] = { pems1, pems2 };
+	for (int i = 0; i < 2; i++) {
+		f[i] = open_memstream(&data[i], &data_len[i]);
+		opts.pems = pems[i];
+		download(d, HTTP_LOREM_IPSUM_SHORT, f[i], &opts);
+	}
+	FILE *finvalid = fmemopen(NULL, BUFSIZ, "wb");
+	opts.pems = pems_invalid;
+	struct download_i *inst = download(d, HTTP_LOREM_IPSUM_SHORT, finvalid, &opts);
+
+	ck_assert_ptr_eq(downloader_run(d), inst);
+	ck_assert_ptr_null(downloader_run(d));
+
+	for (int i = 0; i < 2; i++) {
+		fclose(f[i]);
+		ck_assert_uint_eq(LOREM_IPSUM_SHORT_SIZE, data_len[i]);
+		ck_assert_mem_eq(LOREM_IPSUM_SHORT, data[i], data_len[i]);
+		free(data[i]);
+	}
+
+	fclose(finvalid);
+	download_pem_free(pems1[0]);
+	download_pem_free(pems2[0]);
+	download_pem_free(pems_invalid[0]);
+	downloader_free(d);
+}
+END_TEST
+
 
 __attribute__((constructor))
 static void suite() {
@@ -296,13 +463,17 @@ static void suite() {
 	tcase_add_test(download_case, downloader_empty);
 	tcase_add_test(download_case, simple_download);
 	tcase_add_test(download_case, multiple_downloads);
+	tcase_add_test(download_case, adaptive_downloads);
 	tcase_add_test(download_case, free_instances);
 	tcase_add_test(download_case, invalid);
 	tcase_add_test(download_case, invalid_continue);
+	tcase_add_test(download_case, notify);
+	tcase_add_test(download_case, race_lead);
 	tcase_add_test(download_case, cert_pinning);
 	tcase_add_test(download_case, cert_invalid);
 	tcase_add_test(download_case, cert_pinning_empty);
 	tcase_add_test(download_case, pem_cert_pinning);
+	tcase_add_test(download_case, pem_cert_pinning_multiple);
 	suite_add_tcase(suite, download_case);
 
 	unittests_add_suite(suite);
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2021, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of the turris updater.
+ *
+ * Updater is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * Updater is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Updater.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <hashing.h>
+#include "test_data.h"
+
+void unittests_add_suite(Suite*);
+
+static const uint8_t lorem_ipsum_md5[] = {0xc0, 0x89, 0x18, 0xd1, 0x6a, 0x75, 0x29, 0x82, 0x3b, 0x2c, 0x28, 0x9c, 0xcf, 0x1b, 0x92, 0x23};
+static const uint8_t lorem_ipsum_sha256[] = {
+	0x25, 0x83, 0xc7, 0x16, 0x44, 0x4d, 0xf8, 0x78, 0x91, 0x85, 0x74, 0x89, 0xcb, 0x09, 0x02, 0x59,
+	0x0c, 0x42, 0x19, 0x6c, 0x3e, 0xc7, 0x4f, 0x3c, 0xfc, 0xbb, 0xb3, 0xb0, 0x37, 0x1c, 0xb9, 0x1d};
+
+START_TEST(single) {
+	struct hash_file file = {
+		.path = FILE_LOREM_IPSUM,
+		.algos = HASH_MD5 | HASH_SHA256,
+	};
+	hash_files(&file, 1, 0);
+	ck_assert_int_eq(0, file.err);
+	ck_assert_uint_eq(1119435, file.size);
+	ck_assert_mem_eq(lorem_ipsum_md5, file.md5, sizeof lorem_ipsum_md5);
+	ck_assert_mem_eq(lorem_ipsum_sha256, file.sha256, sizeof lorem_ipsum_sha256);
+}
+END_TEST
+
+START_TEST(missing) {
+	struct hash_file file = {
+		.path = aprintf("%s/nonexistent", get_datadir()),
+		.algos = HASH_MD5,
+	};
+	hash_files(&file, 1, 0);
+	ck_assert_int_eq(ENOENT, file.err);
+}
+END_TEST
+
+// Hash same file many times on various number of threads
+START_TEST(batch) {
+	const size_t cnt = 32;
+	struct hash_file files[cnt];
+	const char *lorem_ipsum = FILE_LOREM_IPSUM;
+	const char *empty = aprintf("%s/empty", get_tmpdir());
+	FILE *f = fopen(empty, "w");
+	fclose(f);
+	for (unsigned threads = 1; threads <= HASH_MAX_THREADS + 1; threads++) {
+		for (size_t i = 0; i < cnt; i++)
+			files[i] = (struct hash_file) {
+				.path = i % 2 ? lorem_ipsum : empty,
+				.algos = i % 3 ? HASH_MD5 : HASH_SHA256,
+			};
+		hash_files(files, cnt, threads);
+		for (size_t i = 0; i < cnt; i++) {
+			ck_assert_int_eq(0, files[i].err);
+			if (i % 2 == 0) {
+				ck_assert_uint_eq(0, files[i].size);
+				continue;
+			}
+			ck_assert_uint_eq(1119435, files[i].size);
+			if (i % 3)
+				ck_assert_mem_eq(lorem_ipsum_md5, files[i].md5, sizeof lorem_ipsum_md5);
+			else
+				ck_assert_mem_eq(lorem_ipsum_sha256, files[i].sha256, sizeof lorem_ipsum_sha256);
+		}
+	}
+	ck_assert(!unlink(empty));
+}
+END_TEST
+
+
+__attribute__((constructor))
+static void suite() {
+	Suite *suite = suite_create("hashing");
+
+	TCase *files_case = tcase_create("files");
+	tcase_add_test(files_case, single);
+	tcase_add_test(files_case, missing);
+	tcase_add_test(files_case, batch);
+	suite_add_tcase(suite, files_case);
+
+	unittests_add_suite(suite);
+}
@@ -33,6 +33,10 @@ void unittests_add_suite(Suite*);
 #define SUFFIX_PKG_UNPACKED_DIR "usr/share/updater/unpacked/"
 #define SUFFIX_PKG_DOWNLOAD_DIR "usr/share/updater/download/"
 #define SUFFIX_DIR_OPKG_COLLIDED "usr/share/updater/collided/"
+#define SUFFIX_DIR_INDEX_CACHE "usr/share/updater/index-cache/"
+#define SUFFIX_DIR_PKG_CACHE "usr/share/updater/pkg-cache/"
+#define SUFFIX_FILE_HASH_CACHE "usr/share/updater/file-hashes"
+#define SUFFIX_FILE_PKG_DB "usr/share/updater/pkgdb"
 
 void paths_teardown() {
 	set_root_dir(NULL);
@@ -46,6 +50,10 @@ START_TEST(default_paths) {
 	ck_assert_str_eq("/" SUFFIX_PKG_UNPACKED_DIR, pkg_unpacked_dir());
 	ck_assert_str_eq("/" SUFFIX_PKG_DOWNLOAD_DIR, pkg_download_dir());
 	ck_assert_str_eq("/" SUFFIX_DIR_OPKG_COLLIDED, opkg_collided_dir());
+	ck_assert_str_eq("/" SUFFIX_DIR_INDEX_CACHE, index_cache_dir());
+	ck_assert_str_eq("/" SUFFIX_DIR_PKG_CACHE, pkg_cache_dir());
+	ck_assert_str_eq("/" SUFFIX_FILE_HASH_CACHE, file_hash_cache());
+	ck_assert_str_eq("/" SUFFIX_FILE_PKG_DB, pkg_db_file());
 }
 END_TEST
 
@@ -58,6 +66,10 @@ START_TEST(absolute_paths) {
 	ck_assert_str_eq(ABS_ROOT SUFFIX_PKG_UNPACKED_DIR, pkg_unpacked_dir());
 	ck_assert_str_eq(ABS_ROOT SUFFIX_PKG_DOWNLOAD_DIR, pkg_download_dir());
 	ck_assert_str_eq(ABS_ROOT SUFFIX_DIR_OPKG_COLLIDED, opkg_collided_dir());
+	ck_assert_str_eq(ABS_ROOT SUFFIX_DIR_INDEX_CACHE, index_cache_dir());
+	ck_assert_str_eq(ABS_ROOT SUFFIX_DIR_PKG_CACHE, pkg_cache_dir());
+	ck_assert_str_eq(ABS_ROOT SUFFIX_FILE_HASH_CACHE, file_hash_cache());
+	ck_assert_str_eq(ABS_ROOT SUFFIX_FILE_PKG_DB, pkg_db_file());
 #undef ABS_ROOT
 }
 END_TEST
@@ -72,6 +84,10 @@ START_TEST(relative_paths) {
 	ck_assert_str_eq(PTH(SUFFIX_PKG_UNPACKED_DIR), pkg_unpacked_dir());
 	ck_assert_str_eq(PTH(SUFFIX_PKG_DOWNLOAD_DIR), pkg_download_dir());
 	ck_assert_str_eq(PTH(SUFFIX_DIR_OPKG_COLLIDED), opkg_collided_dir());
+	ck_assert_str_eq(PTH(SUFFIX_DIR_INDEX_CACHE), index_cache_dir());
+	ck_assert_str_eq(PTH(SUFFIX_DIR_PKG_CACHE), pkg_cache_dir());
+	ck_assert_str_eq(PTH(SUFFIX_FILE_HASH_CACHE), file_hash_cache());
+	ck_assert_str_eq(PTH(SUFFIX_FILE_PKG_DB), pkg_db_file());
 #undef PTH
 	free(cwd);
 }
@@ -87,6 +103,10 @@ START_TEST(tilde_paths) {
 	ck_assert_str_eq(PTH(SUFFIX_PKG_UNPACKED_DIR), pkg_unpacked_dir());
 	ck_assert_str_eq(PTH(SUFFIX_PKG_DOWNLOAD_DIR), pkg_download_dir());
 	ck_assert_str_eq(PTH(SUFFIX_DIR_OPKG_COLLIDED), opkg_collided_dir());
+	ck_assert_str_eq(PTH(SUFFIX_DIR_INDEX_CACHE), index_cache_dir());
+	ck_assert_str_eq(PTH(SUFFIX_DIR_PKG_CACHE), pkg_cache_dir());
+	ck_assert_str_eq(PTH(SUFFIX_FILE_HASH_CACHE), file_hash_cache());
+	ck_assert_str_eq(PTH(SUFFIX_FILE_PKG_DB), pkg_db_file());
 #undef ABS_ROOT
 }
 END_TEST
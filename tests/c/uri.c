@@ -216,6 +216,44 @@ START_TEST(uri_to_file_file) {
 }
 END_TEST
 
+// Local file copied to file output has to be verified and hashed as well
+START_TEST(uri_to_file_file_verified) {
+	uri_t u = uri(FILE_LOREM_IPSUM, NULL);
+	ck_assert_ptr_nonnull(u);
+	ck_assert(uri_add_pubkey(u, USIGN_KEY_1_PUB));
+	uri_set_hash(u, true);
+
+	char *outf = FIXED_OUT_FILE;
+	ck_assert(uri_output_file(u, outf));
+	const uint8_t *data;
+	ck_assert(uri_finish(u, &data, NULL));
+	ck_assert_ptr_null(data); // There is no buffer for file output
+	const uint8_t md5[] = {0xc0, 0x89, 0x18, 0xd1, 0x6a, 0x75, 0x29, 0x82, 0x3b, 0x2c, 0x28, 0x9c, 0xcf, 0x1b, 0x92, 0x23};
+	ck_assert_mem_eq(md5, uri_md5(u), sizeof md5);
+	uri_free(u);
+
+	char *content = readfile(outf);
+	char *expected = readfile(FILE_LOREM_IPSUM);
+	ck_assert_str_eq(expected, content);
+	free(content);
+	free(expected);
+}
+END_TEST
+
+// Special files can't be mapped and are read instead
+START_TEST(uri_to_buffer_file_special) {
+	uri_t u = uri("file:///dev/null", NULL);
+	ck_assert_ptr_nonnull(u);
+
+	const uint8_t *data;
+	size_t size;
+	ck_assert(uri_finish(u, &data, &size));
+	ck_assert_ptr_nonnull(data);
+	ck_assert_int_eq(0, size);
+	uri_free(u);
+}
+END_TEST
+
 START_TEST(uri_to_file_https) {
 	uri_t u = uri(HTTPS_LOREM_IPSUM_SHORT, NULL);
 	ck_assert_ptr_nonnull(u);
@@ -353,6 +391,117 @@ START_TEST(uri_sig_verify_invalid) {
 }
 END_TEST
 
+#define CACHE_FILE aprintf("%s/updater-uri-cache/lorem_ipsum_short", get_tmpdir())
+
+static void download_cached_lorem_ipsum_short(bool cached) {
+	uri_t u = uri(HTTPS_LOREM_IPSUM_SHORT, NULL);
+	ck_assert_ptr_nonnull(u);
+	uri_set_cache(u, CACHE_FILE);
+
+	struct downloader *down = downloader_new(1);
+	ck_assert(uri_downloader_register(u, down));
+	ck_assert_ptr_null(downloader_run(down));
+
+	const uint8_t *data;
+	size_t size;
+	ck_assert(uri_finish(u, &data, &size));
+	downloader_free(down);
+
+	ck_assert(cached == uri_is_cached(u));
+	ck_assert_int_eq(LOREM_IPSUM_SHORT_SIZE, size);
+	ck_assert_mem_eq(LOREM_IPSUM_SHORT, data, size);
+	uri_free(u);
+}
+
+START_TEST(uri_cache_https) {
+	unlink(CACHE_FILE);
+	unlink(aprintf("%s.meta", CACHE_FILE));
+	download_cached_lorem_ipsum_short(false); // There is no cache so it is downloaded
+	download_cached_lorem_ipsum_short(true); // Second time cache has to be used
+}
+END_TEST
+
+
+#define RESUME_FILE aprintf("%s/updater-uri-resume-lorem_ipsum_short", get_tmpdir())
+
+// Get validators of content on server trough cache
+static char *lorem_ipsum_short_validators() {
+	unlink(CACHE_FILE);
+	unlink(aprintf("%s.meta", CACHE_FILE));
+	download_cached_lorem_ipsum_short(false);
+	char *meta = readfile(aprintf("%s.meta", CACHE_FILE));
+	ck_assert_ptr_nonnull(meta);
+	return meta;
+}
+
+// Download lorem_ipsum_short to resumable output with given partially received
+// content and its validators stored for given URL.
+static void download_resumable_lorem_ipsum_short(const char *meta, const char *url,
+		const char *part, bool resume) {
+	char *outf = RESUME_FILE;
+	unlink(outf);
+	ck_assert(dump2file(aprintf("%s.part.meta", outf), aprintf("%s%s\n", meta, url)));
+	ck_assert(dump2file(aprintf("%s.part", outf), part));
+
+	uri_t u = uri(HTTPS_LOREM_IPSUM_SHORT, NULL);
+	ck_assert_ptr_nonnull(u);
+	uri_set_hash(u, true);
+	ck_assert(uri_output_resumable(u, outf));
+	// Partial content has to be dropped right away if it can't be resumed
+	char *data = readfile(aprintf("%s.part", outf));
+	ck_assert_int_eq(resume ? strlen(part) : 0, strlen(data));
+	free(data);
+	struct downloader *down = downloader_new(1);
+	ck_assert(uri_downloader_register(u, down));
+	ck_assert_ptr_null(downloader_run(down));
+	ck_assert(uri_finish(u, NULL, NULL));
+	downloader_free(down);
+	// Sums have to cover also previously received content
+	const uint8_t md5[] = {0x3b, 0xc3, 0x4a, 0x45, 0xd2, 0x67, 0x84, 0xb5, 0xbe, 0xa8, 0x52, 0x9d, 0xb5, 0x33, 0xae, 0x84};
+	ck_assert_mem_eq(md5, uri_md5(u), sizeof md5);
+	uri_free(u);
+
+	ck_assert(!statfile(aprintf("%s.part", outf), F_OK));
+	ck_assert(!statfile(aprintf("%s.part.meta", outf), F_OK));
+	data = readfile(outf);
+	ck_assert_int_eq(LOREM_IPSUM_SHORT_SIZE, strlen(data));
+	ck_assert_str_eq(LOREM_IPSUM_SHORT, data);
+	free(data);
+}
+
+START_TEST(uri_to_resumable_file_https) {
+	char *meta = lorem_ipsum_short_validators();
+	download_resumable_lorem_ipsum_short(meta, HTTPS_LOREM_IPSUM_SHORT, "lorem ", true);
+	free(meta);
+}
+END_TEST
+
+// Content on server changed so If-Range does not match and server sends whole
+// content instead of requested range.
+START_TEST(uri_to_resumable_file_https_changed) {
+	download_resumable_lorem_ipsum_short("-1\n\"changed\"\n", HTTPS_LOREM_IPSUM_SHORT,
+			"ipsum ", true);
+}
+END_TEST
+
+// Partial content is longer than content on server so range is not satisfiable
+// (416).
+START_TEST(uri_to_resumable_file_https_unsatisfiable) {
+	char *meta = lorem_ipsum_short_validators();
+	download_resumable_lorem_ipsum_short(meta, HTTPS_LOREM_IPSUM_SHORT,
+			LOREM_IPSUM_SHORT "dolor sit amet\n", true);
+	free(meta);
+}
+END_TEST
+
+// Partial content was received from different URL (other mirror) so it can't be
+// resumed even if validators match.
+START_TEST(uri_to_resumable_file_https_other_url) {
+	char *meta = lorem_ipsum_short_validators();
+	download_resumable_lorem_ipsum_short(meta, HTTP_LOREM_IPSUM_SHORT, "ipsum ", false);
+	free(meta);
+}
+END_TEST
 
 __attribute__((constructor))
 static void suite() {
@@ -370,6 +519,8 @@ static void suite() {
 	tcase_add_test(uri_case, uri_to_buffer_http);
 	tcase_add_test(uri_case, uri_to_buffer_https);
 	tcase_add_test(uri_case, uri_to_file_file);
+	tcase_add_test(uri_case, uri_to_file_file_verified);
+	tcase_add_test(uri_case, uri_to_buffer_file_special);
 	tcase_add_test(uri_case, uri_to_file_https);
 	tcase_add_test(uri_case, uri_to_temp_file_file);
 	tcase_add_test(uri_case, uri_to_temp_file_https);
@@ -378,6 +529,11 @@ static void suite() {
 	tcase_add_test(uri_case, uri_cert_no_ca_verify);
 	tcase_add_test(uri_case, uri_sig_verify_valid);
 	tcase_add_test(uri_case, uri_sig_verify_invalid);
+	tcase_add_test(uri_case, uri_cache_https);
+	tcase_add_test(uri_case, uri_to_resumable_file_https);
+	tcase_add_test(uri_case, uri_to_resumable_file_https_changed);
+	tcase_add_test(uri_case, uri_to_resumable_file_https_unsatisfiable);
+	tcase_add_test(uri_case, uri_to_resumable_file_https_other_url);
 	suite_add_tcase(suite, uri_case);
 
 	unittests_add_suite(suite);
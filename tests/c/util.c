@@ -20,6 +20,9 @@
 #include <util.h>
 
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "test_data.h"
 
 void unittests_add_suite(Suite*);
 
@@ -84,6 +87,36 @@ START_TEST(cleanup_by_data) {
 }
 END_TEST
 
+START_TEST(atomic_write_and_map) {
+	const char *path = aprintf("%s/atomic", get_tmpdir());
+	struct buffer buf = { .data = NULL, .len = 0, .allocated = 0 };
+	for (int i = 0; i < 1000; i++)
+		buffer_append(&buf, "0123456789", 10);
+	memcpy(buffer_append(&buf, NULL, 3), "end", 3);
+	ck_assert_uint_eq(10003, buf.len);
+	const struct file_part parts[] = {
+		{ "head", 4 },
+		{ buf.data, buf.len },
+	};
+	ck_assert(writefile_atomic(path, parts, 2));
+	ck_assert(!statfile(aprintf("%s.tmp", path), F_OK));
+	size_t len;
+	char *map = mapfile(path, &len);
+	ck_assert_ptr_nonnull(map);
+	ck_assert_uint_eq(10007, len);
+	ck_assert_mem_eq("head0123456789", map, 14);
+	ck_assert_mem_eq("789end", map + len - 6, 6);
+	munmap(map, len);
+	free(buf.data);
+	// Empty and missing files are not mapped
+	ck_assert(writefile_atomic(path, parts, 0));
+	ck_assert_ptr_null(mapfile(path, &len));
+	unlink(path);
+	ck_assert_ptr_null(mapfile(path, &len));
+	ck_assert(!writefile_atomic(aprintf("%s/missing/atomic", get_tmpdir()), parts, 2));
+}
+END_TEST
+
 
 __attribute__((constructor))
 static void suite() {
@@ -94,6 +127,7 @@ static void suite() {
 	tcase_add_test(util_case, cleanup_multi);
 	tcase_add_test(util_case, cleanup_single);
 	tcase_add_test(util_case, cleanup_by_data);
+	tcase_add_test(util_case, atomic_write_and_map);
 	suite_add_tcase(suite, util_case);
 
 	unittests_add_suite(suite);
@@ -109,6 +109,30 @@ block 2
 	-- Few empty lines at the beginning - should not produce an empty block
 end
 
+-- Native parser has to produce same output as the reference implementation
+function test_control_parse()
+	local text = "val1: value 1\nval2:value 2\n val2 continuation\nval3:\n"
+	assert_table_equal(B.block_parse(text), control.parse(text))
+	assert_error(function() control.parse(" x") end)
+	assert_error(function() control.parse("xyz") end)
+end
+
+function test_control_blocks()
+	local content = utils.read_file(datadir .. "/repo/Packages")
+	local reference = {}
+	for block in B.block_split(content) do
+		table.insert(reference, B.block_parse(block))
+	end
+	local native = {}
+	for block in control.blocks(content) do
+		table.insert(native, block)
+	end
+	assert_table_equal(reference, native)
+	assert_error(function()
+		for _ in control.blocks("Package: pkg\n\n continuation") do end
+	end)
+end
+
 --[[
 Test post-processing packages. Examples taken and combined from real status file
 (however, this exact package doesn't exist).
@@ -802,6 +826,77 @@ function test_status_parse_dump()
 	assert_table_equal(status, status3)
 end
 
+function test_status_parse_lazy()
+	local status = B.status_parse()
+	local pkg = status["terminfo"]
+	-- Only status file is read on parse
+	assert_nil(rawget(pkg, "files"))
+	assert_nil(rawget(pkg, "Description"))
+	assert_nil(rawget(pkg, "ChangedFiles"))
+	assert_equal("5.9-2", pkg.Version)
+	-- Info files are read on access
+	assert_equal("Terminal Info Database (ncurses)", pkg.Description)
+	assert_true(pkg.files["/usr/share/terminfo/l/linux"])
+	assert_table_equal({}, pkg.ChangedFiles)
+	assert_equal("libc", pkg.Depends)
+end
+
+-- Changed files of upgraded package are those of installed version even once
+-- info files of new version are merged
+function test_status_load_upgrade()
+	local test_root = mkdtemp()
+	table.insert(tmp_dirs, test_root)
+	syscnf.set_root_dir(test_root)
+	syscnf.status_file = test_root .. "/status"
+	syscnf.info_dir = test_root .. "/info/"
+	utils.mkdirp(syscnf.info_dir)
+	local file = test_root .. "/file"
+	utils.write_file(file, "modified")
+	utils.write_file(syscnf.status_file, "Package: pkg\nVersion: 1\nStatus: install user installed\n")
+	utils.write_file(syscnf.info_dir .. "pkg.list", file .. "\n")
+	utils.write_file(syscnf.info_dir .. "pkg.files-md5sum", md5("original") .. " " .. file .. "\n")
+	local status = B.status_parse()
+	B.status_load(status, {pkg = true})
+	-- Lazily loaded parts are now visible to serialization
+	assert_table_equal({[file] = true}, rawget(status.pkg, "files"))
+	assert_table_equal({file}, rawget(status.pkg, "ChangedFiles"))
+	-- Merge info files of new version
+	local control_dir = mkdtemp()
+	table.insert(tmp_dirs, control_dir)
+	utils.write_file(control_dir .. "/control", "Package: pkg\nVersion: 2\n")
+	utils.write_file(control_dir .. "/files-md5sum", md5("modified") .. " " .. file .. "\n")
+	B.pkg_merge_control(control_dir, "pkg", {[file] = true})
+	assert_table_equal({file}, status.pkg.ChangedFiles)
+	assert_equal("1", status.pkg.Version)
+	-- Hashes are stored
+	B.file_hashes_store()
+	assert_equal(file_id(file) .. " " .. md5("modified") .. " " .. file .. "\n", utils.read_file(syscnf.file_hash_cache))
+end
+
+function test_status_dump_unchanged()
+	local status = B.status_parse()
+	local test_dir = mkdtemp()
+	table.insert(tmp_dirs, test_dir)
+	syscnf.status_file = test_dir .. "/status"
+	B.status_dump(status)
+	local id = file_id(syscnf.status_file)
+	local content = utils.read_file(syscnf.status_file)
+	-- Nothing changed so status file is not rewritten
+	B.status_dump(B.status_parse())
+	assert_equal(id, file_id(syscnf.status_file))
+	assert_equal(content, utils.read_file(syscnf.status_file))
+	-- Change of single package rewrites it
+	status["dnsmasq-dhcpv6"].Version = "999"
+	B.status_dump(status)
+	assert_not_equal(id, file_id(syscnf.status_file))
+	assert_equal("999", B.status_parse()["dnsmasq-dhcpv6"].Version)
+	-- Blocks before changed package are kept and it is moved to the end
+	local new_content = utils.read_file(syscnf.status_file)
+	local changed = content:find("Package: dnsmasq-dhcpv6\n", 1, true)
+	assert_equal(content:sub(1, changed - 1), new_content:sub(1, changed - 1))
+	assert_equal("dnsmasq-dhcpv6", new_content:match(".*Package: ([^\n]*)"))
+end
+
 function test_control_cleanup()
 	--[[
 	Create few files in a test info dir.
@@ -935,6 +1030,28 @@ function test_config_modified()
 	assert(B.config_modified(file, "5f54362b30f53ae6862b11ff34d22a8d4510ed2b3e757b1f285db"))
 end
 
+-- Hashes of config files are cached during transaction but modifications are still detected
+function test_config_hashes()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	syscnf.set_root_dir(dir)
+	local file = dir .. "/config"
+	utils.write_file(file, "hello")
+	B.config_hashes_start()
+	assert_false(B.config_modified(file, md5("hello")))
+	assert_false(B.config_modified(dir .. "//config", sha256("hello")))
+	utils.write_file(file, "hello world")
+	assert(B.config_modified(file, md5("hello")))
+	assert_false(B.config_modified(file, md5("hello world")))
+	-- Not modified config is removed and forgotten
+	B.pkg_cleanup_files({["/config"] = true}, {["/config"] = md5("hello world")})
+	assert_nil(stat(file))
+	assert_nil(B.config_modified(file, md5("hello world")))
+	B.config_hashes_stop()
+	utils.write_file(file, "hello")
+	assert_false(B.config_modified(file, md5("hello")))
+end
+
 function test_repo_parse()
 	assert_table_equal({
 		["base-files"] = {
@@ -958,6 +1075,35 @@ Depends: libc, ubox, libubox, libuci
 ]]))
 end
 
+-- Only fields needed for planning are decoded before first access
+function test_repo_parse_lazy()
+	local packages = B.repo_parse(utils.read_file(datadir .. "/repo/Packages"))
+	local pkg = packages["6in4"]
+	assert_equal("21-2", rawget(pkg, "Version"))
+	assert_equal("libc, kmod-sit", rawget(pkg, "Depends"))
+	assert_nil(rawget(pkg, "Description"))
+	assert_equal("GPL-2.0", getmetatable(pkg).__fields(pkg).License)
+	assert_nil(rawget(pkg, "License"))
+	assert_equal("GPL-2.0", pkg.License)
+	assert_not_nil(rawget(pkg, "Description"))
+	assert_nil(pkg.Missing)
+	assert_nil(getmetatable(pkg).__fields(pkg))
+end
+
+-- Index prepared in background thread is same as one parsed directly
+function test_repo_prepare()
+	local content = utils.read_file(datadir .. "/repo/Packages")
+	local reference = B.repo_parse(content)
+	local prepared = B.repo_parse(B.repo_prepare(content))
+	assert_table_equal(reference, prepared)
+	assert_equal(reference["6in4"].Description, prepared["6in4"].Description)
+	local compressed = B.repo_parse(B.repo_prepare(utils.read_file(datadir .. "/repo/Packages.gz")))
+	assert_table_equal(reference, compressed)
+	assert_error(function()
+		B.repo_parse(B.repo_prepare("Package: pkg\n\n continuation"))
+	end)
+end
+
 function test_parse_pkg_specifier()
 	for _, v in pairs({"foo", "  foo  "}) do
 		assert_equal("foo", B.parse_pkg_specifier(v))
@@ -996,15 +1142,203 @@ function test_version_match()
 	assert_true(B.version_match("1.2.3", "1.2.3")) -- without comparator do exact match (just as corner case)
 	assert_false(B.version_match("1.2.3", "1.3.3"))
 end
+
+-- Deltas are applied by zstd utility so tests that require it are skipped if it
+-- is not available.
+local zstd_available = os.execute("zstd --version >/dev/null 2>&1") == 0
+local delta_base_sum = "4f54362b30f53ae6862b11ff34d22a8d4510ed2b3e757b1f285dbd1033666e55"
+local delta_result_sum = "dfe474a7bf0e83e1f810f54375ef98b2e9fd48ef90ccc21544274d0d4b1f031c"
+
+function test_pkg_delta_apply()
+	if not zstd_available then return end
+	local test_dir = mkdtemp()
+	table.insert(tmp_dirs, test_dir)
+	B.pkg_delta_apply(datadir .. "/repo/updater.ipk", datadir .. "/delta/updater.ipk.zst", test_dir .. "/updater.ipk")
+	assert_equal(delta_result_sum, sha256_file(test_dir .. "/updater.ipk"))
+end
+
+function test_pkg_delta_apply_invalid_base()
+	if not zstd_available then return end
+	local test_dir = mkdtemp()
+	table.insert(tmp_dirs, test_dir)
+	assert_exception(function ()
+		B.pkg_delta_apply(datadir .. "/opkg/status", datadir .. "/delta/updater.ipk.zst", test_dir .. "/updater.ipk")
+	end, 'corruption')
+	assert_nil(stat(test_dir .. "/updater.ipk"))
+end
+
+function test_pkg_cache()
+	if not zstd_available then return end
+	local test_root = mkdtemp()
+	table.insert(tmp_dirs, test_root)
+	syscnf.set_root_dir(test_root)
+	assert_nil(B.pkg_cache_get(delta_base_sum))
+	B.pkg_cache_store(datadir .. "/repo/updater.ipk", delta_base_sum)
+	-- Package is only staged till commit
+	assert_table_equal({[delta_base_sum .. ".ipk.staged"] = "r"}, ls(test_root .. "/usr/share/updater/pkg-cache"))
+	B.pkg_cache_commit()
+	local cached = B.pkg_cache_get(delta_base_sum)
+	assert_equal(test_root .. "/usr/share/updater/pkg-cache/" .. delta_base_sum .. ".ipk", cached)
+	assert_equal(delta_base_sum, sha256_file(cached))
+	B.pkg_delta_apply(cached, datadir .. "/delta/updater.ipk.zst", test_root .. "/updater.ipk")
+	B.pkg_cache_store(test_root .. "/updater.ipk", delta_result_sum)
+	B.pkg_cache_commit()
+	assert_not_nil(B.pkg_cache_get(delta_base_sum))
+	assert_not_nil(B.pkg_cache_get(delta_result_sum))
+	assert_table_equal({
+		[delta_base_sum .. ".ipk"] = "r",
+		[delta_result_sum .. ".ipk"] = "r",
+	}, ls(test_root .. "/usr/share/updater/pkg-cache"))
+end
+
+function test_pkg_cache_evict()
+	local test_root = mkdtemp()
+	table.insert(tmp_dirs, test_root)
+	syscnf.set_root_dir(test_root)
+	local _, _, size = stat(datadir .. "/repo/updater.ipk")
+	local cache_size = B.pkg_cache_size
+	B.pkg_cache_size = 2 * size
+	B.pkg_cache_store(datadir .. "/repo/updater.ipk", "0001")
+	B.pkg_cache_store(datadir .. "/repo/updater.ipk", "0002")
+	B.pkg_cache_commit()
+	-- Make the second package look long unused
+	events_wait(run_command(function () end, nil, nil, -1, -1, "/bin/touch", "-d", "@0",
+		test_root .. "/usr/share/updater/pkg-cache/0002.ipk"))
+	assert_not_nil(B.pkg_cache_get("0001")) -- Using package updates its time
+	B.pkg_cache_store(datadir .. "/repo/updater.ipk", "0003")
+	B.pkg_cache_commit()
+	B.pkg_cache_size = cache_size
+	assert_table_equal({
+		["0001.ipk"] = "r",
+		["0003.ipk"] = "r",
+	}, ls(test_root .. "/usr/share/updater/pkg-cache"))
+end
+
+function test_file_hashes()
+	local test_root = mkdtemp()
+	table.insert(tmp_dirs, test_root)
+	syscnf.set_root_dir(test_root)
+	local file = test_root .. "/file"
+	utils.write_file(file, "hello")
+	local files = {[file] = md5("hello"), [test_root .. "/missing"] = md5("hello")}
+	assert_table_equal({}, B.get_changed_files(files))
+	assert_table_equal({1, 5}, {B.file_hashes_store()})
+	assert_equal(file_id(file) .. " " .. md5("hello") .. " " .. file .. "\n", utils.read_file(syscnf.file_hash_cache))
+	-- Hash of not modified file is taken from cache
+	assert_table_equal({}, B.get_changed_files(files))
+	assert_table_equal({0, 0}, {B.file_hashes_store()})
+	-- Modified file is hashed again
+	utils.write_file(file, "hello world")
+	assert_table_equal({file}, B.get_changed_files(files))
+	assert_table_equal({1, 11}, {B.file_hashes_store()})
+end
+
+function test_pkgdb()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	local db = dir .. "/pkgdb"
+	local packages = {
+		pkg1 = {
+			fields = {Package = "pkg1", Version = "1", Status = "install user installed"},
+			files = {["/etc/config/pkg1"] = true, ["/usr/bin/pkg1"] = true},
+			nonconf = {["/usr/bin/pkg1"] = md5("pkg1"), ["/usr/lib/unlisted"] = md5("unlisted")},
+		},
+		pkg2 = {
+			fields = {Package = "pkg2", Status = "install user not-installed"},
+			nonconf = {},
+		},
+	}
+	assert(pkgdb.write(db, "stamp", packages))
+	assert_table_equal(packages, pkgdb.load(db, "stamp"))
+	assert_nil(pkgdb.load(db, "other"))
+	assert_nil(pkgdb.load(dir .. "/missing", "stamp"))
+	-- Owners of given paths, files in directories of them and on place of their parent directories
+	assert_table_equal({["/usr/bin/pkg1"] = {pkg1 = true}}, pkgdb.owners(db, "stamp", {["/usr/bin/pkg1/file"] = true}))
+	assert_table_equal({["/etc/config/pkg1"] = {pkg1 = true}}, pkgdb.owners(db, "stamp", {["/etc"] = true}))
+	assert_table_equal({}, pkgdb.owners(db, "stamp", {["/usr/lib/unlisted"] = true, ["/usr/bin/pkg"] = true}))
+	assert_nil(pkgdb.owners(db, "other", {}))
+	utils.write_file(db, utils.read_file(db):sub(1, -2))
+	assert_nil(pkgdb.load(db, "stamp"))
+end
+
+function test_collisions_pkgdb()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	opmode:set("pkg_db")
+	local db = syscnf.pkg_db_file
+	local status = B.status_parse()
+	syscnf.status_file = dir .. "/status"
+	B.status_dump(status)
+	assert_equal("r", stat(db))
+	status = B.status_parse()
+	local cases = {
+		{{['kmod-usb-storage'] = true}, {}},
+		{{}, {package = {["/etc/modules.d/usb-storage"] = true, ["/a/file"] = true}}},
+		{{}, {package = {["/etc/modules.d/usb-storage/file"] = true}}},
+		{{['kmod-usb-storage'] = true}, {package = {["/etc/modules.d/usb-storage/file"] = true}}},
+		{{}, {package = {["/usr/share/terminfo"] = true}}},
+		{{['terminfo'] = true}, {package = {["/usr/share/terminfo"] = true}}},
+	}
+	-- Results with package database have to be same as without it
+	for _, case in ipairs(cases) do
+		syscnf.pkg_db_file = db
+		local result = {B.collision_check(status, case[1], case[2])}
+		syscnf.pkg_db_file = db .. ".missing"
+		assert_table_equal({B.collision_check(status, case[1], case[2])}, result)
+	end
+end
+
+function test_status_parse_pkgdb()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	local reference = B.status_parse()
+	syscnf.status_file = dir .. "/status"
+	-- Database is not used without pkg_db mode
+	B.status_dump(reference)
+	assert_nil(stat(syscnf.pkg_db_file))
+	opmode:set("pkg_db")
+	B.status_dump(reference)
+	assert_equal("r", stat(syscnf.pkg_db_file))
+	-- Database is used as long as status file is not modified
+	reference["New"] = {
+		Package = "New",
+		Version = "1",
+		Description = "Not stored in status file",
+		Status = {"install", "user", "installed"},
+		files = {},
+		ChangedFiles = {},
+	}
+	B.status_dump(reference)
+	local status = B.status_parse()
+	-- List of changed files is computed on first access
+	for _, pkg in pairs(status) do
+		assert_nil(rawget(pkg, "ChangedFiles"))
+		assert_table_equal({}, pkg.ChangedFiles)
+	end
+	assert_table_equal(reference, status)
+	-- Once it is modified it is parsed again
+	utils.write_file(syscnf.status_file, utils.read_file(syscnf.status_file) .. "\n")
+	status = B.status_parse()
+	assert_nil(status["New"].Description)
+	status["New"].Description = reference["New"].Description
+	assert_table_equal(reference, status)
+end
+
 function setup()
 	-- Use a shortened version of a real status file for tests
 	syscnf.status_file = datadir .. "/opkg/status"
 	syscnf.info_dir = datadir .. "/opkg/info/"
+	-- Never touch package database of host system
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	syscnf.pkg_db_file = dir .. "/pkgdb"
 end
 
 function teardown()
 	-- Clean up, return the original file name
 	syscnf.set_root_dir()
+	syscnf.pkg_db_file = nil
+	opmode:unset("pkg_db")
 	utils.cleanup_dirs(tmp_dirs)
 	tmp_dirs = {}
 end
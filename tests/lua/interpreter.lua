@@ -86,6 +86,20 @@ function test_fsutils()
 	assert_table_equal({["x"] = "r"}, ls(ldir))
 end
 
+function test_clone_write()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	utils.write_file(dir .. "/base", "hello world")
+	clone_write(dir .. "/new", dir .. "/base", 6, "there")
+	assert_equal("hello there", utils.read_file(dir .. "/new"))
+	assert_equal("hello world", utils.read_file(dir .. "/base"))
+	clone_write(dir .. "/new", dir .. "/base", 0, "")
+	assert_equal("", utils.read_file(dir .. "/new"))
+	-- Base file is shorter than offset
+	assert_error(function () clone_write(dir .. "/new", dir .. "/base", 12, "") end)
+	assert_error(function () clone_write(dir .. "/new", dir .. "/missing", 0, "") end)
+end
+
 -- Test setting the environment
 function test_env()
 	setenv("TEST_ENV", "42")
@@ -97,6 +111,29 @@ function test_hashes()
 	assert_equal("2cf24dba5fb0a30e26e83b2ac5b9e29e1b161e5c1fa7425e73043362938b9824", sha256("hello"))
 end
 
+function test_hashing_files()
+	local dir = mkdtemp()
+	table.insert(tmp_dirs, dir)
+	utils.write_file(dir .. "/hello", "hello")
+	utils.write_file(dir .. "/empty", "")
+	local hashes, errors = hashing.files({dir .. "/hello", dir .. "/empty", dir .. "/missing"}, {"md5", "sha256"})
+	assert_table_equal({
+		[dir .. "/hello"] = {md5 = md5("hello"), sha256 = sha256("hello"), size = 5},
+		[dir .. "/empty"] = {md5 = md5(""), sha256 = sha256(""), size = 0},
+	}, hashes)
+	assert_not_nil(errors[dir .. "/missing"])
+	hashes = hashing.files({dir .. "/hello"}, "sha256", 1)
+	assert_table_equal({[dir .. "/hello"] = {sha256 = sha256("hello"), size = 5}}, hashes)
+	-- Number of threads is capped
+	hashes = hashing.files({dir .. "/hello"}, "sha256", 100000)
+	assert_table_equal({[dir .. "/hello"] = {sha256 = sha256("hello"), size = 5}}, hashes)
+	assert_error(function () hashing.files({dir .. "/hello"}, "sha256", -1) end)
+	assert_equal(md5("hello"), md5_file(dir .. "/hello"))
+	assert_equal(sha256("hello"), sha256_file(dir .. "/hello"))
+	assert_error(function () md5_file(dir .. "/missing") end)
+	assert_error(function () hashing.files({dir .. "/hello"}, "sha1") end)
+end
+
 function teardown()
 	utils.cleanup_dirs(tmp_dirs)
 	tmp_dirs = {}
@@ -21,6 +21,7 @@ require 'lunit'
 
 local requests = require "requests"
 local postprocess = require "postprocess"
+local backend = require "backend"
 local utils = require "utils"
 local uri = require "uri"
 require "syscnf"
@@ -50,6 +51,7 @@ local example_output = {
 				Size = "2534",
 				Source = "package/network/ipv6/6in4",
 				Version = "21-2",
+				index_deps = {tp = "dep-and", sub = {"libc", "kmod-sit"}},
 				uri_raw = "file://" .. datadir .. "/repo/6in4_21-2_all.ipk"
 			},
 			["6rd"] = {
@@ -69,6 +71,7 @@ local example_output = {
 				Size = "4416",
 				Source = "package/network/ipv6/6rd",
 				Version = "9-2",
+				index_deps = {tp = "dep-and", sub = {"libc", "kmod-sit"}},
 				uri_raw = "file://" .. datadir .. "/repo/6rd_9-2_all.ipk"
 			}
 		},
@@ -88,6 +91,8 @@ local function assert_repos(index)
 	example_output["test1"].index = index
 	assert(requests.known_repositories["test1"].index_uri)
 	requests.known_repositories["test1"].index_uri = nil
+	assert(requests.known_repositories["test1"].mirrors)
+	requests.known_repositories["test1"].mirrors = nil
 	assert_table_equal(example_output, requests.known_repositories)
 end
 
@@ -101,6 +106,28 @@ function test_get_repos_gzip()
 	assert_repos("Packages.gz")
 end
 
+-- First mirror is not available so second one has to be used
+function test_get_repos_mirrors()
+	requests.repository({}, "test1", {"http://applications-test.turris.cz/missing", "file://" .. datadir .. "/repo"}, {index="Packages"})
+	assert_nil(postprocess.get_repos())
+	local repo = requests.known_repositories["test1"]
+	assert_equal("file://" .. datadir .. "/repo/Packages", repo.index_uri:uri())
+	assert_equal("parsed-repository", repo.tp)
+	assert_equal("file://" .. datadir .. "/repo/6in4_21-2_all.ipk", repo.content["6in4"].uri_raw)
+end
+
+-- Postprocessing accesses only fields needed for planning so rest of package is
+-- not decoded
+function test_run_lazy()
+	requests.repository({}, "test1", "file://" .. datadir .. "/repo", {index="Packages"})
+	postprocess.run()
+	local pkg = requests.known_repositories["test1"].content["6in4"]
+	assert_table(pkg.deps)
+	assert_nil(rawget(pkg, "Description"))
+	assert_equal("GPL-2.0", pkg.License)
+	assert_not_nil(rawget(pkg, "Description"))
+end
+
 local multierror = utils.exception("multiple", "Multiple exceptions (1)")
 local sub_err = utils.exception("unreachable", "Fake network is down")
 sub_err.why = "missing"
@@ -121,6 +148,7 @@ function test_get_repos_broken_nonfatal()
 	requests.repository({}, "test1", "http://applications-test.turris.cz/missing", {optional = true})
 	assert_nil(postprocess.get_repos())
 	requests.known_repositories["test1"].index_uri = nil
+	requests.known_repositories["test1"].mirrors = nil
 	assert_table_equal({
 		["test1"] = {
 			optional = true,
@@ -134,6 +162,42 @@ function test_get_repos_broken_nonfatal()
 	}, requests.known_repositories)
 end
 
+function test_index_deps_shared()
+	local pkg1 = {Package = "pkg1", Depends = "libc, kmod-sit", Conflicts = "pkg3"}
+	local pkg2 = {Package = "pkg2", Depends = "libc, kmod-sit", Conflicts = "pkg3"}
+	local deps = postprocess.index_deps(pkg1)
+	assert_table_equal({tp = "dep-and", sub = {"libc", "kmod-sit",
+		{tp = "dep-not", sub = {{tp = "dep-package", name = "pkg3", version = "~.*"}}}}}, deps)
+	assert_equal(deps, postprocess.index_deps(pkg2))
+	assert_not_equal(deps, postprocess.index_deps({Depends = "libc, kmod-sit"}))
+	assert_nil(postprocess.index_deps({Package = "pkg4"}))
+end
+
+function test_index_snapshot()
+	local test_dir = mkdtemp()
+	local snap = test_dir .. "/Packages.snap"
+	local list = backend.repo_parse(utils.read_file(datadir .. "/repo/Packages"))
+	for _, pkg in pairs(list) do
+		pkg.index_deps = postprocess.index_deps(pkg)
+	end
+	assert_true(snapshot.write(snap, "key", list))
+	assert_nil(snapshot.load(snap, "other-key"))
+	assert_nil(snapshot.load(test_dir .. "/missing.snap", "key"))
+	local loaded = snapshot.load(snap, "key")
+	-- Only fields needed for planning are decoded before first access
+	assert_equal("6in4", rawget(loaded["6in4"], "Package"))
+	assert_nil(rawget(loaded["6in4"], "Description"))
+	-- Keys that are not fields in index do not decode the rest of package
+	assert_nil(loaded["6in4"].deps)
+	assert_nil(loaded["6in4"].Missing)
+	assert_nil(rawget(loaded["6in4"], "Description"))
+	assert_equal("GPL-2.0", loaded["6in4"].License)
+	assert_not_nil(rawget(loaded["6in4"], "Description"))
+	assert_nil(loaded["6in4"].Missing)
+	assert_table_equal(list, loaded)
+	utils.cleanup_dirs({test_dir})
+end
+
 -- Default values for package modifiers to be added if they are not mentioned
 local modifier_def = {
 	tp = "package",
@@ -59,9 +59,15 @@ function test_repository()
 	]], "test_repository_chunk", "Restricted")
 	assert_equal("context", result.tp, result.msg)
 
+	-- Index is in subdirectory but packages are relative to repository URI
+	local sub = requests.known_repositories["test-repo-2-a"]
+	assert_equal('http://example.org/repo-2', sub.mirrors[1].repo_uri)
+	assert_equal('http://example.org/repo-2/a/Packages', sub.index_uri:uri())
 	for _, repo in pairs(requests.known_repositories) do
 		assert(repo.index_uri)
 		repo.index_uri = nil
+		assert_equal(1, #repo.mirrors)
+		repo.mirrors = nil
 	end
 	assert_table_equal({
 		["test-repo"] = {
@@ -210,6 +216,51 @@ function test_script_err_propagate()
 	assert_equal("error", err.tp)
 end
 
+function test_repository_mirrors()
+	local result = sandbox.run_sandboxed([[
+		Repository('test-repo', {'http://example.org/repo', 'http://mirror.example.org/repo'})
+	]], "test_repository_mirrors_chunk", "Restricted")
+	assert_equal("context", result.tp, result.msg)
+	local repo = requests.known_repositories["test-repo"]
+	assert_table_equal({'http://example.org/repo', 'http://mirror.example.org/repo'}, repo.repo_uri)
+	assert_equal(2, #repo.mirrors)
+	assert_equal('http://example.org/repo', repo.mirrors[1].repo_uri)
+	assert_equal('http://example.org/repo/Packages', repo.mirrors[1].index_uri:uri())
+	assert_equal('http://mirror.example.org/repo', repo.mirrors[2].repo_uri)
+	assert_equal('http://mirror.example.org/repo/Packages', repo.mirrors[2].index_uri:uri())
+	assert_equal(repo.mirrors[1].index_uri, repo.index_uri)
+	local err = sandbox.run_sandboxed([[
+		Repository('test-repo-invalid', {})
+	]], "test_repository_mirrors_invalid_chunk", "Restricted")
+	assert_equal("bad value", err.tp)
+end
+
+function test_downloads()
+	local limit = uri.download_limits()
+	local err = sandbox.run_sandboxed([[
+		Downloads({total = 4, per_host = 2})
+	]], "test_downloads_chunk", "Restricted")
+	assert_equal("context", err.tp, err.msg)
+	assert_equal(4, uri.download_limits())
+	err = sandbox.run_sandboxed([[
+		Downloads({total = 6, adaptive = true})
+	]], "test_downloads_adaptive_chunk", "Restricted")
+	assert_equal("context", err.tp, err.msg)
+	assert_equal(3, uri.download_limits()) -- Adaptive mode starts in middle
+	err = sandbox.run_sandboxed([[
+		Downloads({adaptive = true})
+	]], "test_downloads_preserve_chunk", "Restricted")
+	assert_equal("context", err.tp, err.msg)
+	assert_equal(3, uri.download_limits()) -- Configured total is preserved not the adapted one
+	err = sandbox.run_sandboxed([[
+		Downloads({total = 0})
+	]], "test_downloads_invalid_chunk", "Restricted")
+	assert_table(err)
+	assert_equal("bad value", err.tp)
+	err = sandbox.run_sandboxed("Downloads({total = " .. tostring(limit) .. "})", "test_downloads_restore_chunk", "Restricted")
+	assert_equal("context", err.tp, err.msg)
+end
+
 -- If someone wants to actually download the mock URI object, return an empty document
 local uri_meta = {}
 function uri_meta:__index(key)
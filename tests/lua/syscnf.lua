@@ -32,6 +32,10 @@ function test_set_root_dir()
 	assert_equal("/dir/usr/share/updater/unpacked/", sc.pkg_unpacked_dir)
 	assert_equal("/dir/usr/share/updater/download/", sc.pkg_download_dir)
 	assert_equal("/dir/usr/share/updater/collided/", sc.opkg_collided_dir)
+	assert_equal("/dir/usr/share/updater/index-cache/", sc.index_cache_dir)
+	assert_equal("/dir/usr/share/updater/pkg-cache/", sc.pkg_cache_dir)
+	assert_equal("/dir/usr/share/updater/file-hashes", sc.file_hash_cache)
+	assert_equal("/dir/usr/share/updater/pkgdb", sc.pkg_db_file)
 end
 
 function test_os_release()
@@ -83,6 +83,14 @@ local function outro(cleanup_dirs, status)
 			f = "journal.finish",
 			p = {}
 		},
+		{
+			f = "backend.pkg_cache_commit",
+			p = {}
+		},
+		{
+			f = "backend.file_hashes_store",
+			p = {}
+		},
 		{
 			f = "backend.run_state.release",
 			p = {}
@@ -126,6 +134,9 @@ local function mocks_install()
 	mock_gen("backend.control_cleanup")
 	mock_gen("backend.pkg_merge_control")
 	mock_gen("backend.status_dump")
+	mock_gen("backend.pkg_cache_commit")
+	mock_gen("backend.file_hashes_store")
+	mock_gen("backend.status_load")
 	mock_gen("backend.script_run", function (pkgname, suffix)
 		if suffix == "postinst" then
 			return false, 1, "Fake failed postinst"
@@ -169,6 +180,10 @@ function test_perform_empty()
 			f = "journal.write",
 			p = {journal.CHANGELOG_START}
 		},
+		{
+			f = "backend.status_load",
+			p = {test_status, {}}
+		},
 		{
 			f = "journal.write",
 			p = {journal.MOVED, test_status, {}, {}, {}}
@@ -277,6 +292,10 @@ function test_perform_ok()
 			f = "journal.write",
 			p = {journal.CHANGELOG_START}
 		},
+		{
+			f = "backend.status_load",
+			p = {test_status, {["pkg-name"] = true}}
+		},
 		{
 			f = "backend.pkg_merge_control",
 			p = {"pkg_dir/control", "pkg-name", {f = true}}
@@ -20,6 +20,9 @@ along with Updater.  If not, see <http://www.gnu.org/licenses/>.
 require 'lunit'
 local updater = require "updater"
 local utils = require "utils"
+local uri = require "uri"
+local backend = require "backend"
+local transaction = require "transaction"
 local table = table
 
 syscnf.set_root_dir()
@@ -171,3 +174,56 @@ function test_approval_hash()
 		{'remove', 'pkg2'}
 	}))
 end
+
+-- Deltas are applied by zstd utility so this test is skipped if it is not available
+local zstd_available = os.execute("zstd --version >/dev/null 2>&1") == 0
+
+-- Package is rebuilt from delta against cached package of installed version
+function test_tasks_to_transaction_delta()
+	if not zstd_available then return end
+	local test_root = mkdtemp()
+	syscnf.set_root_dir(test_root)
+	local base_sum = verify_task.package.SHA256sum
+	local result_sum = "dfe474a7bf0e83e1f810f54375ef98b2e9fd48ef90ccc21544274d0d4b1f031c"
+	backend.pkg_cache_store(datadir .. "/repo/updater.ipk", base_sum)
+	backend.pkg_cache_commit()
+	local queued = {}
+	local queue_install_downloaded = transaction.queue_install_downloaded
+	transaction.queue_install_downloaded = function (file, name, version)
+		table.insert(queued, {name = name, version = version, sum = sha256_file(file)})
+	end
+	opmode:set("delta_update")
+	updater.tasks = {{
+		action = "require",
+		name = "updater",
+		installed_version = "1",
+		modifier = {},
+		package = {
+			Version = "2",
+			Filename = "missing.ipk", -- Whole package is not available so delta has to be used
+			SHA256sum = result_sum,
+			Deltas = "0 0000 ../delta/missing.zst, 1 " .. base_sum .. " ../delta/updater.ipk.zst",
+			repo = {
+				index_uri = uri.new():to_buffer("file://" .. datadir .. "/repo/Packages"),
+				pkg_hash_required = true
+			}
+		}
+	}}
+	local ok, err = pcall(updater.tasks_to_transaction)
+	opmode:unset("delta_update")
+	transaction.queue_install_downloaded = queue_install_downloaded
+	updater.tasks = {}
+	assert_true(ok, tostring(err and (err.msg or err)))
+	assert_table_equal({{name = "updater", version = "2", sum = result_sum}}, queued)
+	-- Rebuilt package is added to cache only once transaction is committed
+	local cache = test_root .. "/usr/share/updater/pkg-cache/"
+	assert_table_equal({
+		[base_sum .. ".ipk"] = "r",
+		[result_sum .. ".ipk.staged"] = "r",
+	}, ls(cache))
+	backend.pkg_cache_commit()
+	assert_equal(cache .. result_sum .. ".ipk", backend.pkg_cache_get(result_sum))
+	assert_equal(cache .. base_sum .. ".ipk", backend.pkg_cache_get(base_sum))
+	syscnf.set_root_dir()
+	utils.cleanup_dirs({test_root})
+end
@@ -115,6 +115,116 @@ function test_cert_no_verify()
 	assert_equal(lorem_ipsum, dt)
 end
 
+function test_hash()
+	local master = uri.new()
+	local u = master:to_buffer("data:,Hello!")
+	u:set_hash(true)
+	u:finish()
+	assert_equal("952d2c56d0485958336747bcdd98590d", u:md5())
+	assert_equal("334d016f755cd6dc58c53a86e183882f8ec14f52fb05345887c8a5edd42c87b7", u:sha256())
+end
+
+function test_hash_disabled()
+	local master = uri.new()
+	local u = master:to_buffer("data:,Hello!")
+	u:finish()
+	assert_nil(u:md5())
+	assert_nil(u:sha256())
+end
+
+function test_hash_https()
+	local master = uri.new()
+	local u = master:to_buffer(https_lorem_ipsum)
+	u:set_hash(true)
+	master:download()
+	assert_equal(lorem_ipsum, u:finish())
+	assert_equal("3bc34a45d26784b5bea8529db533ae84", u:md5())
+	assert_equal("25623b53e0984428da972f4c635706d32d01ec92dcd2ab39066082e0b9488c9d", u:sha256())
+end
+
+function test_race()
+	local master = uri.new()
+	local u1 = master:to_buffer(https_lorem_ipsum)
+	local u2 = master:to_buffer(https_lorem_ipsum)
+	local missing = master:to_buffer("https://applications-test.turris.cz/missing")
+	u2:race_join(u1)
+	missing:race_join(u1)
+	assert_nil(master:download())
+	assert_false(missing:race_won())
+	local winner = u1:race_won() and u1 or u2
+	local loser = u1:race_won() and u2 or u1
+	assert_true(winner:race_won())
+	assert_false(loser:race_won())
+	assert_equal(lorem_ipsum, winner:finish())
+end
+
+function test_race_all_failed()
+	local master = uri.new()
+	local u1 = master:to_buffer("https://applications-test.turris.cz/missing")
+	local u2 = master:to_buffer("https://applications-test.turris.cz/missing2")
+	u2:race_join(u1)
+	local failed = master:download()
+	assert_not_nil(failed)
+	assert_false(failed:is_cancelled())
+	assert_false(u1:race_won())
+	assert_false(u2:race_won())
+end
+
+function test_download_stats()
+	local master = uri.new()
+	local u = master:to_buffer(https_lorem_ipsum)
+	assert_nil(u:download_stats())
+	master:download()
+	u:finish()
+	local stats = u:download_stats()
+	assert_equal(#lorem_ipsum, stats.size)
+	assert_true(stats.connect_time > 0)
+	assert_true(stats.tls_time >= stats.connect_time)
+	assert_true(stats.first_byte_time >= stats.tls_time)
+	assert_true(stats.total_time >= stats.first_byte_time)
+	assert_true(math.abs(stats.finish - stats.start - stats.total_time) < 0.001)
+	assert_nil(master:to_buffer("data:,Hello!"):download_stats())
+end
+
+-- Downloader is shared so download of one master can finish URIs of other one
+function test_download_other_master_failed()
+	local master1 = uri.new()
+	local master2 = uri.new()
+	local missing1 = master2:to_buffer("https://applications-test.turris.cz/missing")
+	local missing2 = master2:to_buffer("https://applications-test.turris.cz/missing2")
+	local failed = master2:download()
+	assert_true(failed == missing1 or failed == missing2)
+	local u = master1:to_buffer(https_lorem_ipsum)
+	assert_nil(master1:download())
+	assert_equal(lorem_ipsum, u:finish())
+	-- Second failure has to be reported to its master
+	assert_equal(failed == missing1 and missing2 or missing1, master2:download())
+	assert_nil(master2:download())
+end
+
+function test_download_other_master_notify()
+	local master1 = uri.new()
+	local master2 = uri.new()
+	local notify1 = master2:to_buffer(https_lorem_ipsum)
+	notify1:set_notify(true)
+	local notify2 = master2:to_buffer(https_lorem_ipsum .. "?second")
+	notify2:set_notify(true)
+	local first, finished = master2:download()
+	assert_true(finished)
+	assert_true(first == notify1 or first == notify2)
+	local u = master1:to_buffer(https_lorem_ipsum)
+	assert_nil(master1:download())
+	assert_equal(lorem_ipsum, u:finish())
+	-- Second notification has to be reported to its master
+	local second
+	second, finished = master2:download()
+	assert_true(finished)
+	assert_equal(first == notify1 and notify2 or notify1, second)
+	assert_nil(master2:download())
+	assert_equal(lorem_ipsum, notify1:finish())
+	assert_equal(lorem_ipsum, notify2:finish())
+end
+
 -- This is valid usage so test that it is possible
 function test_add_nil()
 	local master = uri.new()